@@ -0,0 +1,44 @@
+#ifndef __CG_ARENA_STATS_H__
+#define __CG_ARENA_STATS_H__
+
+#include "cg_memory_arena.h"
+
+#define MAX_REGISTERED_ARENA_COUNT 16
+#define ARENA_STATS_HISTORY_SIZE 256    // Frames kept per arena, a power of two
+
+// What an arena went through since the previous sample
+struct ArenaFrameStats {
+    u64 peak_usage;
+    u32 allocation_count;
+    u32 overflow_count;
+};
+
+struct ArenaStatsEntry {
+    const char* name;
+    MemoryArena* arena;
+    
+    ArenaFrameStats history[ARENA_STATS_HISTORY_SIZE];
+    u64 max_peak_usage;          // Highest frame peak since registration
+    u64 total_overflow_count;
+    u64 total_allocation_count;
+};
+
+// Named arenas sampled once per frame. The history of every entry is a ring written at the same
+// index, the sample of frame n is at n % ARENA_STATS_HISTORY_SIZE. Sampling reads the counters of
+// the arenas without locking, so it must happen on the thread allocating from them.
+struct ArenaRegistry {
+    ArenaStatsEntry entries[MAX_REGISTERED_ARENA_COUNT];
+    u32 entry_count;
+    
+    u64 frame_count;             // Samples recorded so far
+};
+
+bool register_arena(ArenaRegistry* registry, MemoryArena* arena, const char* name);
+void unregister_arena(ArenaRegistry* registry, MemoryArena* arena);
+void record_arena_stats(ArenaRegistry* registry);
+
+u32 get_arena_history_size(ArenaRegistry* registry);
+ArenaFrameStats* get_arena_frame_stats(ArenaRegistry* registry, ArenaStatsEntry* entry, u32 frames_ago);
+void dump_arena_report(ArenaRegistry* registry);
+
+#endif //CG_ARENA_STATS_H
@@ -0,0 +1,65 @@
+#ifndef __BUFFER_SUBALLOCATOR_H__
+#define __BUFFER_SUBALLOCATOR_H__
+
+#include <vulkan/vulkan.h>
+
+#include "cg_memory.h"
+
+#define MAX_SUBALLOCATOR_BLOCK_COUNT 32
+
+// Part of a block handed out to a user. The block is referenced by index because its VkBuffer can
+// be replaced when the defragmenter moves it.
+struct BufferRange {
+    u32 block_index;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+};
+
+struct BufferFreeRange {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+};
+
+// One VkBuffer with its own allocation, shared by many small ranges. Free ranges are kept sorted by
+// offset and neighbours are merged when a range is released.
+struct SuballocatorBlock {
+    VkBuffer buffer;
+    AllocatedMemoryChunk allocation;
+    VkDeviceSize size;
+    VkDeviceSize free_size;
+    
+    BufferFreeRange* free_ranges;
+    u32 free_range_count;
+    u32 free_range_capacity;
+};
+
+// Carves ranges out of a few large buffers instead of creating a buffer per resource. Range sizes
+// are rounded up to the alignment, so every offset is a multiple of it.
+struct BufferSuballocator {
+    SuballocatorBlock blocks[MAX_SUBALLOCATOR_BLOCK_COUNT];
+    u32 block_count;
+    
+    VkDeviceSize block_size;
+    VkDeviceSize alignment;
+    VkBufferUsageFlags usage;
+    VkMemoryPropertyFlags memory_flags;
+    VkMemoryPropertyFlags preferred_flags;
+    MemoryTag tag;
+    u32 queue_family_index;
+    
+    u64 range_count;
+    VkDeviceSize used_size;
+};
+
+bool init_buffer_suballocator(BufferSuballocator* suballocator, VkDeviceSize block_size, VkDeviceSize alignment, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_flags, VkMemoryPropertyFlags preferred_flags, MemoryTag tag, u32 queue_family_index);
+void destroy_buffer_suballocator(BufferSuballocator* suballocator, MemoryManager* manager, VkDevice device, bool verbose = false);
+
+bool add_suballocator_block(BufferSuballocator* suballocator, MemoryManager* manager, VkDevice device, VkDeviceSize min_size, u32* block_index);
+bool take_block_range(SuballocatorBlock* block, VkDeviceSize size, VkDeviceSize* offset);
+bool release_block_range(SuballocatorBlock* block, VkDeviceSize offset, VkDeviceSize size);
+
+bool suballocate(BufferSuballocator* suballocator, MemoryManager* manager, VkDevice device, VkDeviceSize size, BufferRange* range);
+void free_suballocation(BufferSuballocator* suballocator, BufferRange* range);
+void* get_suballocation_data(BufferSuballocator* suballocator, BufferRange* range);
+
+#endif
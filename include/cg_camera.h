@@ -1,6 +1,7 @@
 #ifndef __CAMERA_H__
 #define __CAMERA_H__
 
+#include "cg_dirty_buffer.h"
 #include "cg_math.h"
 #include "cg_memory.h"
 
@@ -13,9 +14,10 @@ struct CameraContext {
 };
 
 struct CameraResources {
-    VkDescriptorSet* descriptor_sets;
-    VkBuffer* buffers;
-    AllocatedMemoryChunk* allocations;
+    VkDescriptorSet descriptor_set;
+    DirtyBuffer buffer;             // One context per frame in flight, only rewritten when the camera moved
+    CameraContext uploaded_context; // Last context marked dirty
+    u32 offset;                     // Dynamic offset of this frame copy of the context
 };
 
 struct Camera {
@@ -0,0 +1,64 @@
+#ifndef __CG_COMMAND_RECORDER_H__
+#define __CG_COMMAND_RECORDER_H__
+
+#include <pthread.h>
+#include <vulkan/vulkan.h>
+
+#define MAX_RECORD_THREAD_COUNT 8           // Including the thread asking for the recording
+#define MAX_RECORD_SLOT_COUNT 8             // One per frame in flight
+#define MAX_RECORD_BUFFERS_PER_SLOT 4       // Secondary command buffers a thread records per slot
+
+// Records items [first, first + count) of a job into a secondary command buffer that has already begun
+typedef void (*RecordFunction)(VkCommandBuffer command_buffer, void* user_data, u32 first, u32 count);
+
+// Command pools can only be used by one thread at a time, every thread owns one per slot. A slot is
+// reset as a whole when it is reused, once the frame that used it last has completed.
+struct RecordThreadSlot {
+    VkCommandPool command_pool;
+    VkCommandBuffer command_buffers[MAX_RECORD_BUFFERS_PER_SLOT];
+    u32 allocated_count;
+    u32 used_count;
+};
+
+struct CommandRecorder;
+
+struct RecordThread {
+    CommandRecorder* recorder;
+    pthread_t thread;
+    u32 index;
+    RecordThreadSlot slots[MAX_RECORD_SLOT_COUNT];
+    
+    u32 first_item;
+    u32 item_count;
+    VkCommandBuffer command_buffer;
+    bool succeeded;
+};
+
+// Thread 0 is the caller, the others wait for jobs. Items of a job are split in contiguous ranges,
+// one per thread, and the secondary command buffers come back in the order of their items.
+struct CommandRecorder {
+    VkDevice device;
+    RecordThread threads[MAX_RECORD_THREAD_COUNT];
+    u32 thread_count;
+    u32 current_slot;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;
+    pthread_cond_t job_done;
+    u64 job_generation;
+    u32 pending_thread_count;
+    bool quit;
+    
+    RecordFunction function;
+    void* user_data;
+    VkCommandBufferInheritanceInfo inheritance;
+    u32 job_thread_count;
+};
+
+bool init_command_recorder(CommandRecorder* recorder, VkDevice device, u32 queue_family_index, u32 thread_count);
+void destroy_command_recorder(CommandRecorder* recorder, bool verbose = false);
+
+bool begin_record_slot(CommandRecorder* recorder, u32 slot);
+bool record_secondary_command_buffers(CommandRecorder* recorder, VkCommandBufferInheritanceInfo* inheritance, RecordFunction function, void* user_data, u32 item_count, u32 thread_count, VkCommandBuffer* command_buffers, u32* command_buffer_count);
+
+#endif //CG_COMMAND_RECORDER_H
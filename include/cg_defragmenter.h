@@ -0,0 +1,79 @@
+#ifndef __DEFRAGMENTER_H__
+#define __DEFRAGMENTER_H__
+
+#include <vulkan/vulkan.h>
+
+#include "cg_memory.h"
+
+#define MAX_DEFRAG_BUFFER_COUNT 1024
+#define MAX_DEFRAG_MOVE_COUNT 64
+#define MAX_DEFRAG_RETIRED_COUNT 256
+#define DEFRAG_MAX_BYTES_PER_PASS MB(16)
+#define DEFRAG_VICTIM_MAX_OCCUPANCY 0.5f
+#define DEFRAG_FRAME_BUDGET_NS 500000
+
+struct RendererState;
+
+// A buffer the defragmenter is allowed to move. The buffer handle and its allocation are owned by
+// someone else and get updated in place once the copy to the new location is done, so they
+// must stay at the same address for as long as the buffer is registered.
+struct DefragBuffer {
+    VkBuffer* buffer;
+    AllocatedMemoryChunk* allocation;
+    VkDeviceSize size;
+    VkBufferUsageFlags usage;
+    VkMemoryPropertyFlags memory_flags;
+};
+
+struct DefragMove {
+    u32 buffer_index;
+    VkBuffer new_buffer;
+    AllocatedMemoryChunk new_allocation;
+};
+
+// Old buffers can still be used by frames in flight after a move, they are released later.
+struct DefragRetiredBuffer {
+    VkBuffer buffer;
+    AllocatedMemoryChunk allocation;
+    u64 release_frame;
+};
+
+struct DefragStatistics {
+    u64 pass_count;
+    u64 moved_buffer_count;
+    u64 moved_size;
+    u64 released_pool_count;
+};
+
+struct Defragmenter {
+    DefragBuffer buffers[MAX_DEFRAG_BUFFER_COUNT];
+    u32 buffer_count;
+    
+    // Moves of the pass currently executed by the GPU
+    DefragMove moves[MAX_DEFRAG_MOVE_COUNT];
+    u32 move_count;
+    
+    DefragRetiredBuffer retired[MAX_DEFRAG_RETIRED_COUNT];
+    u32 retired_count;
+    
+    VkCommandPool command_pool;
+    VkCommandBuffer command_buffer;
+    VkFence fence;
+    bool pass_in_flight;
+    
+    u64 frame_index;
+    u8* occupancy;
+    
+    DefragStatistics statistics;
+};
+
+bool init_defragmenter(Defragmenter* defragmenter, RendererState* state);
+void destroy_defragmenter(Defragmenter* defragmenter, RendererState* state, bool verbose = false);
+
+bool register_defrag_buffer(Defragmenter* defragmenter, VkBuffer* buffer, AllocatedMemoryChunk* allocation, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_flags);
+void unregister_defrag_buffer(Defragmenter* defragmenter, RendererState* state, VkBuffer* buffer);
+bool wait_for_defrag_buffer(Defragmenter* defragmenter, RendererState* state, VkBuffer* buffer);
+
+bool update_defragmenter(Defragmenter* defragmenter, RendererState* state, u64 budget_ns);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef __DIRTY_BUFFER_H__
+#define __DIRTY_BUFFER_H__
+
+#include <vulkan/vulkan.h>
+
+#include "cg_memory.h"
+
+// One bit per element and per copy. A change is marked in every copy at once, a copy clears its
+// bits when the elements are written to it.
+struct DirtyTracker {
+    u64* bits;               // copy_count rows of word_count words
+    u32 word_count;
+    u32 copy_count;
+    u32 element_capacity;
+};
+
+struct DirtyUploadStats {
+    u32 span_count;
+    u32 element_count;
+};
+
+// Persistently mapped buffer holding one copy of an array per frame in flight. Only the elements
+// changed since a copy was last written are copied to it, merged into contiguous spans, so data
+// that does not change costs nothing after its first upload.
+struct DirtyBuffer {
+    VkBuffer buffer;
+    AllocatedMemoryChunk allocation;
+    
+    VkDeviceSize element_size;
+    VkDeviceSize copy_size;  // Rounded up to the alignment given at creation
+    
+    DirtyTracker tracker;
+    DirtyUploadStats last_upload;
+};
+
+bool init_dirty_tracker(DirtyTracker* tracker, u32 element_capacity, u32 copy_count);
+void destroy_dirty_tracker(DirtyTracker* tracker);
+
+void mark_dirty(DirtyTracker* tracker, u32 first, u32 count);
+void mark_dirty_bits(DirtyTracker* tracker, const u64* bits, u32 element_count);
+u32 mark_changed_elements(DirtyTracker* tracker, void* shadow, const void* source, VkDeviceSize element_size, u32 element_count);
+DirtyUploadStats upload_dirty_elements(DirtyTracker* tracker, u32 copy, const void* source, void* destination, VkDeviceSize element_size, u32 element_count);
+
+bool init_dirty_buffer(DirtyBuffer* buffer, MemoryManager* manager, VkDevice device, VkDeviceSize element_size, u32 element_capacity, u32 copy_count, VkDeviceSize alignment, VkBufferUsageFlags usage, MemoryTag tag, u32 queue_family_index);
+void destroy_dirty_buffer(DirtyBuffer* buffer, MemoryManager* manager, VkDevice device, bool verbose = false);
+
+bool upload_dirty_buffer(DirtyBuffer* buffer, u32 copy, const void* source, u32 element_count);
+VkDeviceSize get_dirty_copy_offset(DirtyBuffer* buffer, u32 copy);
+
+#endif
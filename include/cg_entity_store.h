@@ -0,0 +1,64 @@
+#ifndef __CG_ENTITY_STORE_H__
+#define __CG_ENTITY_STORE_H__
+
+#include "cg_math.h"
+#include "cg_vertex.h"
+
+#define ENTITY_INVALID_INDEX 0xFFFFFFFF
+
+// Slot and generation, a handle goes stale when its entity is removed and the slot reused
+struct EntityHandle {
+    u32 slot;
+    u32 generation;
+};
+
+// Uploaded as is to the entity transform buffer, one per entity
+struct EntityTransformData {
+    Mat4f model_matrix;
+    Mat4f normal_matrix;
+};
+
+// Bounding sphere in model space
+struct EntityBounds {
+    Vec3f center;
+    f32 radius;
+};
+
+// Entities are packed at the start of parallel arrays, so that per frame loops go through memory
+// in order. Removing an entity moves the last one in its place. Handles go through a slot table to
+// find the current index, free slots are chained through it.
+struct EntityStore {
+    EntityTransformData* transforms;
+    EntityBounds* bounds;
+    f32* sphere_x;               // World space bounding spheres, one component per array for culling
+    f32* sphere_y;
+    f32* sphere_z;
+    f32* sphere_radius;
+    u32* meshes;                 // Index in the mesh registry
+    u32* slots;                  // Slot of the entity at each index
+    u64* dirty_bits;             // One per index, set when the transform at this index changed
+    u32 count;
+    u32 capacity;
+    
+    u32* indices;                // Index of the entity of each slot, next free slot when free
+    u32* generations;
+    u32 slot_count;
+    u32 free_slot;
+};
+
+bool init_entity_store(EntityStore* store, u32 capacity);
+void destroy_entity_store(EntityStore* store, bool verbose = false);
+bool grow_entity_store(EntityStore* store, u32 capacity);
+
+bool add_entity(EntityStore* store, EntityHandle* handle);
+bool remove_entity(EntityStore* store, EntityHandle handle);
+u32 get_entity_index(EntityStore* store, EntityHandle handle);
+bool is_entity_alive(EntityStore* store, EntityHandle handle);
+
+void set_entity_transform(EntityStore* store, u32 index, Mat4f model_matrix);
+void set_entity_bounds(EntityStore* store, u32 index, EntityBounds bounds);
+void update_entity_sphere(EntityStore* store, u32 index);
+void clear_entity_dirty_bits(EntityStore* store);
+EntityBounds compute_entity_bounds(Vertex* vertices, u32 vertex_count);
+
+#endif //CG_ENTITY_STORE_H
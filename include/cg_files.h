@@ -1,7 +1,16 @@
 #ifndef __CG_FILES_H__
 #define __CG_FILES_H__
 
+// Read only view of a whole file, pages are read by the system as they are touched
+struct MappedFile {
+    u8* data;
+    u64 size;
+};
+
 u32 get_file_size(FILE* file);
-void copy_file_to(FILE* file, u8* dest, u32 file_size = 0);
+bool copy_file_to(FILE* file, u8* dest, u32 file_size = 0);
+
+bool map_file(const char* filename, MappedFile* file);
+void unmap_file(MappedFile* file);
 
 #endif //CG_FILES_H
@@ -6,10 +6,12 @@
 #include "stb_rect_pack.h"
 #include "stb_truetype.h"
 #include "cg_memory_arena.h"
+#include "cg_pool_allocator.h"
 #include "cg_texture.h"
 #include "cg_string.h"
 
 #define FONT_ATLAS_SIZE 512
+#define MAX_FONT_COUNT 64
 
 struct Font {
     stbtt_fontinfo font_info;
@@ -25,6 +27,8 @@ struct FontEntry {
 struct FontCatalog {
     FontEntry** entries;
     u32 size;
+    
+    PoolAllocator entry_allocator; // Entries stay next to each other for the bucket walks
 };
 
 struct Glyph {
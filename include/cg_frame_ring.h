@@ -0,0 +1,38 @@
+#ifndef __FRAME_RING_H__
+#define __FRAME_RING_H__
+
+#include <vulkan/vulkan.h>
+
+#include "cg_memory.h"
+
+#define MAX_FRAME_RING_SLOT_COUNT 8
+
+// Transient per-frame data (camera, transforms, gui vertices) is written into a single persistently
+// mapped buffer used as a ring. head and tail are running totals of bytes handed out and reclaimed,
+// the position in the buffer is obtained modulo its size. Each frame slot remembers where the head
+// was at the end of its frame so that everything up to there can be reclaimed once its fence signaled.
+struct FrameRingAllocator {
+    VkBuffer buffer;
+    AllocatedMemoryChunk allocation;
+    
+    VkDeviceSize size;
+    VkDeviceSize alignment;
+    
+    u64 head;
+    u64 tail;
+    u64 frame_end[MAX_FRAME_RING_SLOT_COUNT];
+    u32 current_slot;
+};
+
+struct FrameRingSlice {
+    VkDeviceSize offset;
+    void* data;
+};
+
+bool init_frame_ring_allocator(FrameRingAllocator* ring, MemoryManager* manager, VkDevice device, VkDeviceSize size, VkDeviceSize alignment, VkBufferUsageFlags usage, u32 queue_family_index);
+void destroy_frame_ring_allocator(FrameRingAllocator* ring, MemoryManager* manager, VkDevice device, bool verbose = false);
+
+void begin_frame_ring(FrameRingAllocator* ring, u32 slot);
+bool frame_ring_allocate(FrameRingAllocator* ring, VkDeviceSize size, FrameRingSlice* slice);
+
+#endif
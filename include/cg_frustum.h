@@ -0,0 +1,19 @@
+#ifndef __CG_FRUSTUM_H__
+#define __CG_FRUSTUM_H__
+
+#include "cg_math.h"
+
+#define FRUSTUM_PLANE_COUNT 6
+
+// Planes with normalized normals pointing inside, a point p is inside a plane when
+// dot(plane.xyz, p) + plane.w >= 0
+struct Frustum {
+    Vec4f planes[FRUSTUM_PLANE_COUNT];
+};
+
+Frustum extract_frustum(Mat4f* view_projection);
+
+u32 cull_spheres(Frustum* frustum, f32* x, f32* y, f32* z, f32* radius, u32 count, u8* visibility);
+u32 cull_spheres_scalar(Frustum* frustum, f32* x, f32* y, f32* z, f32* radius, u32 count, u8* visibility);
+
+#endif //CG_FRUSTUM_H
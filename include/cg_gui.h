@@ -5,6 +5,7 @@
 #include <GLFW/glfw3.h>
 #include <vulkan/vulkan.h>
 
+#include "cg_dirty_buffer.h"
 #include "cg_input.h"
 #include "cg_math.h"
 #include "cg_memory.h"
@@ -42,8 +43,9 @@ struct GuiResources {
     VkPipelineLayout pipeline_layout;
     VkPipeline pipeline;
     VkDescriptorSetLayout descriptor_set_layout;
-    VkBuffer* buffers;
-    AllocatedMemoryChunk* allocations;
+    DirtyBuffer vertex_buffer;      // One copy per frame in flight, only the vertices that changed are written
+    GuiVertex* uploaded_vertices;   // Vertices last marked dirty
+    VkDeviceSize vertex_offset;     // Offset of this frame copy of the vertices
     
     u32 font_atlas_slot_count;
     
@@ -76,10 +78,8 @@ enum TextAnchor {
 bool create_gui_descriptor_set_layout(GuiResources* resources, RendererState* state);
 bool create_gui_pipeline_layout(GuiResources* resources, RendererState* state);
 bool create_gui_pipeline(GuiResources* resources, RendererState* state);
-bool create_gui_buffers(GuiResources* resources, RendererState* state, MemoryArena* storage);
 bool init_gui_resources(GuiResources* resources, RendererState* state);
 
-void destroy_gui_buffers(GuiResources* resources, RendererState* state, bool verbose = false);
 void destroy_gui_pipeline(GuiResources* resources, RendererState* state, bool verbose = false);
 void destroy_gui_pipeline_layout(GuiResources* resources, RendererState* state, bool verbose = false);
 void destroy_gui_descriptor_set_layout(GuiResources* resources, RendererState* state, bool verbose = false);
@@ -151,4 +151,6 @@ bool draw_text_button(GuiState* state, Input* input,
 
 void draw_text(GuiState* state, ConstString* text, i32 x, i32 y, Vec4f color, TextAnchor text_anchor, FontAtlas* font_atlas);
 
+void draw_bar_graph(GuiState* state, Rect2i bound, f32* values, u32 value_count, f32 max_value, Vec4f color, Vec4f bar_color);
+
 #endif
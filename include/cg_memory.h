@@ -1,10 +1,53 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <pthread.h>
 #include <vulkan/vulkan.h>
 
+#include "cg_memory_arena.h"
+#include "cg_pool_allocator.h"
+
+#define MAX_BUDDY_ORDER_COUNT 32
+#define BUDDY_NONE 0xFFFFFFFF
+#define MAX_MEMORY_POOL_COUNT 256
+
+#define MAX_MEMORY_THREAD_COUNT 64    // Thread indices are allocated from a 64 bits mask
+#define MEMORY_CACHE_MAX_ORDER 4     // Blocks up to (min_page_size << 4) are cached per thread
+#define MEMORY_CACHE_BLOCK_COUNT 16  // Capacity of a cache bin
+#define MEMORY_CACHE_REFILL_COUNT 8  // Blocks taken from the pools when a bin is empty
+
+#define MEMORY_WARM_POOL_COUNT 1                 // Default number of empty pools kept per memory type
+#define MEMORY_POOL_IDLE_TIME_NS 5000000000ull   // Default time an extra empty pool is kept
+
+// Per subsystem accounting of device memory, only in debug builds
+#ifndef NDEBUG
+#define MEMORY_TAGGING
+#endif
+
 struct RendererState;
 
+// Subsystem owning an allocation. The frame ring holds the per frame instance indices and draw commands.
+enum MemoryTag {
+    MEMORY_TAG_UNKNOWN,
+    MEMORY_TAG_ENTITY,
+    MEMORY_TAG_TEXTURE,
+    MEMORY_TAG_FONT_ATLAS,
+    MEMORY_TAG_STAGING,
+    MEMORY_TAG_MATERIAL,
+    MEMORY_TAG_FRAME_RING,
+    MEMORY_TAG_DEPTH_BUFFER,
+    MEMORY_TAG_CAMERA,
+    MEMORY_TAG_GUI,
+    MEMORY_TAG_COUNT
+};
+
+// Identifies the block owning an allocation: the slot of its pool in the manager pool table and
+// its node in the buddy tree of that pool.
+struct MemoryHandle {
+    u32 pool_index;
+    u32 node;
+};
+
 struct AllocatedMemoryChunk {
     VkDeviceMemory device_memory;
     u32 memory_type;
@@ -13,59 +56,212 @@ struct AllocatedMemoryChunk {
     VkDeviceSize allocated_size;
     VkDeviceSize real_size;
     
+    MemoryHandle handle;
+    bool dedicated; // Owns its device memory instead of living in a pool
+    
     bool mappable;
     void* data;
-};
-
-struct MemoryChunk {
-    VkDeviceSize offset;
-    VkDeviceSize size;
-    
-    bool full;
     
-    MemoryChunk* right;
-    MemoryChunk* left;
+#ifdef MEMORY_TAGGING
+    MemoryTag tag;
+#endif
 };
 
+// A pool is managed as a buddy allocator. Blocks of order k are (min_page_size << k) bytes
+// long. Nodes of the buddy tree are numbered like a binary heap (root is 0, children of n are
+// 2n + 1 and 2n + 2). Free blocks are linked by their first page index in per-order lists.
 struct MemoryPool {
     VkDeviceMemory device_memory;
     u32 memory_type;
+    u32 index; // Slot in the manager pool table
+    
+    u32 page_count;
+    u32 max_order;
+    u32 free_order_mask; // Bit k is set when free_lists[k] is not empty
+    u32 free_lists[MAX_BUDDY_ORDER_COUNT];
+    u32* next_free;      // Indexed by page
+    u32* previous_free;  // Indexed by page
+    u8* split_bits;      // Indexed by node
+    u8* free_bits;       // Indexed by node
+    
+#ifdef MEMORY_TAGGING
+    // Indexed by the first page of a block, only meaningful for blocks handed out
+    u8* block_tags;
+    u32* block_requested_sizes;
+#endif
     
-    MemoryChunk base_chunk;
+    bool reserved;   // Created by reserve_memory(), never given back before cleanup_memory()
+    u64 empty_since; // Time the pool was first seen empty by release_empty_pools(), 0 when in use
     
     bool mappable;
     void* data;
     MemoryPool* next;
 };
 
+struct MemoryStatistics {
+    u64 pool_count;
+    u64 pool_size;
+    
+    u64 pooled_allocation_count;
+    u64 pooled_requested_size; // What the resources asked for
+    u64 pooled_allocated_size; // What the buddy blocks actually use
+    
+    u64 dedicated_allocation_count;
+    u64 dedicated_size;
+};
+
+// Per memory type and per heap accounting. Reserved is the device memory the manager got from the
+// driver (pools and dedicated allocations), used is the part of it handed out to resources.
+struct MemoryTypeUsage {
+    u64 reserved_size;
+    u64 used_size;
+};
+
+struct MemoryHeapUsage {
+    u64 reserved_size;
+    u64 used_size;
+    
+    // Refreshed from VK_EXT_memory_budget when available, estimated from the heap size otherwise
+    u64 budget;
+    u64 usage;
+    u64 reserved_size_at_budget_update;
+};
+
+struct MemoryHeapReport {
+    u64 heap_size;
+    u64 budget;
+    u64 usage;
+    u64 reserved_size;
+    u64 used_size;
+    u64 free_size;          // Free space in the pools of the heap
+    u64 largest_free_block;
+    f32 fragmentation;      // 0 when all the free space is in a single block, close to 1 when scattered
+};
+
+struct MemoryTagUsage {
+    u64 allocation_count;
+    u64 requested_size;
+    u64 allocated_size;
+};
+
+// Decides when empty pools go back to the driver. Releasing a pool as soon as it is empty means
+// paying a vkAllocateMemory the next time the type fills up, so a few empty pools are kept warm
+// and the others only after staying empty for a while. Reserved pools are not counted.
+struct MemoryResidencyPolicy {
+    u32 warm_pool_count; // Empty pools kept per memory type
+    u64 idle_time_ns;    // Time before an empty pool beyond the warm ones is released
+};
+
+struct MemoryCacheBin {
+    u32 count;
+    MemoryHandle blocks[MEMORY_CACHE_BLOCK_COUNT];
+};
+
+// Small blocks kept by a thread so that most allocations and frees do not take any lock. A cache is
+// only touched by its thread, except by flush_memory_caches() which needs every other thread idle.
+// Cached blocks are out of the buddy allocator, they count as used in the pools.
+struct ThreadMemoryCache {
+    MemoryCacheBin bins[VK_MAX_MEMORY_TYPES][MEMORY_CACHE_MAX_ORDER + 1];
+    MemoryStatistics statistics; // Pooled allocations and frees made by this thread
+    
+#ifdef MEMORY_TAGGING
+    MemoryTagUsage tag_usage[MEMORY_TAG_COUNT];
+#endif
+};
+
+// Locking: the lock of a memory type protects its pool list and the buddy state of these pools.
+// The global lock protects the pool table, the pool storage, the pool and dedicated statistics and
+// the budget.
+// Functions taking a MemoryPool* expect the caller to hold the lock of the pool memory type.
 struct MemoryManager {
-    MemoryPool** pools;
+    VkPhysicalDevice physical_device;
+    VkDevice device;
+    MemoryPool** pools; // Linked list of pools per memory type
+    MemoryPool* pool_table[MAX_MEMORY_POOL_COUNT];
+    
+    // Pools and their bookkeeping arrays come from fixed size pool allocators carved in this arena
+    MemoryArena pool_storage;
+    PoolAllocator pool_allocator;
+    PoolAllocator bookkeeping_allocator;
+    
+    pthread_mutex_t global_lock;
+    pthread_mutex_t type_locks[VK_MAX_MEMORY_TYPES];
+    
+    bool thread_cache_enabled;
+    ThreadMemoryCache* thread_caches[MAX_MEMORY_THREAD_COUNT];
     
     VkDeviceSize allocation_size;
     VkDeviceSize min_page_size;
+    u32 page_count;
+    u32 max_order;
+    
+    // Resources bigger than this get their own device memory instead of taking a block in a pool
+    VkDeviceSize dedicated_threshold;
+    bool dedicated_allocation_supported; // Vulkan 1.1 or VK_KHR_dedicated_allocation
+    
+    MemoryStatistics statistics; // Pooled counters live in the thread caches, see get_memory_statistics()
+    MemoryResidencyPolicy residency_policy;
+    
+    bool memory_budget_supported; // VK_EXT_memory_budget is enabled on the device
+    MemoryTypeUsage type_usage[VK_MAX_MEMORY_TYPES];
+    MemoryHeapUsage heap_usage[VK_MAX_MEMORY_HEAPS];
     
     VkPhysicalDeviceMemoryProperties memory_properties;
 };
 
 
-bool init_memory(MemoryManager* manager, u64 allocation_size, u64 min_page_size, VkPhysicalDevice physical_device);
+bool init_memory(MemoryManager* manager, u64 allocation_size, u64 min_page_size, VkPhysicalDevice physical_device, VkDevice device, bool memory_budget_supported = false);
 void cleanup_memory(MemoryManager* manager, VkDevice device, bool verbose);
-void cleanup_chunk(MemoryManager* manager, MemoryChunk* chunk);
 void cleanup_pool(MemoryManager* manager, VkDevice device, MemoryPool* pool);
 
-i32 find_memory_type_index(MemoryManager* manager, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties);
+void lock_memory_type(MemoryManager* manager, u32 type);
+void unlock_memory_type(MemoryManager* manager, u32 type);
+ThreadMemoryCache* get_thread_memory_cache(MemoryManager* manager);
+bool refill_memory_cache_bin(MemoryManager* manager, VkDevice device, u32 type, u32 order, MemoryCacheBin* bin);
+void flush_memory_cache_bin(MemoryManager* manager, u32 type, u32 order, MemoryCacheBin* bin, u32 count);
+void flush_thread_memory_cache(MemoryManager* manager);
+void flush_memory_caches(MemoryManager* manager);
 
-bool allocate_pool_for_type(MemoryManager* manager, VkDevice device, u32 type, VkMemoryPropertyFlags flags, MemoryPool* pool);
+void update_memory_budget(MemoryManager* manager);
+void update_memory_usage(MemoryManager* manager, u32 type, i64 reserved_delta, i64 used_delta);
+bool is_heap_over_budget(MemoryManager* manager, u32 heap, VkDeviceSize size);
+i32 find_memory_type_index(MemoryManager* manager, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, VkMemoryPropertyFlags preferred_properties = 0);
 
-bool allocate(MemoryManager* manager, VkDevice device, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk);
+u64 get_pool_bookkeeping_size(u32 page_count);
+bool allocate_pool_for_type(MemoryManager* manager, VkDevice device, u32 type, MemoryPool** pool);
+bool reserve_memory(MemoryManager* manager, VkDevice device, VkMemoryPropertyFlags required_properties, VkMemoryPropertyFlags preferred_properties, VkDeviceSize size);
+
+u32 get_buddy_order(MemoryManager* manager, VkDeviceSize size);
+u32 get_buddy_node(MemoryPool* pool, u32 order, u32 page);
+u32 get_buddy_node_order(MemoryPool* pool, u32 node);
+u32 get_buddy_node_page(MemoryPool* pool, u32 node);
+bool take_buddy_block(MemoryPool* pool, u32 order, u32* block_page);
+void release_buddy_block(MemoryPool* pool, u32 order, u32 page);
+
+bool allocate(MemoryManager* manager, VkDevice device, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk, VkMemoryPropertyFlags preferred_properties = 0, MemoryTag tag = MEMORY_TAG_UNKNOWN);
+bool allocate_from_type(MemoryManager* manager, VkDevice device, u32 memory_type, VkMemoryRequirements requirements, AllocatedMemoryChunk* allocated_chunk);
 bool allocate_from_pool(MemoryManager* manager, MemoryPool* pool, VkMemoryRequirements requirements, AllocatedMemoryChunk* allocated_chunk);
-bool allocate_from_chunk(MemoryManager* manager, MemoryPool* pool, MemoryChunk* chunk, VkMemoryRequirements requirements, AllocatedMemoryChunk* allocated_chunk);
+bool allocate_dedicated(MemoryManager* manager, VkDevice device, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, VkMemoryPropertyFlags preferred_properties, VkBuffer buffer, VkImage image, AllocatedMemoryChunk* allocated_chunk, MemoryTag tag = MEMORY_TAG_UNKNOWN);
+bool allocate_for_buffer(MemoryManager* manager, VkDevice device, VkBuffer buffer, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk, VkMemoryPropertyFlags preferred_properties = 0, MemoryTag tag = MEMORY_TAG_UNKNOWN);
+bool allocate_for_image(MemoryManager* manager, VkDevice device, VkImage image, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk, VkMemoryPropertyFlags preferred_properties = 0, MemoryTag tag = MEMORY_TAG_UNKNOWN);
+
+void tag_memory_chunk(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk, MemoryTag tag);
+void untag_memory_chunk(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk);
+MemoryTag get_memory_tag(AllocatedMemoryChunk* allocated_chunk);
+void get_memory_tag_usage(MemoryManager* manager, MemoryTag tag, MemoryTagUsage* usage);
 
 void free(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk);
-void free_from_chunk(MemoryManager* manager, MemoryPool* pool, MemoryChunk* chunk, AllocatedMemoryChunk* allocated_chunk);
+void free_dedicated(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk);
 void free_from_pool(MemoryManager* manager, MemoryPool* pool, AllocatedMemoryChunk* allocated_chunk);
 
 void memory_snapshot(MemoryManager* manager, MemoryPool* pool, u8* occupancy);
-void memory_snapshot_chunk(MemoryManager* manager, MemoryChunk* chunk, u8* occupancy);
+bool is_pool_empty(MemoryPool* pool);
+void release_pool(MemoryManager* manager, VkDevice device, MemoryPool* pool);
+u32 release_empty_pools(MemoryManager* manager, VkDevice device);
+VkDeviceSize get_pool_free_size(MemoryManager* manager, MemoryPool* pool);
+void get_memory_heap_report(MemoryManager* manager, u32 heap, MemoryHeapReport* report);
+void get_memory_statistics(MemoryManager* manager, MemoryStatistics* statistics);
+void print_memory_statistics(MemoryManager* manager);
+void dump_memory_report(MemoryManager* manager, bool verbose = false);
 
 #endif
@@ -2,21 +2,72 @@
 #define __CG_MEMORY_ARENA_H__
 
 #include "cg_macros.h"
-#define TEMPORARY_STORAGE_SIZE MB(1)
+#define TEMPORARY_STORAGE_SIZE MB(64)
 
+#define ARENA_COMMIT_SIZE KB(64)            // Granularity of the pages committed in the initial block
+#define ARENA_BLOCK_HEADER_SIZE 64          // Keeps the data of chained blocks 64 bytes aligned
+#define ARENA_SPARE_BLOCK_DECAY_COUNT 120   // Resets without overflow before the spare block is released
+#define ARENA_ARRAY_ALIGNMENT 16            // Arrays are ready for SSE loads and fast copies to mapped memory
+
+// Typed allocations, work with arenas and temporary memory. Alignments must be powers of two.
+#define push_struct(arena, type) (type*)allocate((arena), sizeof(type), alignof(type))
+#define push_zero_struct(arena, type) (type*)zero_allocate((arena), sizeof(type), alignof(type))
+#define push_array(arena, type, count) (type*)allocate((arena), sizeof(type) * (count), get_array_alignment(type))
+#define push_zero_array(arena, type, count) (type*)zero_allocate((arena), sizeof(type) * (count), get_array_alignment(type))
+#define get_array_alignment(type) (alignof(type) > ARENA_ARRAY_ALIGNMENT ? alignof(type) : ARENA_ARRAY_ALIGNMENT)
+
+// Header at the start of every block chained after the initial one. The state of the block it
+// replaced is saved in it and restored when the block is popped.
+struct MemoryArenaBlock {
+    MemoryArenaBlock* previous;
+    u64 mapped_size;
+    u64 dirty_size;              // Only meaningful for the spare block
+    
+    void* previous_data;
+    u64 previous_size;
+    u64 previous_usage;
+    u64 previous_dirty_usage;
+};
+
+// Allocations go to the current block, which is the initial one until it overflows. The initial
+// block is only reserved address space, its pages are committed as the usage grows. Blocks chained
+// after it are mapped on demand and given back on reset, except the last one which is kept as a
+// spare until the arena stops overflowing for a while.
 struct MemoryArena {
     void* data;
     u64 size;
     u64 usage;
-    u64 outside_usage;
+    
+    void* reserved_data;         // Initial block
+    u64 reserved_size;
+    u64 committed_size;
+    
+    u64 block_size;              // Minimum size of a chained block
+    u32 block_count;             // Chained blocks in use
+    MemoryArenaBlock* block;     // Current block, 0 while in the initial one
+    MemoryArenaBlock* spare_block;
+    u32 reset_count_without_overflow;
+    
+    u64 chained_usage;           // Usage of the blocks before the current one
     u64 max_usage;
+    u64 dirty_usage;             // Past this, the current block is still as the system gave it, all zero
+    
+    u64 frame_peak_usage;        // Counters since the last stats sample, see record_arena_stats()
+    u32 allocation_count;
+    u32 overflow_count;
 };
 
 bool init_memory_arena(MemoryArena* arena, u64 size = TEMPORARY_STORAGE_SIZE);
 void destroy_memory_arena(MemoryArena* arena, bool verbose = true);
-void* allocate(MemoryArena* arena, u64 size);
-void* zero_allocate(MemoryArena* arena, u64 size);
-void reset_arena(MemoryArena* arena);
+bool commit_arena_pages(MemoryArena* arena, u64 end);
+void decommit_arena_pages(MemoryArena* arena);
+bool push_arena_block(MemoryArena* arena, u64 min_size);
+void pop_arena_block(MemoryArena* arena);
+u64 get_aligned_usage(MemoryArena* arena, u64 alignment);
+void* allocate(MemoryArena* arena, u64 size, u64 alignment = 1);
+void* allocate_with_dirty_size(MemoryArena* arena, u64 size, u64 alignment, u64* dirty_size);
+void* zero_allocate(MemoryArena* arena, u64 size, u64 alignment = 1);
+void reset_arena(MemoryArena* arena, bool release_pages = false);
 char* to_string(MemoryArena to_print, MemoryArena* arena, u32 indentation_level = 0);
 
 
@@ -0,0 +1,47 @@
+#ifndef __CG_MESH_REGISTRY_H__
+#define __CG_MESH_REGISTRY_H__
+
+#include "cg_buffer_suballocator.h"
+#include "cg_entity_store.h"
+
+#define MAX_MESH_NAME_LENGTH 64
+#define MESH_INVALID_INDEX 0xFFFFFFFF
+
+// Geometry uploaded once and shared by every entity created from it
+struct Mesh {
+    char name[MAX_MESH_NAME_LENGTH];
+    BufferRange vertex_range;    // In the entity vertex suballocator
+    u32 first_vertex;
+    u32 vertex_count;
+    EntityBounds bounds;
+    u32 reference_count;         // Entities using the mesh and its creator until released, the slot is free when 0
+    
+    u32 first_instance;          // Batch of this frame, see write_instance_indices()
+    u32 instance_count;
+};
+
+// Consecutive indirect commands of the meshes stored in one vertex block, drawn with a single call
+struct IndirectDrawBatch {
+    u32 block_index;
+    u32 first_command;
+    u32 command_count;
+};
+
+struct MeshRegistry {
+    Mesh* meshes;
+    u32 mesh_count;
+    u32 capacity;
+};
+
+bool init_mesh_registry(MeshRegistry* registry, u32 capacity);
+void destroy_mesh_registry(MeshRegistry* registry, BufferSuballocator* suballocator, bool verbose = false);
+
+u32 find_mesh(MeshRegistry* registry, const char* name);
+bool add_mesh(MeshRegistry* registry, const char* name, BufferRange vertex_range, u32 vertex_count, EntityBounds bounds, u32* mesh_index);
+void acquire_mesh(MeshRegistry* registry, u32 mesh_index);
+bool release_mesh(MeshRegistry* registry, u32 mesh_index, BufferRange* vertex_range);
+
+u32 write_instance_indices(MeshRegistry* registry, EntityStore* store, u8* visibility, u32 base_index, u32* instances);
+u32 write_indirect_commands(MeshRegistry* registry, u32 first_instance, VkDrawIndirectCommand* commands, IndirectDrawBatch batches[MAX_SUBALLOCATOR_BLOCK_COUNT], u32* batch_count);
+
+#endif //CG_MESH_REGISTRY_H
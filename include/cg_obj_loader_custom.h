@@ -1,6 +1,8 @@
 #ifndef __CG_OBJ_LOADER_CUSTOM_H__
 #define __CG_OBJ_LOADER_CUSTOM_H__
 
+#define OBJ_READ_BUFFER_SIZE KB(256)
+
 enum ObjFaceType {
     OFT_Undefined = 0,
     OFT_Vertex,
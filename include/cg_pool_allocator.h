@@ -0,0 +1,30 @@
+#ifndef __POOL_ALLOCATOR_H__
+#define __POOL_ALLOCATOR_H__
+
+#include "cg_memory_arena.h"
+
+// Typed helpers, the element size is rounded up to the alignment
+#define init_typed_pool_allocator(pool, arena, type, capacity) init_pool_allocator((pool), (arena), sizeof(type), alignof(type), (capacity))
+#define pool_allocate_struct(pool, type) (type*)pool_allocate((pool))
+#define pool_zero_allocate_struct(pool, type) (type*)pool_zero_allocate((pool))
+
+// Fixed size elements stored contiguously in a single arena allocation. Freed elements are linked
+// through their first bytes and reused first, fresh ones are taken in order after that, so the
+// pages of the arena are only touched as the number of live elements grows. Not thread safe.
+struct PoolAllocator {
+    u8* data;
+    u64 element_size;
+    u32 capacity;
+    u32 fresh_index; // Elements before it were handed out at least once
+    u32 live_count;
+    void* free_list;
+};
+
+bool init_pool_allocator(PoolAllocator* pool, MemoryArena* arena, u64 element_size, u64 alignment, u32 capacity);
+void reset_pool_allocator(PoolAllocator* pool);
+void* pool_allocate(PoolAllocator* pool);
+void* pool_zero_allocate(PoolAllocator* pool);
+void pool_free(PoolAllocator* pool, void* element);
+bool owns_pool_element(PoolAllocator* pool, void* element);
+
+#endif
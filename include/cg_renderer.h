@@ -4,20 +4,42 @@
 #include <GLFW/glfw3.h>
 #include <vulkan/vulkan.h>
 
+#include "cg_arena_stats.h"
 #include "cg_benchmark.h"
+#include "cg_buffer_suballocator.h"
 #include "cg_shaders.h"
 #include "cg_texture.h"
 #include "cg_memory.h"
 #include "cg_math.h"
 #include "cg_camera.h"
+#include "cg_defragmenter.h"
+#include "cg_entity_store.h"
+#include "cg_frame_ring.h"
 #include "cg_gui.h"
 #include "cg_material.h"
 #include "cg_memory_arena.h"
+#include "cg_dirty_buffer.h"
+#include "cg_mesh_registry.h"
+#include "cg_frustum.h"
+#include "cg_command_recorder.h"
 #include "cg_fonts.h"
 #include "cg_vertex.h"
 
-#define MAX_ENTITY_COUNT 1024
-#define MAIN_ARENA_SIZE MB(256)
+#define INITIAL_ENTITY_CAPACITY 1024  // The entity store grows past it
+#define INITIAL_MESH_CAPACITY 64
+#define ENTITY_VERTEX_BLOCK_SIZE MB(4)
+#define MAIN_ARENA_SIZE GB(1)  // Reserved, pages are committed on demand
+#define FRAME_RING_SIZE MB(16)
+
+// Frames the CPU may prepare while the GPU is still busy with earlier ones. Each of them owns a frame
+// ring slot and a recorder slot, so the maximum can not exceed MAX_FRAME_RING_SLOT_COUNT nor
+// MAX_RECORD_SLOT_COUNT.
+#define MAX_FRAMES_IN_FLIGHT 4
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+
+// Device memory reserved at startup, so that loading during gameplay does not wait on the driver
+#define DEVICE_LOCAL_MEMORY_RESERVE MB(128) // Textures and depth buffers
+#define HOST_VISIBLE_MEMORY_RESERVE MB(128) // Entity vertices and materials
 
 enum DescriptorSetLayoutName {
     CameraDescriptorSetLayout,
@@ -31,33 +53,44 @@ struct PhysicalDeviceSelection {
     u32 transfer_queue_family_index;
     u32 compute_queue_family_index;
     u32 present_queue_family_index;
+    
+    bool memory_budget_supported; // VK_EXT_memory_budget, enabled on the device when available
+    bool multi_draw_indirect_supported; // multiDrawIndirect and drawIndirectFirstInstance, enabled when available
 };
 
+// The pool is reset as a whole once the fence signaled, its command buffer is allocated once and
+// recorded again every time the submission is reused
 struct CommandBufferSubmission {
+    VkCommandPool command_pool;
     VkCommandBuffer command_buffer;
     VkFence* fence;
 };
 
-struct EntityTransformData {
-    Mat4f model_matrix;
-    Mat4f normal_matrix;
+struct EntityResources {
+    VkDescriptorSet descriptor_set;
+    DirtyBuffer transform_buffer;   // Transforms by entity index, one copy per frame in flight
+    u32 first_instance;             // Index of this frame first entity index in the frame ring
+    u32 visible_count;              // Entities left after frustum culling
+    
+    // Draw commands of this frame in the frame ring, one batch per vertex block
+    VkDeviceSize indirect_offset;
+    IndirectDrawBatch indirect_batches[MAX_SUBALLOCATOR_BLOCK_COUNT];
+    u32 indirect_batch_count;
+    
+    BufferSuballocator vertex_suballocator;
+    
+    // Vertices of the meshes released while preparing a frame, freed once its fence signaled
+    BufferRange* released_ranges[MAX_FRAMES_IN_FLIGHT];
+    u32 released_range_count[MAX_FRAMES_IN_FLIGHT];
+    u32 released_range_capacity[MAX_FRAMES_IN_FLIGHT];
 };
 
-struct Entity {
-    u32 id;
+// Host copy of a rendered swapchain image, used to check that recordings give the same picture
+struct FrameCapture {
     VkBuffer buffer;
     AllocatedMemoryChunk allocation;
-    u32 size;
-    u32 offset;
-    
-    EntityTransformData *transform_data;
-};
-
-struct EntityResources {
-    VkBuffer* buffers;
-    VkDescriptorSet* descriptor_sets;
-    AllocatedMemoryChunk* allocations;
-    EntityTransformData transform_data[MAX_ENTITY_COUNT];
+    VkDeviceSize size;
+    bool requested;     // The next frame copies its image into the buffer
 };
 
 struct TempData {
@@ -66,12 +99,17 @@ struct TempData {
     
     u32 frame_count_update;
     
-    u32 light_entity_id;
+    EntityHandle light_entity;
     
     i32 rotation_speed;
     f32 current_angle;
     bool minus_button_status;
     bool plus_button_status;
+    bool show_arena_stats;
+    bool use_indirect_draws;
+    
+    u32 record_thread_count;    // 0 records everything inline in the primary command buffer
+    u64 record_time;            // Time spent recording the last frame
 };
 
 struct RendererState {
@@ -91,14 +129,16 @@ struct RendererState {
     VkImage* swapchain_images;
     VkImageView* swapchain_image_views;
     VkExtent2D swapchain_extent;
+    VkImageUsageFlags swapchain_usage;
     bool crashed;
     bool skip_image;
-    VkSemaphore* present_semaphores;
-    VkSemaphore* acquire_semaphores;
-    u32 current_semaphore_index;
-    VkFence* submit_fences;
-    VkFence* acquire_fences;
-    VkCommandPool command_pool;
+    VkSemaphore* present_semaphores;    // One per swapchain image
+    VkSemaphore* acquire_semaphores;    // One per frame in flight
+    VkFence* submit_fences;             // One per frame in flight
+    VkFence* image_fences;              // Submit fence of the last frame that rendered to each swapchain image
+    u32 frames_in_flight;
+    u32 frame_index;                    // Frame in flight being prepared
+    CommandRecorder command_recorder;
     VkPipelineLayout pipeline_layout;
     VkDescriptorSetLayout descriptor_set_layouts[CountDescriptorSetLayout];
     VkDescriptorPool descriptor_pool;
@@ -115,8 +155,11 @@ struct RendererState {
     CommandBufferSubmission* submissions;
     
     u32 image_index;
+    Benchmark render_benchmark;
     ShaderCatalog shader_catalog;
     MemoryManager memory_manager;
+    FrameRingAllocator frame_ring;
+    Defragmenter defragmenter;
     
     TextureCatalog texture_catalog;
     FontCatalog font_catalog;
@@ -129,12 +172,15 @@ struct RendererState {
     GuiState gui_state;
     GuiResources gui_resources;
     
-    Entity entities[MAX_ENTITY_COUNT];
+    EntityStore entity_store;
+    MeshRegistry mesh_registry;
     EntityResources entity_resources;
-    u32 entity_count;
     
     MemoryArena temporary_storage;
     MemoryArena main_arena;
+    ArenaRegistry arena_registry;
+    
+    FrameCapture frame_capture;
     
     TempData temp_data;
 };
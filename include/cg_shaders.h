@@ -5,6 +5,8 @@
 
 #include <vulkan/vulkan.h>
 
+#include "cg_files.h"
+
 struct ShaderCatalog {
     VkShaderModule* modules;
     u32 count;
@@ -13,8 +15,8 @@ struct ShaderCatalog {
 bool init_shader_catalog(ShaderCatalog* catalog, u32 size);
 void cleanup_shader_catalog(VkDevice device, ShaderCatalog* catalog, bool verbose);
 
-bool load_shader_code(const char* filename, u32** code, u32* code_size);
-void free_shader_code(u32* code);
+bool load_shader_code(const char* filename, MappedFile* code);
+void free_shader_code(MappedFile* code);
 
 bool create_shader_module(VkDevice device, const char* filename, VkShaderModule* module);
 
@@ -3,15 +3,24 @@
 
 #include "cg_memory_arena.h"
 
+#define SCRATCH_ARENA_COUNT 2       // One for the results of a function, one for its own temporaries
+#define SCRATCH_ARENA_SIZE MB(256)  // Reserved per thread, committed on demand
+
+// Saves the position of an arena, blocks chained after it are popped when the memory is destroyed
 struct TemporaryMemory {
     MemoryArena* arena;
+    MemoryArenaBlock* saved_block;
     u64 saved_usage;
 };
 
 TemporaryMemory make_temporary_memory(MemoryArena* arena);
 void destroy_temporary_memory(TemporaryMemory* memory);
 
-void* allocate(TemporaryMemory* memory, u64 size);
-void* zero_allocate(TemporaryMemory* memory, u64 size);
+MemoryArena* get_scratch_arena(MemoryArena* conflict = 0);
+TemporaryMemory begin_scratch_memory(MemoryArena* conflict = 0);
+void end_scratch_memory(TemporaryMemory* scratch);
+
+void* allocate(TemporaryMemory* memory, u64 size, u64 alignment = 1);
+void* zero_allocate(TemporaryMemory* memory, u64 size, u64 alignment = 1);
 
 #endif //CG_TEMPORARY_MEMORY_H
@@ -33,4 +33,8 @@ Texture* get_texture_from_catalog(TextureCatalog* catalog, const char* texture_n
 bool load_texture(RendererState* state, const u8* pixels, u32 width, u32 height, u32 channels, const char* texture_name);
 bool load_texture_from_filename(RendererState* state, const char* filename, const char* texture_name);
 
+void* texture_decoder_allocate(u64 size);
+void* texture_decoder_reallocate(void* data, u64 size);
+void texture_decoder_free(void* data);
+
 #endif
@@ -19,6 +19,7 @@ bool select_present_mode(RendererState* state);
 bool check_required_layers();
 bool check_required_instance_extensions(const char** extensions, u32 count);
 bool check_required_device_extensions(VkPhysicalDevice physical_device);
+bool is_device_extension_available(VkPhysicalDevice physical_device, const char* extension);
 
 bool create_instance(VkInstance* instance);
 bool create_device_and_queues(RendererState* state);
@@ -28,9 +29,8 @@ bool create_swapchain_image_views(RendererState* state);
 bool create_depth_images(RendererState* state);
 bool create_semaphore(RendererState* state);
 bool create_submit_fences(RendererState* state);
-bool create_acquire_fences(RendererState* state);
 bool create_fences(RendererState* state);
-bool create_command_pool(RendererState* state);
+bool create_command_pools(RendererState* state);
 bool create_descriptor_set_layout(RendererState* state);
 bool create_pipeline_layout(RendererState* state);
 bool create_render_pass(RendererState* state);
@@ -50,7 +50,7 @@ void destroy_renderpass(RendererState* state, bool verbose = false);
 void destroy_descriptor_set_layout(RendererState* state, bool verbose = false);
 void destroy_descriptor_pool(RendererState* state, bool verbose = false);
 void destroy_pipeline_layout(RendererState* state, bool verbose = false);
-void destroy_command_pool(RendererState* state, bool verbose = false);
+void destroy_command_pools(RendererState* state, bool verbose = false);
 void destroy_fences(RendererState* state, bool verbose = false);
 void destroy_submissions(RendererState* state, bool verbose = false);
 void destroy_semaphores(RendererState* state, bool verbose = false);
@@ -4,6 +4,7 @@ layout(location = 0) in vec3 position;
 layout(location = 1) in vec2 uv;
 layout(location = 2) in vec3 normal;
 layout(location = 3) in vec3 color;
+layout(location = 4) in uint entityIndex;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec3 fragPos;
@@ -16,15 +17,21 @@ layout(set = 0, binding = 0) uniform Context {
 	vec3 viewPosition;
 } ctx;
 
-layout(set = 1, binding = 0) uniform Model {
+struct Model {
     mat4 model;
     mat4 normal;
-} model;
+};
+
+// One per entity and frame in flight, each instance reads the index of its entity from an instance
+// rate attribute
+layout(set = 1, binding = 0) readonly buffer Models {
+    Model models[];
+};
 
 void main() {
-	vec4 worldPosition = model.model * vec4(position, 1.0);
+	vec4 worldPosition = models[entityIndex].model * vec4(position, 1.0);
     gl_Position = ctx.projection * ctx.view * worldPosition;
     fragColor = color;
 	fragPos = vec3(worldPosition);
-	fragNormal = mat3(model.normal) * normal;
+	fragNormal = mat3(models[entityIndex].normal) * normal;
 }
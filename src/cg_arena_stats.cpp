@@ -0,0 +1,86 @@
+#include "cg_arena_stats.h"
+
+inline bool register_arena(ArenaRegistry* registry, MemoryArena* arena, const char* name) {
+    if (registry->entry_count == MAX_REGISTERED_ARENA_COUNT) {
+        println("Error: too many registered arenas");
+        return false;
+    }
+    
+    ArenaStatsEntry* entry = &registry->entries[registry->entry_count++];
+    *entry = {};
+    entry->name = name;
+    entry->arena = arena;
+    
+    arena->frame_peak_usage = arena->chained_usage + arena->usage;
+    arena->allocation_count = 0;
+    arena->overflow_count = 0;
+    
+    return true;
+}
+
+inline void unregister_arena(ArenaRegistry* registry, MemoryArena* arena) {
+    for (u32 i = 0;i < registry->entry_count;++i) {
+        if (registry->entries[i].arena != arena) continue;
+        
+        registry->entries[i] = registry->entries[--registry->entry_count];
+        return;
+    }
+}
+
+// Closes the frame of every arena. The peak of the next frame starts at what is still allocated,
+// so that an arena which is never reset reports its usage and not only what grew this frame.
+inline void record_arena_stats(ArenaRegistry* registry) {
+    u32 index = registry->frame_count & (ARENA_STATS_HISTORY_SIZE - 1);
+    for (u32 i = 0;i < registry->entry_count;++i) {
+        ArenaStatsEntry* entry = &registry->entries[i];
+        MemoryArena* arena = entry->arena;
+        
+        ArenaFrameStats* stats = &entry->history[index];
+        stats->peak_usage = arena->frame_peak_usage;
+        stats->allocation_count = arena->allocation_count;
+        stats->overflow_count = arena->overflow_count;
+        
+        if (stats->peak_usage > entry->max_peak_usage) {
+            entry->max_peak_usage = stats->peak_usage;
+        }
+        entry->total_overflow_count += stats->overflow_count;
+        entry->total_allocation_count += stats->allocation_count;
+        
+        arena->frame_peak_usage = arena->chained_usage + arena->usage;
+        arena->allocation_count = 0;
+        arena->overflow_count = 0;
+    }
+    registry->frame_count++;
+}
+
+inline u32 get_arena_history_size(ArenaRegistry* registry) {
+    return registry->frame_count < ARENA_STATS_HISTORY_SIZE ? (u32)registry->frame_count : ARENA_STATS_HISTORY_SIZE;
+}
+
+// frames_ago is 0 for the last recorded frame and must be below get_arena_history_size()
+inline ArenaFrameStats* get_arena_frame_stats(ArenaRegistry* registry, ArenaStatsEntry* entry, u32 frames_ago) {
+    u64 frame = registry->frame_count - 1 - frames_ago;
+    
+    return &entry->history[frame & (ARENA_STATS_HISTORY_SIZE - 1)];
+}
+
+// Peaks against the size of the initial block, an arena overflowing often needs a bigger one
+inline void dump_arena_report(ArenaRegistry* registry) {
+    println("Memory arenas (%lu frames):", registry->frame_count);
+    for (u32 i = 0;i < registry->entry_count;++i) {
+        ArenaStatsEntry* entry = &registry->entries[i];
+        MemoryArena* arena = entry->arena;
+        
+        u64 recent_peak_usage = 0;
+        for (u32 frame = 0;frame < get_arena_history_size(registry);++frame) {
+            ArenaFrameStats* stats = get_arena_frame_stats(registry, entry, frame);
+            if (stats->peak_usage > recent_peak_usage) {
+                recent_peak_usage = stats->peak_usage;
+            }
+        }
+        
+        println("    %-12s %8lu KB reserved, %8lu KB peak, %8lu KB recent peak, %6lu overflows, %8lu allocations",
+                entry->name, arena->block_size / 1024, entry->max_peak_usage / 1024, recent_peak_usage / 1024,
+                entry->total_overflow_count, entry->total_allocation_count);
+    }
+}
@@ -0,0 +1,214 @@
+#include "cg_buffer_suballocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cg_macros.h"
+
+inline bool init_buffer_suballocator(BufferSuballocator* suballocator, VkDeviceSize block_size, VkDeviceSize alignment, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_flags, VkMemoryPropertyFlags preferred_flags, MemoryTag tag, u32 queue_family_index) {
+    if (alignment == 0 || block_size < alignment) {
+        println("Error: invalid suballocator block size or alignment");
+        return false;
+    }
+    
+    suballocator->block_count = 0;
+    suballocator->block_size = block_size / alignment * alignment;
+    suballocator->alignment = alignment;
+    suballocator->usage = usage;
+    suballocator->memory_flags = memory_flags;
+    suballocator->preferred_flags = preferred_flags;
+    suballocator->tag = tag;
+    suballocator->queue_family_index = queue_family_index;
+    suballocator->range_count = 0;
+    suballocator->used_size = 0;
+    
+    return true;
+}
+
+inline void destroy_buffer_suballocator(BufferSuballocator* suballocator, MemoryManager* manager, VkDevice device, bool verbose) {
+    if (verbose) {
+        println("Destroying buffer suballocator");
+    }
+    if (suballocator->range_count != 0) {
+        println("Warning: %lu suballocated ranges were not freed", suballocator->range_count);
+    }
+    for (u32 i = 0;i < suballocator->block_count;++i) {
+        SuballocatorBlock* block = &suballocator->blocks[i];
+        if (verbose) {
+            println("    Destroying suballocator block %u (%p)", i, block->buffer);
+        }
+        vkDestroyBuffer(device, block->buffer, nullptr);
+        free(manager, &block->allocation);
+        free_null(block->free_ranges);
+    }
+    suballocator->block_count = 0;
+    if (verbose) {
+        println("");
+    }
+}
+
+inline bool add_suballocator_block(BufferSuballocator* suballocator, MemoryManager* manager, VkDevice device, VkDeviceSize min_size, u32* block_index) {
+    if (suballocator->block_count == MAX_SUBALLOCATOR_BLOCK_COUNT) {
+        println("Error: too many suballocator blocks");
+        return false;
+    }
+    
+    SuballocatorBlock* block = &suballocator->blocks[suballocator->block_count];
+    *block = {};
+    block->size = min_size > suballocator->block_size ? min_size : suballocator->block_size;
+    
+    VkBufferCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.size = block->size;
+    create_info.usage = suballocator->usage;
+    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    create_info.queueFamilyIndexCount = 1;
+    create_info.pQueueFamilyIndices = &suballocator->queue_family_index;
+    
+    if (vkCreateBuffer(device, &create_info, nullptr, &block->buffer) != VK_SUCCESS) {
+        println("Error: failed to create a suballocator block");
+        return false;
+    }
+    
+    VkMemoryRequirements requirements = {};
+    
+    vkGetBufferMemoryRequirements(device, block->buffer, &requirements);
+    
+    if (!allocate(manager, device, requirements, suballocator->memory_flags, &block->allocation, suballocator->preferred_flags, suballocator->tag)) {
+        vkDestroyBuffer(device, block->buffer, nullptr);
+        return false;
+    }
+    
+    if (vkBindBufferMemory(device, block->buffer, block->allocation.device_memory, block->allocation.offset) != VK_SUCCESS) {
+        println("Error: failed to bind the memory of a suballocator block");
+        vkDestroyBuffer(device, block->buffer, nullptr);
+        free(manager, &block->allocation);
+        return false;
+    }
+    
+    block->free_range_capacity = 16;
+    block->free_ranges = (BufferFreeRange*)calloc(block->free_range_capacity, sizeof(BufferFreeRange));
+    block->free_ranges[0] = { 0, block->size };
+    block->free_range_count = 1;
+    block->free_size = block->size;
+    
+    *block_index = suballocator->block_count++;
+    
+    return true;
+}
+
+// First fit, the lowest offsets get reused first which keeps the end of the blocks free
+inline bool take_block_range(SuballocatorBlock* block, VkDeviceSize size, VkDeviceSize* offset) {
+    if (size > block->free_size) return false;
+    
+    for (u32 i = 0;i < block->free_range_count;++i) {
+        BufferFreeRange* free_range = &block->free_ranges[i];
+        if (free_range->size < size) continue;
+        
+        *offset = free_range->offset;
+        free_range->offset += size;
+        free_range->size -= size;
+        if (free_range->size == 0) {
+            memmove(free_range, free_range + 1, (block->free_range_count - i - 1) * sizeof(BufferFreeRange));
+            block->free_range_count--;
+        }
+        
+        block->free_size -= size;
+        return true;
+    }
+    
+    return false;
+}
+
+inline bool release_block_range(SuballocatorBlock* block, VkDeviceSize offset, VkDeviceSize size) {
+    // Index of the first free range after the released one
+    u32 low = 0;
+    u32 high = block->free_range_count;
+    while (low < high) {
+        u32 middle = (low + high) / 2;
+        if (block->free_ranges[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    BufferFreeRange* previous = low > 0 ? &block->free_ranges[low - 1] : 0;
+    BufferFreeRange* next = low < block->free_range_count ? &block->free_ranges[low] : 0;
+    if ((previous && previous->offset + previous->size > offset) || (next && offset + size > next->offset)) {
+        println("Error: released range overlaps a free range");
+        return false;
+    }
+    
+    bool merge_previous = previous && previous->offset + previous->size == offset;
+    bool merge_next = next && offset + size == next->offset;
+    
+    if (merge_previous && merge_next) {
+        previous->size += size + next->size;
+        memmove(next, next + 1, (block->free_range_count - low - 1) * sizeof(BufferFreeRange));
+        block->free_range_count--;
+    } else if (merge_previous) {
+        previous->size += size;
+    } else if (merge_next) {
+        next->offset = offset;
+        next->size += size;
+    } else {
+        if (block->free_range_count == block->free_range_capacity) {
+            block->free_range_capacity *= 2;
+            block->free_ranges = (BufferFreeRange*)realloc(block->free_ranges, block->free_range_capacity * sizeof(BufferFreeRange));
+        }
+        
+        memmove(block->free_ranges + low + 1, block->free_ranges + low, (block->free_range_count - low) * sizeof(BufferFreeRange));
+        block->free_ranges[low] = { offset, size };
+        block->free_range_count++;
+    }
+    
+    block->free_size += size;
+    return true;
+}
+
+inline bool suballocate(BufferSuballocator* suballocator, MemoryManager* manager, VkDevice device, VkDeviceSize size, BufferRange* range) {
+    if (size == 0) return false;
+    
+    VkDeviceSize aligned_size = (size + suballocator->alignment - 1) / suballocator->alignment * suballocator->alignment;
+    
+    u32 block_index = 0;
+    VkDeviceSize offset = 0;
+    while (block_index < suballocator->block_count) {
+        if (take_block_range(&suballocator->blocks[block_index], aligned_size, &offset)) break;
+        block_index++;
+    }
+    
+    if (block_index == suballocator->block_count) {
+        if (!add_suballocator_block(suballocator, manager, device, aligned_size, &block_index)) return false;
+        take_block_range(&suballocator->blocks[block_index], aligned_size, &offset);
+    }
+    
+    range->block_index = block_index;
+    range->offset = offset;
+    range->size = aligned_size;
+    
+    suballocator->range_count++;
+    suballocator->used_size += aligned_size;
+    
+    return true;
+}
+
+inline void free_suballocation(BufferSuballocator* suballocator, BufferRange* range) {
+    if (range->size == 0 || range->block_index >= suballocator->block_count) return;
+    
+    if (release_block_range(&suballocator->blocks[range->block_index], range->offset, range->size)) {
+        suballocator->range_count--;
+        suballocator->used_size -= range->size;
+    }
+    
+    *range = {};
+}
+
+// The mapping can change when the defragmenter moves a block, do not keep the pointer around
+inline void* get_suballocation_data(BufferSuballocator* suballocator, BufferRange* range) {
+    AllocatedMemoryChunk* allocation = &suballocator->blocks[range->block_index].allocation;
+    if (!allocation->data) return 0;
+    
+    return (u8*)allocation->data + range->offset;
+}
@@ -0,0 +1,240 @@
+#include "cg_command_recorder.h"
+
+#include "cg_macros.h"
+
+inline bool record_thread_range(CommandRecorder* recorder, RecordThread* thread) {
+    RecordThreadSlot* slot = &thread->slots[recorder->current_slot];
+    if (slot->used_count == MAX_RECORD_BUFFERS_PER_SLOT) {
+        println("Error: too many secondary command buffers recorded in a slot");
+        return false;
+    }
+    
+    // Buffers stay allocated across frames, resetting the pool resets them
+    if (slot->used_count == slot->allocated_count) {
+        VkCommandBufferAllocateInfo allocate_info = {};
+        allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocate_info.commandPool = slot->command_pool;
+        allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        allocate_info.commandBufferCount = 1;
+        
+        VkResult result = vkAllocateCommandBuffers(recorder->device, &allocate_info, &slot->command_buffers[slot->allocated_count]);
+        if (result != VK_SUCCESS) {
+            println("Error: failed to allocate a secondary command buffer (%d)", result);
+            return false;
+        }
+        slot->allocated_count++;
+    }
+    
+    VkCommandBuffer command_buffer = slot->command_buffers[slot->used_count++];
+    
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &recorder->inheritance;
+    
+    if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS) {
+        println("Error: failed to begin a secondary command buffer");
+        return false;
+    }
+    
+    recorder->function(command_buffer, recorder->user_data, thread->first_item, thread->item_count);
+    
+    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+        println("Error: failed to end a secondary command buffer");
+        return false;
+    }
+    
+    thread->command_buffer = command_buffer;
+    return true;
+}
+
+inline void* record_thread_main(void* data) {
+    RecordThread* thread = (RecordThread*)data;
+    CommandRecorder* recorder = thread->recorder;
+    
+    u64 seen_generation = 0;
+    while (true) {
+        pthread_mutex_lock(&recorder->lock);
+        while (!recorder->quit && recorder->job_generation == seen_generation) {
+            pthread_cond_wait(&recorder->job_ready, &recorder->lock);
+        }
+        if (recorder->quit) {
+            pthread_mutex_unlock(&recorder->lock);
+            break;
+        }
+        seen_generation = recorder->job_generation;
+        bool has_work = thread->index < recorder->job_thread_count;
+        pthread_mutex_unlock(&recorder->lock);
+        
+        if (has_work) {
+            thread->succeeded = record_thread_range(recorder, thread);
+        }
+        
+        pthread_mutex_lock(&recorder->lock);
+        if (--recorder->pending_thread_count == 0) {
+            pthread_cond_signal(&recorder->job_done);
+        }
+        pthread_mutex_unlock(&recorder->lock);
+    }
+    
+    return 0;
+}
+
+inline bool init_command_recorder(CommandRecorder* recorder, VkDevice device, u32 queue_family_index, u32 thread_count) {
+    *recorder = {};
+    recorder->device = device;
+    if (thread_count == 0 || thread_count > MAX_RECORD_THREAD_COUNT) {
+        thread_count = MAX_RECORD_THREAD_COUNT;
+    }
+    
+    pthread_mutex_init(&recorder->lock, nullptr);
+    pthread_cond_init(&recorder->job_ready, nullptr);
+    pthread_cond_init(&recorder->job_done, nullptr);
+    
+    VkCommandPoolCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    create_info.queueFamilyIndex = queue_family_index;
+    
+    for (u32 i = 0;i < thread_count;++i) {
+        RecordThread* thread = &recorder->threads[i];
+        thread->recorder = recorder;
+        thread->index = i;
+        for (u32 j = 0;j < MAX_RECORD_SLOT_COUNT;++j) {
+            if (vkCreateCommandPool(device, &create_info, nullptr, &thread->slots[j].command_pool) != VK_SUCCESS) {
+                println("Error: failed to create a recording command pool");
+                destroy_command_recorder(recorder);
+                return false;
+            }
+        }
+        recorder->thread_count++;
+    }
+    
+    for (u32 i = 1;i < recorder->thread_count;++i) {
+        if (pthread_create(&recorder->threads[i].thread, nullptr, record_thread_main, &recorder->threads[i]) != 0) {
+            println("Warning: only %u recording threads could be started", i);
+            
+            // The pools of the threads that did not start are destroyed with the others
+            for (u32 j = i;j < recorder->thread_count;++j) {
+                for (u32 k = 0;k < MAX_RECORD_SLOT_COUNT;++k) {
+                    vkDestroyCommandPool(device, recorder->threads[j].slots[k].command_pool, nullptr);
+                    recorder->threads[j].slots[k] = {};
+                }
+            }
+            recorder->thread_count = i;
+            break;
+        }
+    }
+    
+    return true;
+}
+
+inline void destroy_command_recorder(CommandRecorder* recorder, bool verbose) {
+    if (!recorder->device) return;
+    
+    if (verbose) {
+        println("Destroying command recorder (%u threads)", recorder->thread_count);
+    }
+    
+    if (recorder->thread_count > 1) {
+        pthread_mutex_lock(&recorder->lock);
+        recorder->quit = true;
+        pthread_cond_broadcast(&recorder->job_ready);
+        pthread_mutex_unlock(&recorder->lock);
+        
+        for (u32 i = 1;i < recorder->thread_count;++i) {
+            pthread_join(recorder->threads[i].thread, nullptr);
+        }
+    }
+    pthread_mutex_destroy(&recorder->lock);
+    pthread_cond_destroy(&recorder->job_ready);
+    pthread_cond_destroy(&recorder->job_done);
+    
+    // Destroying a pool frees its command buffers
+    for (u32 i = 0;i < MAX_RECORD_THREAD_COUNT;++i) {
+        for (u32 j = 0;j < MAX_RECORD_SLOT_COUNT;++j) {
+            RecordThreadSlot* slot = &recorder->threads[i].slots[j];
+            if (slot->command_pool) {
+                vkDestroyCommandPool(recorder->device, slot->command_pool, nullptr);
+            }
+            *slot = {};
+        }
+    }
+    recorder->thread_count = 0;
+    recorder->device = VK_NULL_HANDLE;
+}
+
+// The command buffers of the slot must not be in use by the device anymore
+inline bool begin_record_slot(CommandRecorder* recorder, u32 slot) {
+    if (slot >= MAX_RECORD_SLOT_COUNT) {
+        println("Error: recording slot %u out of range", slot);
+        return false;
+    }
+    
+    recorder->current_slot = slot;
+    for (u32 i = 0;i < recorder->thread_count;++i) {
+        RecordThreadSlot* thread_slot = &recorder->threads[i].slots[slot];
+        if (thread_slot->used_count == 0) continue;
+        
+        if (vkResetCommandPool(recorder->device, thread_slot->command_pool, 0) != VK_SUCCESS) {
+            println("Error: failed to reset a recording command pool");
+            return false;
+        }
+        thread_slot->used_count = 0;
+    }
+    
+    return true;
+}
+
+// Splits the items between at most thread_count threads, the caller records the first range while
+// the others record theirs. One command buffer per range is written, at most thread_count.
+inline bool record_secondary_command_buffers(CommandRecorder* recorder, VkCommandBufferInheritanceInfo* inheritance, RecordFunction function, void* user_data, u32 item_count, u32 thread_count, VkCommandBuffer* command_buffers, u32* command_buffer_count) {
+    *command_buffer_count = 0;
+    if (item_count == 0) return true;
+    
+    if (thread_count > recorder->thread_count) thread_count = recorder->thread_count;
+    if (thread_count > item_count) thread_count = item_count;
+    if (thread_count == 0) thread_count = 1;
+    
+    recorder->function = function;
+    recorder->user_data = user_data;
+    recorder->inheritance = *inheritance;
+    
+    u32 first_item = 0;
+    for (u32 i = 0;i < thread_count;++i) {
+        RecordThread* thread = &recorder->threads[i];
+        thread->first_item = first_item;
+        thread->item_count = item_count / thread_count + (i < item_count % thread_count ? 1 : 0);
+        thread->command_buffer = VK_NULL_HANDLE;
+        thread->succeeded = false;
+        first_item += thread->item_count;
+    }
+    
+    if (recorder->thread_count > 1) {
+        pthread_mutex_lock(&recorder->lock);
+        recorder->job_thread_count = thread_count;
+        recorder->pending_thread_count = recorder->thread_count - 1;
+        recorder->job_generation++;
+        pthread_cond_broadcast(&recorder->job_ready);
+        pthread_mutex_unlock(&recorder->lock);
+    }
+    
+    recorder->threads[0].succeeded = record_thread_range(recorder, &recorder->threads[0]);
+    
+    if (recorder->thread_count > 1) {
+        pthread_mutex_lock(&recorder->lock);
+        while (recorder->pending_thread_count != 0) {
+            pthread_cond_wait(&recorder->job_done, &recorder->lock);
+        }
+        pthread_mutex_unlock(&recorder->lock);
+    }
+    
+    bool succeeded = true;
+    for (u32 i = 0;i < thread_count;++i) {
+        RecordThread* thread = &recorder->threads[i];
+        succeeded = succeeded && thread->succeeded;
+        command_buffers[(*command_buffer_count)++] = thread->command_buffer;
+    }
+    
+    return succeeded;
+}
@@ -0,0 +1,408 @@
+#include "cg_defragmenter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cg_macros.h"
+#include "cg_renderer.h"
+#include "cg_timer.h"
+#include "cg_vk_helper.h"
+
+inline bool init_defragmenter(Defragmenter* defragmenter, RendererState* state) {
+    VkCommandPoolCreateInfo pool_create_info = {};
+    pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    pool_create_info.queueFamilyIndex = state->selection.graphics_queue_family_index;
+    
+    VkResult result = vkCreateCommandPool(state->device, &pool_create_info, nullptr, &defragmenter->command_pool);
+    if (result != VK_SUCCESS) {
+        println("vkCreateCommandPool returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    VkCommandBufferAllocateInfo allocate_info = {};
+    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocate_info.commandPool = defragmenter->command_pool;
+    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocate_info.commandBufferCount = 1;
+    
+    result = vkAllocateCommandBuffers(state->device, &allocate_info, &defragmenter->command_buffer);
+    if (result != VK_SUCCESS) {
+        println("vkAllocateCommandBuffers returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    VkFenceCreateInfo fence_create_info = {};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    
+    result = vkCreateFence(state->device, &fence_create_info, nullptr, &defragmenter->fence);
+    if (result != VK_SUCCESS) {
+        println("vkCreateFence returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    defragmenter->occupancy = (u8*)calloc(state->memory_manager.page_count, sizeof(u8));
+    defragmenter->buffer_count = 0;
+    defragmenter->move_count = 0;
+    defragmenter->retired_count = 0;
+    defragmenter->pass_in_flight = false;
+    defragmenter->frame_index = 0;
+    defragmenter->statistics = {};
+    
+    return true;
+}
+
+inline bool register_defrag_buffer(Defragmenter* defragmenter, VkBuffer* buffer, AllocatedMemoryChunk* allocation, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memory_flags) {
+    if (defragmenter->buffer_count == MAX_DEFRAG_BUFFER_COUNT) return false;
+    
+    // The defragmenter copies with vkCmdCopyBuffer, both ends need the transfer usages
+    if ((usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT) == 0 || (usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT) == 0) {
+        println("Error: movable buffers must be created with transfer src and dst usages");
+        return false;
+    }
+    
+    DefragBuffer* entry = &defragmenter->buffers[defragmenter->buffer_count++];
+    entry->buffer = buffer;
+    entry->allocation = allocation;
+    entry->size = size;
+    entry->usage = usage;
+    entry->memory_flags = memory_flags;
+    
+    return true;
+}
+
+inline void retire_defrag_buffer(Defragmenter* defragmenter, VkBuffer buffer, AllocatedMemoryChunk* allocation, u64 release_frame) {
+    assert(defragmenter->retired_count < MAX_DEFRAG_RETIRED_COUNT);
+    
+    DefragRetiredBuffer* retired = &defragmenter->retired[defragmenter->retired_count++];
+    retired->buffer = buffer;
+    retired->allocation = *allocation;
+    retired->release_frame = release_frame;
+}
+
+inline void release_retired_buffers(Defragmenter* defragmenter, RendererState* state, bool force) {
+    u32 i = 0;
+    while (i < defragmenter->retired_count) {
+        DefragRetiredBuffer* retired = &defragmenter->retired[i];
+        if (!force && retired->release_frame > defragmenter->frame_index) {
+            ++i;
+            continue;
+        }
+        
+        vkDestroyBuffer(state->device, retired->buffer, nullptr);
+        free(&state->memory_manager, &retired->allocation);
+        
+        *retired = defragmenter->retired[--defragmenter->retired_count];
+    }
+}
+
+// Called once the copies are done: the owners now see the new buffers, the old ones are retired
+// until the frames in flight that may still use them are finished.
+inline void complete_defrag_pass(Defragmenter* defragmenter, RendererState* state) {
+    u64 release_frame = defragmenter->frame_index + state->frames_in_flight + 1;
+    
+    for (u32 i = 0;i < defragmenter->move_count;++i) {
+        DefragMove* move = &defragmenter->moves[i];
+        DefragBuffer* entry = &defragmenter->buffers[move->buffer_index];
+        
+        retire_defrag_buffer(defragmenter, *entry->buffer, entry->allocation, release_frame);
+        
+        *entry->buffer = move->new_buffer;
+        *entry->allocation = move->new_allocation;
+        
+        defragmenter->statistics.moved_buffer_count++;
+        defragmenter->statistics.moved_size += entry->size;
+    }
+    
+    defragmenter->move_count = 0;
+    defragmenter->pass_in_flight = false;
+    vkResetFences(state->device, 1, &defragmenter->fence);
+}
+
+inline bool wait_for_defrag_pass(Defragmenter* defragmenter, RendererState* state) {
+    if (!defragmenter->pass_in_flight) return true;
+    
+    VkResult result = vkWaitForFences(state->device, 1, &defragmenter->fence, VK_TRUE, 1000000000);
+    if (result != VK_SUCCESS) {
+        println("vkWaitForFences returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    complete_defrag_pass(defragmenter, state);
+    
+    return true;
+}
+
+// Writes from the CPU to a buffer being copied would be lost, they must wait for the end of the pass
+inline bool wait_for_defrag_buffer(Defragmenter* defragmenter, RendererState* state, VkBuffer* buffer) {
+    if (!defragmenter->pass_in_flight) return true;
+    
+    for (u32 i = 0;i < defragmenter->move_count;++i) {
+        if (defragmenter->buffers[defragmenter->moves[i].buffer_index].buffer == buffer) {
+            return wait_for_defrag_pass(defragmenter, state);
+        }
+    }
+    
+    return true;
+}
+
+inline void unregister_defrag_buffer(Defragmenter* defragmenter, RendererState* state, VkBuffer* buffer) {
+    // Indices of the pending moves would be invalidated, let the pass finish first
+    wait_for_defrag_pass(defragmenter, state);
+    
+    for (u32 i = 0;i < defragmenter->buffer_count;++i) {
+        if (defragmenter->buffers[i].buffer == buffer) {
+            defragmenter->buffers[i] = defragmenter->buffers[--defragmenter->buffer_count];
+            return;
+        }
+    }
+}
+
+inline bool is_in_pool(AllocatedMemoryChunk* allocation, MemoryPool* pool) {
+    return allocation->device_memory == pool->device_memory && !allocation->dedicated;
+}
+
+// The victim is the least occupied pool whose allocations all belong to movable buffers, among the
+// memory types that have other pools to move them to. Reserved pools are left alone.
+inline MemoryPool* select_defrag_victim(Defragmenter* defragmenter, MemoryManager* manager) {
+    MemoryPool* victim = 0;
+    f32 victim_occupancy = DEFRAG_VICTIM_MAX_OCCUPANCY;
+    
+    for (u32 i = 0;i < manager->memory_properties.memoryTypeCount;++i) {
+        lock_memory_type(manager, i);
+        if (!manager->pools[i] || !manager->pools[i]->next) {
+            unlock_memory_type(manager, i);
+            continue;
+        }
+        
+        for (MemoryPool* pool = manager->pools[i];pool != 0;pool = pool->next) {
+            // Reserved pools are never released, emptying them would reclaim nothing
+            if (is_pool_empty(pool) || pool->reserved) continue;
+            
+            memset(defragmenter->occupancy, 0, pool->page_count);
+            memory_snapshot(manager, pool, defragmenter->occupancy);
+            
+            u32 used_page_count = 0;
+            for (u32 page = 0;page < pool->page_count;++page) {
+                used_page_count += defragmenter->occupancy[page];
+            }
+            
+            f32 occupancy = (f32)used_page_count / (f32)pool->page_count;
+            if (occupancy >= victim_occupancy) continue;
+            
+            u64 movable_page_count = 0;
+            for (u32 j = 0;j < defragmenter->buffer_count;++j) {
+                AllocatedMemoryChunk* allocation = defragmenter->buffers[j].allocation;
+                if (is_in_pool(allocation, pool)) {
+                    movable_page_count += allocation->allocated_size / manager->min_page_size;
+                }
+            }
+            
+            if (movable_page_count != used_page_count) continue;
+            
+            victim = pool;
+            victim_occupancy = occupancy;
+        }
+        unlock_memory_type(manager, i);
+    }
+    
+    return victim;
+}
+
+inline bool allocate_outside_of_pool(MemoryManager* manager, MemoryPool* excluded_pool, VkMemoryRequirements requirements, AllocatedMemoryChunk* allocation, MemoryTag tag) {
+    if ((requirements.memoryTypeBits & (1 << excluded_pool->memory_type)) == 0) return false;
+    
+    // Empty pools are skipped, moving there would not make anything denser
+    bool allocated = false;
+    lock_memory_type(manager, excluded_pool->memory_type);
+    for (MemoryPool* pool = manager->pools[excluded_pool->memory_type];pool != 0;pool = pool->next) {
+        if (pool == excluded_pool || is_pool_empty(pool)) continue;
+        if (allocate_from_pool(manager, pool, requirements, allocation)) {
+            allocated = true;
+            break;
+        }
+    }
+    unlock_memory_type(manager, excluded_pool->memory_type);
+    
+    if (allocated) {
+        tag_memory_chunk(manager, allocation, tag);
+    }
+    
+    return allocated;
+}
+
+inline bool start_defrag_pass(Defragmenter* defragmenter, RendererState* state, u64 start, u64 budget_ns) {
+    MemoryManager* manager = &state->memory_manager;
+    
+    if (defragmenter->retired_count + MAX_DEFRAG_MOVE_COUNT > MAX_DEFRAG_RETIRED_COUNT) return true;
+    
+    MemoryPool* victim = select_defrag_victim(defragmenter, manager);
+    if (!victim) return true;
+    
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    
+    VkResult result = vkBeginCommandBuffer(defragmenter->command_buffer, &begin_info);
+    if (result != VK_SUCCESS) {
+        println("vkBeginCommandBuffer returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    VkDeviceSize pass_size = 0;
+    for (u32 i = 0;i < defragmenter->buffer_count;++i) {
+        DefragBuffer* entry = &defragmenter->buffers[i];
+        if (!is_in_pool(entry->allocation, victim)) continue;
+        
+        if (defragmenter->move_count == MAX_DEFRAG_MOVE_COUNT) break;
+        if (pass_size + entry->size > DEFRAG_MAX_BYTES_PER_PASS) break;
+        if (get_time_ns() - start > budget_ns) break;
+        
+        DefragMove* move = &defragmenter->moves[defragmenter->move_count];
+        
+        VkBufferCreateInfo create_info = {};
+        create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        create_info.size = entry->size;
+        create_info.usage = entry->usage;
+        create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        create_info.queueFamilyIndexCount = 1;
+        create_info.pQueueFamilyIndices = &state->selection.graphics_queue_family_index;
+        
+        result = vkCreateBuffer(state->device, &create_info, nullptr, &move->new_buffer);
+        if (result != VK_SUCCESS) {
+            println("vkCreateBuffer returned (%s)", vk_error_code_str(result));
+            break;
+        }
+        
+        VkMemoryRequirements requirements = {};
+        vkGetBufferMemoryRequirements(state->device, move->new_buffer, &requirements);
+        
+        if (!allocate_outside_of_pool(manager, victim, requirements, &move->new_allocation, get_memory_tag(entry->allocation))) {
+            vkDestroyBuffer(state->device, move->new_buffer, nullptr);
+            break;
+        }
+        
+        result = vkBindBufferMemory(state->device, move->new_buffer, move->new_allocation.device_memory, move->new_allocation.offset);
+        if (result != VK_SUCCESS) {
+            println("vkBindBufferMemory returned (%s)", vk_error_code_str(result));
+            vkDestroyBuffer(state->device, move->new_buffer, nullptr);
+            free(manager, &move->new_allocation);
+            break;
+        }
+        
+        VkBufferCopy region = {};
+        region.srcOffset = 0;
+        region.dstOffset = 0;
+        region.size = entry->size;
+        vkCmdCopyBuffer(defragmenter->command_buffer, *entry->buffer, move->new_buffer, 1, &region);
+        
+        move->buffer_index = i;
+        defragmenter->move_count++;
+        pass_size += entry->size;
+    }
+    
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    
+    vkCmdPipelineBarrier(defragmenter->command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0,
+                         1, &barrier,
+                         0, nullptr,
+                         0, nullptr);
+    
+    result = vkEndCommandBuffer(defragmenter->command_buffer);
+    if (result != VK_SUCCESS) {
+        println("vkEndCommandBuffer returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    if (defragmenter->move_count == 0) {
+        vkResetCommandBuffer(defragmenter->command_buffer, 0);
+        return true;
+    }
+    
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &defragmenter->command_buffer;
+    
+    result = vkQueueSubmit(state->graphics_queue, 1, &submit_info, defragmenter->fence);
+    if (result != VK_SUCCESS) {
+        println("vkQueueSubmit returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    defragmenter->pass_in_flight = true;
+    defragmenter->statistics.pass_count++;
+    
+    return true;
+}
+
+inline bool update_defragmenter(Defragmenter* defragmenter, RendererState* state, u64 budget_ns) {
+    u64 start = get_time_ns();
+    defragmenter->frame_index++;
+    
+    if (defragmenter->pass_in_flight) {
+        VkResult result = vkGetFenceStatus(state->device, defragmenter->fence);
+        if (result == VK_NOT_READY) return true;
+        if (result != VK_SUCCESS) {
+            println("vkGetFenceStatus returned (%s)", vk_error_code_str(result));
+            return false;
+        }
+        
+        vkResetCommandBuffer(defragmenter->command_buffer, 0);
+        complete_defrag_pass(defragmenter, state);
+    }
+    
+    release_retired_buffers(defragmenter, state, false);
+    
+    // Pools emptied by previous passes (or by anything else) go back to the driver as the residency
+    // policy allows. Blocks cached by this thread would keep them alive and look like unmovable
+    // allocations to the victim selection.
+    flush_thread_memory_cache(&state->memory_manager);
+    defragmenter->statistics.released_pool_count += release_empty_pools(&state->memory_manager, state->device);
+    
+    if (get_time_ns() - start > budget_ns) return true;
+    
+    return start_defrag_pass(defragmenter, state, start, budget_ns);
+}
+
+inline void destroy_defragmenter(Defragmenter* defragmenter, RendererState* state, bool verbose) {
+    if (verbose) {
+        println("Destroying defragmenter");
+        println("    %lu passes moved %lu buffers (%lu KB), %lu pools released",
+                defragmenter->statistics.pass_count,
+                defragmenter->statistics.moved_buffer_count,
+                defragmenter->statistics.moved_size / 1024,
+                defragmenter->statistics.released_pool_count);
+    }
+    
+    wait_for_defrag_pass(defragmenter, state);
+    release_retired_buffers(defragmenter, state, true);
+    
+    if (defragmenter->fence) {
+        if (verbose) {
+            println("    Destroying defragmenter fence (%p)", defragmenter->fence);
+        }
+        vkDestroyFence(state->device, defragmenter->fence, nullptr);
+        defragmenter->fence = 0;
+    }
+    
+    if (defragmenter->command_pool) {
+        if (verbose) {
+            println("    Destroying defragmenter command pool (%p)", defragmenter->command_pool);
+        }
+        vkDestroyCommandPool(state->device, defragmenter->command_pool, nullptr);
+        defragmenter->command_pool = 0;
+    }
+    
+    free_null(defragmenter->occupancy);
+    defragmenter->buffer_count = 0;
+    if (verbose) {
+        println("");
+    }
+}
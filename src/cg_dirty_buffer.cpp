@@ -0,0 +1,217 @@
+#include "cg_dirty_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cg_macros.h"
+
+inline bool init_dirty_tracker(DirtyTracker* tracker, u32 element_capacity, u32 copy_count) {
+    *tracker = {};
+    if (element_capacity == 0 || copy_count == 0) {
+        println("Error: a dirty tracker needs at least one element and one copy");
+        return false;
+    }
+    
+    tracker->word_count = (element_capacity + 63) / 64;
+    tracker->copy_count = copy_count;
+    tracker->element_capacity = element_capacity;
+    tracker->bits = (u64*)calloc((size_t)tracker->word_count * copy_count, sizeof(u64));
+    if (!tracker->bits) {
+        println("Error: failed to allocate the dirty bits of %u elements", element_capacity);
+        return false;
+    }
+    
+    // Nothing was ever written to the copies
+    mark_dirty(tracker, 0, element_capacity);
+    
+    return true;
+}
+
+inline void destroy_dirty_tracker(DirtyTracker* tracker) {
+    free_null(tracker->bits);
+    tracker->word_count = 0;
+    tracker->copy_count = 0;
+    tracker->element_capacity = 0;
+}
+
+inline void set_bit_range(u64* bits, u32 first, u32 end) {
+    while (first < end) {
+        u32 word = first / 64;
+        u32 bit = first % 64;
+        u32 count = min(64 - bit, end - first);
+        u64 mask = count == 64 ? ~0ull : ((1ull << count) - 1) << bit;
+        bits[word] |= mask;
+        first += count;
+    }
+}
+
+inline void clear_bit_range(u64* bits, u32 first, u32 end) {
+    while (first < end) {
+        u32 word = first / 64;
+        u32 bit = first % 64;
+        u32 count = min(64 - bit, end - first);
+        u64 mask = count == 64 ? ~0ull : ((1ull << count) - 1) << bit;
+        bits[word] &= ~mask;
+        first += count;
+    }
+}
+
+// First index at or after start whose bit is set (or clear when invert is all ones), end if none
+inline u32 find_bit(u64* bits, u32 start, u32 end, u64 invert) {
+    if (start >= end) return end;
+    
+    u32 word = start / 64;
+    u64 value = (bits[word] ^ invert) & (~0ull << (start % 64));
+    while (value == 0) {
+        if (++word * 64 >= end) return end;
+        value = bits[word] ^ invert;
+    }
+    
+    return min(word * 64 + (u32)__builtin_ctzll(value), end);
+}
+
+inline void mark_dirty(DirtyTracker* tracker, u32 first, u32 count) {
+    u32 end = min(first + count, tracker->element_capacity);
+    for (u32 i = 0;i < tracker->copy_count;++i) {
+        set_bit_range(tracker->bits + i * tracker->word_count, first, end);
+    }
+}
+
+// bits holds one bit per element, as kept by the entity store
+inline void mark_dirty_bits(DirtyTracker* tracker, const u64* bits, u32 element_count) {
+    u32 word_count = (min(element_count, tracker->element_capacity) + 63) / 64;
+    for (u32 i = 0;i < tracker->copy_count;++i) {
+        u64* copy_bits = tracker->bits + i * tracker->word_count;
+        for (u32 j = 0;j < word_count;++j) {
+            copy_bits[j] |= bits[j];
+        }
+    }
+}
+
+// For data rebuilt every frame: each element is compared with the shadow copy of what was last
+// marked, the ones that differ are marked and the shadow updated. Returns the number of elements marked.
+inline u32 mark_changed_elements(DirtyTracker* tracker, void* shadow, const void* source, VkDeviceSize element_size, u32 element_count) {
+    element_count = min(element_count, tracker->element_capacity);
+    
+    u32 changed_count = 0;
+    u32 span_start = 0;
+    bool in_span = false;
+    for (u32 i = 0;i <= element_count;++i) {
+        bool changed = i < element_count && memcmp((u8*)shadow + i * element_size, (u8*)source + i * element_size, element_size) != 0;
+        if (changed && !in_span) {
+            span_start = i;
+            in_span = true;
+        } else if (!changed && in_span) {
+            memcpy((u8*)shadow + span_start * element_size, (u8*)source + span_start * element_size, (i - span_start) * element_size);
+            mark_dirty(tracker, span_start, i - span_start);
+            changed_count += i - span_start;
+            in_span = false;
+        }
+    }
+    
+    return changed_count;
+}
+
+// Writes the dirty elements of the copy from source to destination, the mapped start of the copy.
+// Elements past element_count keep their bits until they are written.
+inline DirtyUploadStats upload_dirty_elements(DirtyTracker* tracker, u32 copy, const void* source, void* destination, VkDeviceSize element_size, u32 element_count) {
+    DirtyUploadStats stats = {};
+    u64* bits = tracker->bits + copy * tracker->word_count;
+    u32 end = min(element_count, tracker->element_capacity);
+    
+    u32 first = find_bit(bits, 0, end, 0);
+    while (first < end) {
+        u32 last = find_bit(bits, first, end, ~0ull);
+        memcpy((u8*)destination + first * element_size, (u8*)source + first * element_size, (last - first) * element_size);
+        clear_bit_range(bits, first, last);
+        
+        stats.span_count++;
+        stats.element_count += last - first;
+        first = find_bit(bits, last, end, 0);
+    }
+    
+    return stats;
+}
+
+inline bool init_dirty_buffer(DirtyBuffer* buffer, MemoryManager* manager, VkDevice device, VkDeviceSize element_size, u32 element_capacity, u32 copy_count, VkDeviceSize alignment, VkBufferUsageFlags usage, MemoryTag tag, u32 queue_family_index) {
+    *buffer = {};
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        println("Error: dirty buffer alignment must be a power of two");
+        return false;
+    }
+    
+    if (!init_dirty_tracker(&buffer->tracker, element_capacity, copy_count)) {
+        return false;
+    }
+    
+    buffer->element_size = element_size;
+    buffer->copy_size = (element_size * element_capacity + alignment - 1) & ~(alignment - 1);
+    
+    VkBufferCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.size = buffer->copy_size * copy_count;
+    create_info.usage = usage;
+    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    create_info.queueFamilyIndexCount = 1;
+    create_info.pQueueFamilyIndices = &queue_family_index;
+    
+    if (vkCreateBuffer(device, &create_info, nullptr, &buffer->buffer) != VK_SUCCESS) {
+        println("Error: failed to create a dirty buffer");
+        destroy_dirty_tracker(&buffer->tracker);
+        return false;
+    }
+    
+    VkMemoryRequirements requirements = {};
+    
+    vkGetBufferMemoryRequirements(device, buffer->buffer, &requirements);
+    
+    // Written from the CPU and read once per frame by the GPU, like the frame ring
+    VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!allocate(manager, device, requirements, memory_flags, &buffer->allocation, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, tag)) {
+        destroy_dirty_buffer(buffer, manager, device);
+        return false;
+    }
+    
+    if (vkBindBufferMemory(device, buffer->buffer, buffer->allocation.device_memory, buffer->allocation.offset) != VK_SUCCESS) {
+        println("Error: failed to bind the memory of a dirty buffer");
+        destroy_dirty_buffer(buffer, manager, device);
+        return false;
+    }
+    
+    return true;
+}
+
+inline void destroy_dirty_buffer(DirtyBuffer* buffer, MemoryManager* manager, VkDevice device, bool verbose) {
+    if (buffer->buffer) {
+        if (verbose) {
+            println("    Destroying dirty buffer (%p)", buffer->buffer);
+        }
+        vkDestroyBuffer(device, buffer->buffer, nullptr);
+        buffer->buffer = VK_NULL_HANDLE;
+    }
+    
+    free(manager, &buffer->allocation);
+    destroy_dirty_tracker(&buffer->tracker);
+}
+
+// Called once the fence of the last frame that used this copy signaled
+inline bool upload_dirty_buffer(DirtyBuffer* buffer, u32 copy, const void* source, u32 element_count) {
+    if (!buffer->allocation.data) {
+        println("Error: dirty buffer is not mapped");
+        return false;
+    }
+    
+    if (element_count > buffer->tracker.element_capacity) {
+        println("Error: %u elements do not fit in a dirty buffer of %u", element_count, buffer->tracker.element_capacity);
+        return false;
+    }
+    
+    void* destination = (u8*)buffer->allocation.data + get_dirty_copy_offset(buffer, copy);
+    buffer->last_upload = upload_dirty_elements(&buffer->tracker, copy, source, destination, buffer->element_size, element_count);
+    
+    return true;
+}
+
+inline VkDeviceSize get_dirty_copy_offset(DirtyBuffer* buffer, u32 copy) {
+    return copy * buffer->copy_size;
+}
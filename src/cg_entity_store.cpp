@@ -0,0 +1,203 @@
+#include "cg_entity_store.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cg_macros.h"
+
+inline bool init_entity_store(EntityStore* store, u32 capacity) {
+    *store = {};
+    store->free_slot = ENTITY_INVALID_INDEX;
+    
+    return grow_entity_store(store, capacity);
+}
+
+inline void destroy_entity_store(EntityStore* store, bool verbose) {
+    if (verbose) {
+        println("Destroying entity store (%u entities, %u slots)", store->count, store->slot_count);
+    }
+    free_null(store->transforms);
+    free_null(store->bounds);
+    free_null(store->sphere_x);
+    free_null(store->sphere_y);
+    free_null(store->sphere_z);
+    free_null(store->sphere_radius);
+    free_null(store->meshes);
+    free_null(store->slots);
+    free_null(store->dirty_bits);
+    free_null(store->indices);
+    free_null(store->generations);
+    store->count = 0;
+    store->capacity = 0;
+    store->slot_count = 0;
+    store->free_slot = ENTITY_INVALID_INDEX;
+}
+
+// Every array grows together, there are never more slots than the capacity
+inline bool grow_entity_store(EntityStore* store, u32 capacity) {
+    if (capacity <= store->capacity) return true;
+    
+    EntityTransformData* transforms = (EntityTransformData*)realloc(store->transforms, capacity * sizeof(EntityTransformData));
+    if (transforms) store->transforms = transforms;
+    EntityBounds* bounds = (EntityBounds*)realloc(store->bounds, capacity * sizeof(EntityBounds));
+    if (bounds) store->bounds = bounds;
+    f32* sphere_x = (f32*)realloc(store->sphere_x, capacity * sizeof(f32));
+    if (sphere_x) store->sphere_x = sphere_x;
+    f32* sphere_y = (f32*)realloc(store->sphere_y, capacity * sizeof(f32));
+    if (sphere_y) store->sphere_y = sphere_y;
+    f32* sphere_z = (f32*)realloc(store->sphere_z, capacity * sizeof(f32));
+    if (sphere_z) store->sphere_z = sphere_z;
+    f32* sphere_radius = (f32*)realloc(store->sphere_radius, capacity * sizeof(f32));
+    if (sphere_radius) store->sphere_radius = sphere_radius;
+    u32* meshes = (u32*)realloc(store->meshes, capacity * sizeof(u32));
+    if (meshes) store->meshes = meshes;
+    u32* slots = (u32*)realloc(store->slots, capacity * sizeof(u32));
+    if (slots) store->slots = slots;
+    u32* indices = (u32*)realloc(store->indices, capacity * sizeof(u32));
+    if (indices) store->indices = indices;
+    u32* generations = (u32*)realloc(store->generations, capacity * sizeof(u32));
+    if (generations) store->generations = generations;
+    u32 word_count = (store->capacity + 63) / 64;
+    u32 new_word_count = (capacity + 63) / 64;
+    u64* dirty_bits = (u64*)realloc(store->dirty_bits, new_word_count * sizeof(u64));
+    if (dirty_bits) {
+        memset(dirty_bits + word_count, 0, (new_word_count - word_count) * sizeof(u64));
+        store->dirty_bits = dirty_bits;
+    }
+    
+    if (!transforms || !bounds || !sphere_x || !sphere_y || !sphere_z || !sphere_radius || !meshes || !slots || !indices || !generations || !dirty_bits) {
+        println("Error: failed to grow the entity store to %u entities", capacity);
+        return false;
+    }
+    
+    store->capacity = capacity;
+    return true;
+}
+
+inline bool add_entity(EntityStore* store, EntityHandle* handle) {
+    if (store->count == store->capacity && !grow_entity_store(store, store->capacity ? 2 * store->capacity : 64)) {
+        return false;
+    }
+    
+    u32 slot = store->free_slot;
+    if (slot != ENTITY_INVALID_INDEX) {
+        store->free_slot = store->indices[slot];
+    } else {
+        slot = store->slot_count++;
+        store->generations[slot] = 1;
+    }
+    
+    u32 index = store->count++;
+    store->indices[slot] = index;
+    store->slots[index] = slot;
+    
+    store->transforms[index].model_matrix = identity_mat4f();
+    store->transforms[index].normal_matrix = identity_mat4f();
+    store->bounds[index] = {};
+    store->meshes[index] = ENTITY_INVALID_INDEX;
+    store->dirty_bits[index / 64] |= 1ull << (index % 64);
+    update_entity_sphere(store, index);
+    
+    handle->slot = slot;
+    handle->generation = store->generations[slot];
+    return true;
+}
+
+// The last entity takes the place of the removed one, only its slot needs to know
+inline bool remove_entity(EntityStore* store, EntityHandle handle) {
+    u32 index = get_entity_index(store, handle);
+    if (index == ENTITY_INVALID_INDEX) return false;
+    
+    u32 last = --store->count;
+    if (index != last) {
+        store->transforms[index] = store->transforms[last];
+        store->bounds[index] = store->bounds[last];
+        store->sphere_x[index] = store->sphere_x[last];
+        store->sphere_y[index] = store->sphere_y[last];
+        store->sphere_z[index] = store->sphere_z[last];
+        store->sphere_radius[index] = store->sphere_radius[last];
+        store->meshes[index] = store->meshes[last];
+        store->slots[index] = store->slots[last];
+        store->indices[store->slots[index]] = index;
+        store->dirty_bits[index / 64] |= 1ull << (index % 64);
+    }
+    
+    store->generations[handle.slot]++;
+    store->indices[handle.slot] = store->free_slot;
+    store->free_slot = handle.slot;
+    
+    return true;
+}
+
+// Indices change when entities are removed, they are only valid until the next removal
+inline u32 get_entity_index(EntityStore* store, EntityHandle handle) {
+    if (handle.slot >= store->slot_count || store->generations[handle.slot] != handle.generation) {
+        return ENTITY_INVALID_INDEX;
+    }
+    
+    return store->indices[handle.slot];
+}
+
+inline bool is_entity_alive(EntityStore* store, EntityHandle handle) {
+    return get_entity_index(store, handle) != ENTITY_INVALID_INDEX;
+}
+
+inline void set_entity_transform(EntityStore* store, u32 index, Mat4f model_matrix) {
+    EntityTransformData* transform = &store->transforms[index];
+    transform->model_matrix = model_matrix;
+    transform->normal_matrix = transpose_inverse(&transform->model_matrix);
+    store->dirty_bits[index / 64] |= 1ull << (index % 64);
+    update_entity_sphere(store, index);
+}
+
+inline void set_entity_bounds(EntityStore* store, u32 index, EntityBounds bounds) {
+    store->bounds[index] = bounds;
+    update_entity_sphere(store, index);
+}
+
+// The radius is scaled by the largest axis of the model matrix so that the sphere still contains
+// the mesh under non uniform scales
+inline void update_entity_sphere(EntityStore* store, u32 index) {
+    Mat4f* m = &store->transforms[index].model_matrix;
+    Vec3f center = store->bounds[index].center;
+    
+    f32 scale_x = m->m00 * m->m00 + m->m10 * m->m10 + m->m20 * m->m20;
+    f32 scale_y = m->m01 * m->m01 + m->m11 * m->m11 + m->m21 * m->m21;
+    f32 scale_z = m->m02 * m->m02 + m->m12 * m->m12 + m->m22 * m->m22;
+    
+    store->sphere_x[index] = m->m00 * center.x + m->m01 * center.y + m->m02 * center.z + m->m03;
+    store->sphere_y[index] = m->m10 * center.x + m->m11 * center.y + m->m12 * center.z + m->m13;
+    store->sphere_z[index] = m->m20 * center.x + m->m21 * center.y + m->m22 * center.z + m->m23;
+    store->sphere_radius[index] = store->bounds[index].radius * sqrtf(max(scale_x, max(scale_y, scale_z)));
+}
+
+// Called once the changes were handed to every copy of the transforms
+inline void clear_entity_dirty_bits(EntityStore* store) {
+    memset(store->dirty_bits, 0, (store->capacity + 63) / 64 * sizeof(u64));
+}
+
+// Centered on the bounding box, not the smallest sphere but close enough for culling
+inline EntityBounds compute_entity_bounds(Vertex* vertices, u32 vertex_count) {
+    EntityBounds bounds = {};
+    if (vertex_count == 0) return bounds;
+    
+    Vec3f box_min = vertices[0].position;
+    Vec3f box_max = vertices[0].position;
+    for (u32 i = 1;i < vertex_count;++i) {
+        Vec3f* position = &vertices[i].position;
+        box_min = new_vec3f(min(box_min.x, position->x), min(box_min.y, position->y), min(box_min.z, position->z));
+        box_max = new_vec3f(max(box_max.x, position->x), max(box_max.y, position->y), max(box_max.z, position->z));
+    }
+    
+    bounds.center = new_vec3f(0.5f * (box_min.x + box_max.x), 0.5f * (box_min.y + box_max.y), 0.5f * (box_min.z + box_max.z));
+    for (u32 i = 0;i < vertex_count;++i) {
+        Vec3f offset = vertices[i].position - bounds.center;
+        f32 distance = length(&offset);
+        if (distance > bounds.radius) {
+            bounds.radius = distance;
+        }
+    }
+    
+    return bounds;
+}
@@ -1,5 +1,10 @@
 #include "cg_files.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 inline u32 get_file_size(FILE* file) {
     u32 size = 0;
     
@@ -10,13 +15,49 @@ inline u32 get_file_size(FILE* file) {
     return size;
 }
 
-inline void copy_file_to(FILE* file, u8* dest, u32 file_size) {
+inline bool copy_file_to(FILE* file, u8* dest, u32 file_size) {
     if (file_size == 0) {
         file_size = get_file_size(file);
     }
     
-    u8* pos = dest;
-    for (u32 i = 0;i < file_size;++i) {
-        *pos++ = fgetc(file);
+    if (fread(dest, 1, file_size, file) != file_size) {
+        println("Error: failed to read %u bytes from a file", file_size);
+        return false;
     }
+    
+    return true;
+}
+
+inline bool map_file(const char* filename, MappedFile* file) {
+    *file = {};
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return false;
+    
+    struct stat file_stat = {};
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    
+    // The mapping keeps the file alive, the descriptor is not needed anymore
+    void* data = mmap(0, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        println("Error: failed to map %s", filename);
+        return false;
+    }
+    
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+    
+    file->data = (u8*)data;
+    file->size = (u64)file_stat.st_size;
+    return true;
+}
+
+inline void unmap_file(MappedFile* file) {
+    if (file->data == 0) return;
+    
+    munmap(file->data, file->size);
+    file->data = 0;
+    file->size = 0;
 }
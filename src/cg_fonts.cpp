@@ -12,8 +12,10 @@ inline u8* load_font_data_from_file(ConstString* filename, MemoryArena* storage)
     u32 file_size = get_file_size(font_file);
     
     u8* font_data = (u8*)allocate(storage, file_size);
-    
-    copy_file_to(font_file, font_data, file_size);
+    if (font_data == 0 || !copy_file_to(font_file, font_data, file_size)) {
+        fclose(font_file);
+        return 0;
+    }
     fclose(font_file);
     
     return font_data;
@@ -41,9 +43,13 @@ inline bool load_font_from_file(Font* font, ConstString* font_name,
 
 // Font Catalog //
 inline bool init_font_catalog(FontCatalog* catalog, u32 size, MemoryArena* storage) {
-    catalog->entries = (FontEntry**)zero_allocate(storage, size * sizeof(FontEntry*));
+    catalog->entries = push_zero_array(storage, FontEntry*, size);
     catalog->size = size;
     
+    if (!init_typed_pool_allocator(&catalog->entry_allocator, storage, FontEntry, MAX_FONT_COUNT)) {
+        return false;
+    }
+    
     return (catalog->entries != 0);
 }
 
@@ -52,7 +58,11 @@ inline bool add_font_to_catalog(FontCatalog* catalog, Font* font, MemoryArena* s
     
     u32 index = font_hash % catalog->size;
     
-    FontEntry* new_entry = (FontEntry*)zero_allocate(storage, sizeof(FontEntry));
+    FontEntry* new_entry = pool_zero_allocate_struct(&catalog->entry_allocator, FontEntry);
+    if (new_entry == 0) {
+        println("Error: too many fonts in the catalog");
+        return false;
+    }
     
     new_entry->font.font_info = font->font_info;
     new_entry->font.name = font->name;
@@ -127,12 +137,10 @@ inline bool init_font_atlas_catalog_resources(FontAtlasCatalog* catalog, Rendere
         return false;
     }
     
-    // Allocate memory
-    VkMemoryRequirements requirements = {};
-    vkGetImageMemoryRequirements(state->device, resources->texture_array, &requirements);
+    // Allocate memory, preferably device local but the atlas can still be sampled from system memory
     VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
     
-    if (!allocate(&state->memory_manager, state->device, requirements, properties, &resources->texture_array_allocation)) {
+    if (!allocate_for_image(&state->memory_manager, state->device, resources->texture_array, 0, &resources->texture_array_allocation, properties, MEMORY_TAG_FONT_ATLAS)) {
         println("Error: failed to allocate memory for font atlas texture.");
         return false;
     }
@@ -162,10 +170,9 @@ inline bool init_font_atlas_catalog_resources(FontAtlasCatalog* catalog, Rendere
         return false;
     }
     
-    vkGetBufferMemoryRequirements(state->device, resources->staging_buffer, &requirements);
     properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
     
-    if (!allocate(&state->memory_manager, state->device, requirements, properties, &resources->staging_buffer_allocation)) {
+    if (!allocate_for_buffer(&state->memory_manager, state->device, resources->staging_buffer, properties, &resources->staging_buffer_allocation, 0, MEMORY_TAG_STAGING)) {
         println("Error: failed to allocate memory for staging buffer.");
         return false;
     }
@@ -401,7 +408,7 @@ inline bool init_font_atlas_catalog_resources(FontAtlasCatalog* catalog, Rendere
 
 inline bool init_font_atlas_catalog(FontAtlasCatalog* catalog, u32 size, RendererState* state, MemoryArena* storage) {
     //catalog->entries = (FontAtlasEntry**)zero_allocate(storage, size * sizeof(FontAtlasEntry*));
-    catalog->atlases = (FontAtlas*)zero_allocate(storage, size * sizeof(FontAtlas));
+    catalog->atlases = push_zero_array(storage, FontAtlas, size);
     catalog->size = size;
     
     if (catalog->atlases == 0) {
@@ -522,14 +529,17 @@ inline bool create_font_atlas(Font* font,
     font_atlas->first_unicode_character = first_unicode_character;
     
     font_atlas->glyph_count = character_count;
-    font_atlas->glyphs = (Glyph*)zero_allocate(storage, character_count * sizeof(Glyph));
+    font_atlas->glyphs = push_zero_array(storage, Glyph, character_count);
     font_atlas->pixels = (u8*)zero_allocate(storage, font_atlas->width * font_atlas->height * sizeof(u8));
     
-    TemporaryMemory temporary_memory = make_temporary_memory(storage);
+    TemporaryMemory scratch = begin_scratch_memory(storage);
     
-    stbtt_packedchar* packed_characters = (stbtt_packedchar*)zero_allocate(&temporary_memory, character_count * sizeof(stbtt_packedchar));
+    stbtt_packedchar* packed_characters = push_zero_array(&scratch, stbtt_packedchar, character_count);
     
-    if (packed_characters == 0) return false;
+    if (packed_characters == 0) {
+        end_scratch_memory(&scratch);
+        return false;
+    }
     
     stbtt_pack_context context = {};
     int result = stbtt_PackBegin(&context,
@@ -540,7 +550,10 @@ inline bool create_font_atlas(Font* font,
                                  1,
                                  nullptr);
     
-    if (result == 0) return false;
+    if (result == 0) {
+        end_scratch_memory(&scratch);
+        return false;
+    }
     stbtt_PackSetSkipMissingCodepoints(&context, 0);
     
     // Generate the font atlas
@@ -556,7 +569,7 @@ inline bool create_font_atlas(Font* font,
         *glyph = make_glyph_from_packed_char(packed_char);
     }
     
-    destroy_temporary_memory(&temporary_memory);
+    end_scratch_memory(&scratch);
     
     return (result != 0);
 }
@@ -0,0 +1,111 @@
+#include "cg_frame_ring.h"
+
+#include <assert.h>
+
+#include "cg_macros.h"
+#include "cg_vk_helper.h"
+
+inline bool init_frame_ring_allocator(FrameRingAllocator* ring, MemoryManager* manager, VkDevice device, VkDeviceSize size, VkDeviceSize alignment, VkBufferUsageFlags usage, u32 queue_family_index) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        println("Error: frame ring alignment must be a power of two");
+        return false;
+    }
+    
+    VkBufferCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.size  = size;
+    create_info.usage = usage;
+    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    create_info.queueFamilyIndexCount = 1;
+    create_info.pQueueFamilyIndices = &queue_family_index;
+    
+    VkResult result = vkCreateBuffer(device, &create_info, nullptr, &ring->buffer);
+    if (result != VK_SUCCESS) {
+        println("vkCreateBuffer returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    VkMemoryRequirements requirements = {};
+    
+    vkGetBufferMemoryRequirements(device, ring->buffer, &requirements);
+    
+    VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkMemoryPropertyFlags preferred_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    
+    if(!allocate(manager, device, requirements, memory_flags, &ring->allocation, preferred_flags, MEMORY_TAG_FRAME_RING)) {
+        return false;
+    }
+    
+    result = vkBindBufferMemory(device, ring->buffer, ring->allocation.device_memory, ring->allocation.offset);
+    if (result != VK_SUCCESS) {
+        println("vkBindBufferMemory returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    ring->size = size;
+    ring->alignment = alignment;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->current_slot = 0;
+    for (u32 i = 0;i < MAX_FRAME_RING_SLOT_COUNT;++i) {
+        ring->frame_end[i] = 0;
+    }
+    
+    return true;
+}
+
+inline void destroy_frame_ring_allocator(FrameRingAllocator* ring, MemoryManager* manager, VkDevice device, bool verbose) {
+    if (verbose) {
+        println("Destroying frame ring");
+    }
+    if (ring->buffer) {
+        if (verbose) {
+            println("    Destroying frame ring buffer (%p)", ring->buffer);
+        }
+        vkDestroyBuffer(device, ring->buffer, nullptr);
+        ring->buffer = 0;
+    }
+    
+    free(manager, &ring->allocation);
+    if (verbose) {
+        println("");
+    }
+}
+
+// Must be called once the fence of the previous frame using this slot has been waited on.
+inline void begin_frame_ring(FrameRingAllocator* ring, u32 slot) {
+    assert(slot < MAX_FRAME_RING_SLOT_COUNT);
+    
+    if (ring->frame_end[slot] > ring->tail) {
+        ring->tail = ring->frame_end[slot];
+    }
+    
+    ring->current_slot = slot;
+    ring->frame_end[slot] = ring->head;
+}
+
+inline bool frame_ring_allocate(FrameRingAllocator* ring, VkDeviceSize size, FrameRingSlice* slice) {
+    if (size > ring->size) return false;
+    
+    u64 start = (ring->head + ring->alignment - 1) & ~(u64)(ring->alignment - 1);
+    
+    // A slice never wraps around the end of the buffer, skip to the beginning instead
+    u64 offset = start % ring->size;
+    if (offset + size > ring->size) {
+        start += ring->size - offset;
+        offset = 0;
+    }
+    
+    if (start + size - ring->tail > ring->size) {
+        println("Error: frame ring is full (%lu bytes in flight)", ring->head - ring->tail);
+        return false;
+    }
+    
+    ring->head = start + size;
+    ring->frame_end[ring->current_slot] = ring->head;
+    
+    slice->offset = offset;
+    slice->data = (u8*)ring->allocation.data + offset;
+    
+    return true;
+}
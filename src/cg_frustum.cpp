@@ -0,0 +1,101 @@
+#include "cg_frustum.h"
+
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Gribb and Hartmann, each plane is a combination of the rows of the matrix. Depth goes from 0 to 1
+// in clip space, the near plane is the third row alone.
+inline Frustum extract_frustum(Mat4f* view_projection) {
+    Mat4f* m = view_projection;
+    Vec4f row0 = new_vec4f(m->m00, m->m01, m->m02, m->m03);
+    Vec4f row1 = new_vec4f(m->m10, m->m11, m->m12, m->m13);
+    Vec4f row2 = new_vec4f(m->m20, m->m21, m->m22, m->m23);
+    Vec4f row3 = new_vec4f(m->m30, m->m31, m->m32, m->m33);
+    
+    Frustum frustum = {};
+    frustum.planes[0] = row3 + row0;
+    frustum.planes[1] = row3 - row0;
+    frustum.planes[2] = row3 + row1;
+    frustum.planes[3] = row3 - row1;
+    frustum.planes[4] = row2;
+    frustum.planes[5] = row3 - row2;
+    
+    for (u32 i = 0;i < FRUSTUM_PLANE_COUNT;++i) {
+        Vec4f* plane = &frustum.planes[i];
+        f32 normal_length = sqrtf(plane->x * plane->x + plane->y * plane->y + plane->z * plane->z);
+        if (normal_length > 0.0f) {
+            *plane = new_vec4f(plane->x / normal_length, plane->y / normal_length, plane->z / normal_length, plane->w / normal_length);
+        }
+    }
+    
+    return frustum;
+}
+
+// A sphere is kept unless it is entirely behind one of the planes. Spheres near a corner of the
+// frustum can be kept while being outside, the draw is wasted but the result stays correct.
+inline u32 cull_spheres_scalar(Frustum* frustum, f32* x, f32* y, f32* z, f32* radius, u32 count, u8* visibility) {
+    u32 visible_count = 0;
+    for (u32 i = 0;i < count;++i) {
+        bool visible = true;
+        for (u32 j = 0;j < FRUSTUM_PLANE_COUNT;++j) {
+            Vec4f* plane = &frustum->planes[j];
+            f32 distance = (plane->x * x[i] + plane->y * y[i]) + (plane->z * z[i] + plane->w);
+            if (distance < -radius[i]) {
+                visible = false;
+                break;
+            }
+        }
+        visibility[i] = visible;
+        visible_count += visible;
+    }
+    
+    return visible_count;
+}
+
+// Same test on four spheres at a time, the bounds are stored one component per array so that
+// they load straight into registers. The remainder goes through the scalar version.
+inline u32 cull_spheres(Frustum* frustum, f32* x, f32* y, f32* z, f32* radius, u32 count, u8* visibility) {
+#if defined(__SSE2__)
+    __m128 plane_x[FRUSTUM_PLANE_COUNT];
+    __m128 plane_y[FRUSTUM_PLANE_COUNT];
+    __m128 plane_z[FRUSTUM_PLANE_COUNT];
+    __m128 plane_w[FRUSTUM_PLANE_COUNT];
+    for (u32 j = 0;j < FRUSTUM_PLANE_COUNT;++j) {
+        plane_x[j] = _mm_set1_ps(frustum->planes[j].x);
+        plane_y[j] = _mm_set1_ps(frustum->planes[j].y);
+        plane_z[j] = _mm_set1_ps(frustum->planes[j].z);
+        plane_w[j] = _mm_set1_ps(frustum->planes[j].w);
+    }
+    
+    u32 visible_count = 0;
+    u32 batch_count = count / 4 * 4;
+    for (u32 i = 0;i < batch_count;i += 4) {
+        __m128 sphere_x = _mm_loadu_ps(x + i);
+        __m128 sphere_y = _mm_loadu_ps(y + i);
+        __m128 sphere_z = _mm_loadu_ps(z + i);
+        __m128 negative_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+        
+        __m128 outside = _mm_setzero_ps();
+        for (u32 j = 0;j < FRUSTUM_PLANE_COUNT;++j) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(plane_x[j], sphere_x), _mm_mul_ps(plane_y[j], sphere_y)),
+                                         _mm_add_ps(_mm_mul_ps(plane_z[j], sphere_z), plane_w[j]));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negative_radius));
+        }
+        
+        i32 mask = ~_mm_movemask_ps(outside) & 0xF;
+        visibility[i + 0] = (mask >> 0) & 1;
+        visibility[i + 1] = (mask >> 1) & 1;
+        visibility[i + 2] = (mask >> 2) & 1;
+        visibility[i + 3] = (mask >> 3) & 1;
+        visible_count += visibility[i + 0] + visibility[i + 1] + visibility[i + 2] + visibility[i + 3];
+    }
+    
+    return visible_count + cull_spheres_scalar(frustum, x + batch_count, y + batch_count, z + batch_count, radius + batch_count,
+                                               count - batch_count, visibility + batch_count);
+#else
+    return cull_spheres_scalar(frustum, x, y, z, radius, count, visibility);
+#endif
+}
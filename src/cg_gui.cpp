@@ -188,45 +188,6 @@ inline bool create_gui_pipeline(GuiResources* resources, RendererState* state) {
     return true;
 }
 
-inline bool create_gui_buffers(GuiResources* resources, RendererState* state, MemoryArena* storage) {
-    resources->buffers = (VkBuffer*)zero_allocate(storage, state->swapchain_image_count * sizeof(VkBuffer));
-    resources->allocations = (AllocatedMemoryChunk*)zero_allocate(storage, state->swapchain_image_count * sizeof(AllocatedMemoryChunk));
-    
-    VkBufferCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_info.size  = MAX_GUI_VERTEX_COUNT * sizeof(GuiVertex);
-    create_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    create_info.queueFamilyIndexCount = 1;
-    create_info.pQueueFamilyIndices = &state->selection.graphics_queue_family_index;
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        VkResult result = vkCreateBuffer(state->device, &create_info, nullptr, &resources->buffers[i]);
-        if (result != VK_SUCCESS) {
-            println("vkCreateBuffer returned (%s)", vk_error_code_str(result));
-            return false;
-        }
-        
-        VkMemoryRequirements requirements = {};
-        
-        vkGetBufferMemoryRequirements(state->device, resources->buffers[i], &requirements);
-        
-        VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-        
-        if(!allocate(&state->memory_manager, state->device, requirements, memory_flags, &resources->allocations[i])) {
-            return false;
-        }
-        
-        result = vkBindBufferMemory(state->device, resources->buffers[i], resources->allocations[i].device_memory, resources->allocations[i].offset);
-        if (result != VK_SUCCESS) {
-            println("vkBindBufferMemory returned (%s)", vk_error_code_str(result));
-            return false;
-        }
-    }
-    
-    return true;
-}
-
 inline bool init_gui_resources(GuiResources* resources, RendererState* state) {
     resources->font_atlas_slot_count = 64;
     if (!create_gui_descriptor_set_layout(resources, state)) {
@@ -244,40 +205,19 @@ inline bool init_gui_resources(GuiResources* resources, RendererState* state) {
         return false;
     }
     
-    if (!create_gui_buffers(resources, state, &state->main_arena)) {
-        println("Error: failed to create gui buffers");
-        return false;
-    }
-    
     if (!init_memory_arena(&resources->main_arena, MB(1))) {
         println("Error: failed to initialize gui memory arena");
         return false;
     }
     
-    return true;
-}
-
-inline void destroy_gui_buffers(GuiResources* resources, RendererState* state, bool verbose) {
-    if (verbose) {
-        println("Destroying GUI buffers");
-    }
-    if (resources->buffers) {
-        for(int i = 0;i < state->swapchain_image_count;++i) {
-            if (verbose) {
-                println("    Destroying GUI buffer (%p)", resources->buffers[i]);
-            }
-            vkDestroyBuffer(state->device, resources->buffers[i], nullptr);
-        }
+    if (!init_dirty_buffer(&resources->vertex_buffer, &state->memory_manager, state->device,
+                           sizeof(GuiVertex), MAX_GUI_VERTEX_COUNT, state->frames_in_flight, 16,
+                           VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, MEMORY_TAG_GUI, state->selection.graphics_queue_family_index)) {
+        println("Error: failed to create gui vertex buffer");
+        return false;
     }
     
-    if (resources->allocations) {
-        for(int i = 0;i < state->swapchain_image_count;++i) {
-            free(&state->memory_manager, &resources->allocations[i]);
-        }
-    }
-    if (verbose) {
-        println("");
-    }
+    return true;
 }
 
 inline void destroy_gui_pipeline(GuiResources* resources, RendererState* state, bool verbose) {
@@ -322,14 +262,15 @@ inline void destroy_gui_descriptor_set_layout(GuiResources* resources, RendererS
 
 inline bool destroy_gui_resources(GuiResources* resources, RendererState* state, bool verbose) {
     destroy_memory_arena(&resources->main_arena);
-    destroy_gui_buffers(resources, state, verbose);
+    destroy_dirty_buffer(&resources->vertex_buffer, &state->memory_manager, state->device, verbose);
     destroy_gui_pipeline(resources, state, verbose);
     destroy_gui_pipeline_layout(resources, state, verbose);
     destroy_gui_descriptor_set_layout(resources, state, verbose);
 }
 
 inline bool init_gui_state(GuiState* gui_state, GuiResources* resources, RendererState* renderer_state, MemoryArena* storage) {
-    gui_state->vertex_buffer = (GuiVertex*)zero_allocate(storage, MAX_GUI_VERTEX_COUNT * sizeof(GuiVertex));
+    gui_state->vertex_buffer = push_zero_array(storage, GuiVertex, MAX_GUI_VERTEX_COUNT);
+    resources->uploaded_vertices = push_zero_array(storage, GuiVertex, MAX_GUI_VERTEX_COUNT);
     gui_state->current_size = 0;
     gui_state->screen_size.x = (i32)renderer_state->swapchain_extent.width;
     gui_state->screen_size.y = (i32)renderer_state->swapchain_extent.height;
@@ -707,3 +648,30 @@ inline void draw_text(GuiState* state, ConstString* text,
         vertex->position = screen_space_to_normalized_space(state->screen_size, vertex->position_int);
     }
 }
+
+// One bar per value from left to right, values above max_value are clamped. Bars are at least a
+// pixel wide, the oldest values are dropped when they do not fit.
+inline void draw_bar_graph(GuiState* state, Rect2i bound, f32* values, u32 value_count, f32 max_value, Vec4f color, Vec4f bar_color) {
+    draw_rectangle(state, bound, color);
+    if (value_count == 0 || max_value <= 0.0f) return;
+    
+    i32 width = bound.right - bound.left;
+    i32 height = bound.bottom - bound.top;
+    if (value_count > (u32)width) {
+        values += value_count - width;
+        value_count = width;
+    }
+    
+    assert(state->current_size + 6 * value_count <= MAX_GUI_VERTEX_COUNT);
+    
+    f32 bar_width = (f32)width / (f32)value_count;
+    for (u32 i = 0;i < value_count;++i) {
+        f32 value = values[i] < max_value ? values[i] : max_value;
+        i32 bar_height = (i32)(value / max_value * (f32)height);
+        if (bar_height == 0) continue;
+        
+        i32 left = bound.left + (i32)(bar_width * (f32)i);
+        i32 right = bound.left + (i32)(bar_width * (f32)(i + 1));
+        draw_rectangle(state, left, bound.bottom - bar_height, right, bound.bottom, bar_color);
+    }
+}
@@ -5,15 +5,13 @@ inline bool init_material_catalog(MaterialCatalog* catalog, RendererState* state
         return false;
     }
     
-    catalog->materials = (Material*)zero_allocate(&state->main_arena,
-                                                  MAX_MATERIAL_COUNT * sizeof(Material));
+    catalog->materials = push_zero_array(&state->main_arena, Material, MAX_MATERIAL_COUNT);
     if (catalog->materials == 0) {
         println("Error: failed to allocate material array.");
         return false;
     }
     
-    catalog->material_entries = (MaterialEntry*)zero_allocate(&state->main_arena,
-                                                              MAX_MATERIAL_COUNT * sizeof(MaterialEntry));
+    catalog->material_entries = push_zero_array(&state->main_arena, MaterialEntry, MAX_MATERIAL_COUNT);
     if (catalog->material_entries == 0) {
         println("Error: failed to allocate material entry array.");
         return false;
@@ -56,8 +54,9 @@ inline static bool create_buffers(MaterialCatalogResources* material_catalog_res
     vkGetBufferMemoryRequirements(state->device, material_catalog_resources->buffer, &requirements);
     
     VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkMemoryPropertyFlags preferred_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
     
-    if (!allocate(&state->memory_manager, state->device, requirements, memory_flags, &material_catalog_resources->allocation)) {
+    if (!allocate(&state->memory_manager, state->device, requirements, memory_flags, &material_catalog_resources->allocation, preferred_flags, MEMORY_TAG_MATERIAL)) {
         println("Error: failed to allocate memory.");
         return false;
     }
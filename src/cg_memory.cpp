@@ -1,23 +1,104 @@
-#include "memory.h"
+#include "cg_memory.h"
 
 #include <string.h>
 #include <stdlib.h>
 
 #include "cg_macros.h"
 
-inline bool init_memory(MemoryManager* manager, u64 allocation_size, u64 min_page_size, VkPhysicalDevice physical_device) {
+#define get_bit(bits, index) (((bits)[(index) >> 3] >> ((index) & 7)) & 1)
+#define set_bit(bits, index) (bits)[(index) >> 3] |= (u8)(1 << ((index) & 7))
+#define clear_bit(bits, index) (bits)[(index) >> 3] &= (u8)~(1 << ((index) & 7))
+
+// Blocks out of the buddy allocator but not used by a resource, they sit in a thread cache
+#define MEMORY_TAG_NOT_HANDED_OUT MEMORY_TAG_COUNT
+
+const char* memory_tag_names[MEMORY_TAG_COUNT] = {
+    "unknown",
+    "entity",
+    "texture",
+    "font atlas",
+    "staging",
+    "material",
+    "frame ring",
+    "depth buffer",
+    "camera",
+    "gui",
+};
+
+inline bool init_memory(MemoryManager* manager, u64 allocation_size, u64 min_page_size, VkPhysicalDevice physical_device, VkDevice device, bool memory_budget_supported) {
+    if (min_page_size == 0 || allocation_size < min_page_size) return false;
+    
+    u64 page_count = allocation_size / min_page_size;
+    if (page_count * min_page_size != allocation_size || (page_count & (page_count - 1)) != 0) {
+        println("Error: allocation size must be a power of two multiple of the minimum page size");
+        return false;
+    }
+    
+    u32 max_order = __builtin_ctzll(page_count);
+    if (max_order >= MAX_BUDDY_ORDER_COUNT) {
+        println("Error: too many pages per memory pool");
+        return false;
+    }
+    
     vkGetPhysicalDeviceMemoryProperties(physical_device, &manager->memory_properties);
     
+    // Dedicated allocation hints are core since Vulkan 1.1
+    VkPhysicalDeviceProperties properties = {};
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    manager->dedicated_allocation_supported = properties.apiVersion >= VK_API_VERSION_1_1;
+    
     manager->pools = (MemoryPool**)calloc(manager->memory_properties.memoryTypeCount, sizeof(MemoryPool*));
     
+    // Only reserved, the pages are committed as pools get created
+    u64 bookkeeping_size = get_pool_bookkeeping_size((u32)page_count);
+    u64 pool_storage_size = MAX_MEMORY_POOL_COUNT * (sizeof(MemoryPool) + bookkeeping_size) + 2 * ARENA_COMMIT_SIZE;
+    if (!init_memory_arena(&manager->pool_storage, pool_storage_size) ||
+        !init_typed_pool_allocator(&manager->pool_allocator, &manager->pool_storage, MemoryPool, MAX_MEMORY_POOL_COUNT) ||
+        !init_pool_allocator(&manager->bookkeeping_allocator, &manager->pool_storage, bookkeeping_size, 64, MAX_MEMORY_POOL_COUNT)) {
+        free_null(manager->pools);
+        return false;
+    }
+    
+    manager->physical_device = physical_device;
+    manager->device = device;
     manager->allocation_size = allocation_size;
     manager->min_page_size = min_page_size;
+    manager->page_count = (u32)page_count;
+    manager->max_order = max_order;
+    manager->dedicated_threshold = allocation_size / 4;
+    manager->statistics = {};
+    manager->residency_policy.warm_pool_count = MEMORY_WARM_POOL_COUNT;
+    manager->residency_policy.idle_time_ns = MEMORY_POOL_IDLE_TIME_NS;
+    
+    // The budget query goes through vkGetPhysicalDeviceMemoryProperties2, core since Vulkan 1.1
+    manager->memory_budget_supported = memory_budget_supported && properties.apiVersion >= VK_API_VERSION_1_1;
+    memset(manager->type_usage, 0, sizeof(manager->type_usage));
+    memset(manager->heap_usage, 0, sizeof(manager->heap_usage));
+    update_memory_budget(manager);
+    
+    pthread_mutex_init(&manager->global_lock, nullptr);
+    for (u32 i = 0;i < VK_MAX_MEMORY_TYPES;++i) {
+        pthread_mutex_init(&manager->type_locks[i], nullptr);
+    }
+    manager->thread_cache_enabled = true;
+    memset(manager->thread_caches, 0, sizeof(manager->thread_caches));
     
     return true;
 }
 
 inline void cleanup_memory(MemoryManager* manager, VkDevice device, bool verbose = false) {
     if (manager == 0) return;
+    if (manager->pools == 0) return;
+    
+    // Blocks kept by the threads go back to the pools first, the other threads must be done by now
+    flush_memory_caches(manager);
+    for (u32 i = 0;i < MAX_MEMORY_THREAD_COUNT;++i) {
+        free_null(manager->thread_caches[i]);
+    }
+    
+    if (manager->statistics.dedicated_allocation_count != 0) {
+        println("Warning: %lu dedicated allocations were not freed", manager->statistics.dedicated_allocation_count);
+    }
     for (int i = 0;i < manager->memory_properties.memoryTypeCount;++i) {
         if (verbose) {
             println("Destroying allocation of type #%d", i);
@@ -28,12 +109,150 @@ inline void cleanup_memory(MemoryManager* manager, VkDevice device, bool verbose
             cleanup_pool(manager, device, current);
             vkFreeMemory(device, current->device_memory, nullptr);
             MemoryPool* next = current->next;
-            free_null(current);
+            manager->pool_table[current->index] = 0;
+            manager->statistics.pool_count--;
+            manager->statistics.pool_size -= manager->allocation_size;
+            update_memory_usage(manager, i, -(i64)manager->allocation_size, 0);
+            pool_free(&manager->pool_allocator, current);
             current = next;
         }
     }
     
     free_null(manager->pools);
+    destroy_memory_arena(&manager->pool_storage, false);
+    
+    pthread_mutex_destroy(&manager->global_lock);
+    for (u32 i = 0;i < VK_MAX_MEMORY_TYPES;++i) {
+        pthread_mutex_destroy(&manager->type_locks[i]);
+    }
+}
+
+inline void lock_memory_type(MemoryManager* manager, u32 type) {
+    pthread_mutex_lock(&manager->type_locks[type]);
+}
+
+inline void unlock_memory_type(MemoryManager* manager, u32 type) {
+    pthread_mutex_unlock(&manager->type_locks[type]);
+}
+
+// Threads get an index the first time they use a memory manager, the same index is used with
+// every manager. The index goes back to the mask when the thread exits and the next thread taking
+// it inherits the caches, blocks in there stay valid.
+u64 memory_thread_mask = 0;
+
+struct MemoryThreadSlot {
+    u32 index = BUDDY_NONE;
+    
+    ~MemoryThreadSlot() {
+        if (index != BUDDY_NONE) {
+            __atomic_fetch_and(&memory_thread_mask, ~(1ull << index), __ATOMIC_RELEASE);
+        }
+    }
+};
+
+thread_local MemoryThreadSlot memory_thread_slot;
+
+inline ThreadMemoryCache* get_thread_memory_cache(MemoryManager* manager) {
+    if (memory_thread_slot.index == BUDDY_NONE) {
+        u64 mask = __atomic_load_n(&memory_thread_mask, __ATOMIC_ACQUIRE);
+        while (mask != ~0ull) {
+            u32 index = __builtin_ctzll(~mask);
+            if (__atomic_compare_exchange_n(&memory_thread_mask, &mask, mask | (1ull << index), true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                memory_thread_slot.index = index;
+                break;
+            }
+        }
+        
+        if (memory_thread_slot.index == BUDDY_NONE) {
+            println("Error: too many threads use the memory manager");
+            return 0;
+        }
+    }
+    
+    ThreadMemoryCache* cache = manager->thread_caches[memory_thread_slot.index];
+    if (!cache) {
+        cache = (ThreadMemoryCache*)calloc(1, sizeof(ThreadMemoryCache));
+        manager->thread_caches[memory_thread_slot.index] = cache;
+    }
+    
+    return cache;
+}
+
+inline bool refill_memory_cache_bin(MemoryManager* manager, VkDevice device, u32 type, u32 order, MemoryCacheBin* bin) {
+    lock_memory_type(manager, type);
+    
+    u32 refill_count = 0;
+    MemoryPool* last_pool = 0;
+    MemoryPool* pool = manager->pools[type];
+    while (refill_count < MEMORY_CACHE_REFILL_COUNT) {
+        if (!pool) {
+            // A new pool is only worth it when the existing ones cannot give a single block
+            if (refill_count > 0) break;
+            if (!allocate_pool_for_type(manager, device, type, &pool)) break;
+            
+            if (last_pool) {
+                last_pool->next = pool;
+            } else {
+                manager->pools[type] = pool;
+            }
+        }
+        
+        u32 page = 0;
+        if (take_buddy_block(pool, order, &page)) {
+            bin->blocks[bin->count].pool_index = pool->index;
+            bin->blocks[bin->count].node = get_buddy_node(pool, order, page);
+            bin->count++;
+            refill_count++;
+        } else {
+            last_pool = pool;
+            pool = pool->next;
+        }
+    }
+    
+    update_memory_usage(manager, type, 0, (i64)refill_count * (manager->min_page_size << order));
+    unlock_memory_type(manager, type);
+    
+    return bin->count > 0;
+}
+
+// Gives the count last blocks of a bin back to their pools
+inline void flush_memory_cache_bin(MemoryManager* manager, u32 type, u32 order, MemoryCacheBin* bin, u32 count) {
+    if (count > bin->count) count = bin->count;
+    if (count == 0) return;
+    
+    lock_memory_type(manager, type);
+    for (u32 i = 0;i < count;++i) {
+        MemoryHandle handle = bin->blocks[--bin->count];
+        MemoryPool* pool = manager->pool_table[handle.pool_index];
+        release_buddy_block(pool, order, get_buddy_node_page(pool, handle.node));
+    }
+    
+    update_memory_usage(manager, type, 0, -(i64)count * (manager->min_page_size << order));
+    unlock_memory_type(manager, type);
+}
+
+inline void flush_thread_memory_cache(MemoryManager* manager, ThreadMemoryCache* cache) {
+    for (u32 type = 0;type < manager->memory_properties.memoryTypeCount;++type) {
+        for (u32 order = 0;order <= MEMORY_CACHE_MAX_ORDER;++order) {
+            MemoryCacheBin* bin = &cache->bins[type][order];
+            flush_memory_cache_bin(manager, type, order, bin, bin->count);
+        }
+    }
+}
+
+inline void flush_thread_memory_cache(MemoryManager* manager) {
+    ThreadMemoryCache* cache = get_thread_memory_cache(manager);
+    if (cache) {
+        flush_thread_memory_cache(manager, cache);
+    }
+}
+
+inline void flush_memory_caches(MemoryManager* manager) {
+    for (u32 i = 0;i < MAX_MEMORY_THREAD_COUNT;++i) {
+        if (manager->thread_caches[i]) {
+            flush_thread_memory_cache(manager, manager->thread_caches[i]);
+        }
+    }
 }
 
 inline void cleanup_pool(MemoryManager* manager, VkDevice device, MemoryPool* pool) {
@@ -43,38 +262,230 @@ inline void cleanup_pool(MemoryManager* manager, VkDevice device, MemoryPool* po
         vkUnmapMemory(device, pool->device_memory);
     }
     
-    cleanup_chunk(manager, &pool->base_chunk);
+    // The bookkeeping arrays share a single element starting at next_free
+    pthread_mutex_lock(&manager->global_lock);
+    pool_free(&manager->bookkeeping_allocator, pool->next_free);
+    pthread_mutex_unlock(&manager->global_lock);
+    pool->next_free = 0;
+    pool->previous_free = 0;
+    pool->split_bits = 0;
+    pool->free_bits = 0;
 }
 
-inline void cleanup_chunk(MemoryManager* manager, MemoryChunk* chunk) {
-    if (chunk->left) {
-        cleanup_chunk(manager, chunk->left);
-        free_null(chunk->left);
-    }
+inline void update_memory_budget(MemoryManager* manager) {
+    VkPhysicalDeviceMemoryProperties* properties = &manager->memory_properties;
     
-    if (chunk->right) {
-        cleanup_chunk(manager, chunk->right);
-        free_null(chunk->right);
+    if (manager->memory_budget_supported) {
+        VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties = {};
+        budget_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+        
+        VkPhysicalDeviceMemoryProperties2 properties2 = {};
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+        properties2.pNext = &budget_properties;
+        
+        vkGetPhysicalDeviceMemoryProperties2(manager->physical_device, &properties2);
+        
+        for (u32 i = 0;i < properties->memoryHeapCount;++i) {
+            MemoryHeapUsage* heap = &manager->heap_usage[i];
+            __atomic_store_n(&heap->budget, budget_properties.heapBudget[i], __ATOMIC_RELAXED);
+            __atomic_store_n(&heap->usage, budget_properties.heapUsage[i], __ATOMIC_RELAXED);
+            __atomic_store_n(&heap->reserved_size_at_budget_update, __atomic_load_n(&heap->reserved_size, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        }
+    } else {
+        // Without the extension, assume the process can use most of each heap for itself
+        for (u32 i = 0;i < properties->memoryHeapCount;++i) {
+            MemoryHeapUsage* heap = &manager->heap_usage[i];
+            u64 reserved_size = __atomic_load_n(&heap->reserved_size, __ATOMIC_RELAXED);
+            __atomic_store_n(&heap->budget, properties->memoryHeaps[i].size / 10 * 8, __ATOMIC_RELAXED);
+            __atomic_store_n(&heap->usage, reserved_size, __ATOMIC_RELAXED);
+            __atomic_store_n(&heap->reserved_size_at_budget_update, reserved_size, __ATOMIC_RELAXED);
+        }
     }
 }
 
-inline i32 find_memory_type_index(MemoryManager* manager, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties) {
+// Types sharing a heap are updated under different locks, the counters are atomic
+inline void update_memory_usage(MemoryManager* manager, u32 type, i64 reserved_delta, i64 used_delta) {
+    MemoryTypeUsage* type_usage = &manager->type_usage[type];
+    __atomic_add_fetch(&type_usage->reserved_size, reserved_delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&type_usage->used_size, used_delta, __ATOMIC_RELAXED);
+    
+    MemoryHeapUsage* heap_usage = &manager->heap_usage[manager->memory_properties.memoryTypes[type].heapIndex];
+    __atomic_add_fetch(&heap_usage->reserved_size, reserved_delta, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&heap_usage->used_size, used_delta, __ATOMIC_RELAXED);
+}
+
+// The fields are read one by one without lock, a concurrent update only makes the estimate a bit off
+inline bool is_heap_over_budget(MemoryManager* manager, u32 heap, VkDeviceSize size) {
+    MemoryHeapUsage* heap_usage = &manager->heap_usage[heap];
+    
+    // What the manager reserved since the last budget update is not in the driver usage yet
+    u64 usage = __atomic_load_n(&heap_usage->usage, __ATOMIC_RELAXED)
+              + __atomic_load_n(&heap_usage->reserved_size, __ATOMIC_RELAXED)
+              - __atomic_load_n(&heap_usage->reserved_size_at_budget_update, __ATOMIC_RELAXED);
+    
+    return usage + size > __atomic_load_n(&heap_usage->budget, __ATOMIC_RELAXED);
+}
+
+// Picks the type with all the required properties that misses the fewest preferred ones. Types
+// are listed by the driver from the most to the least efficient, ties keep the first one. Heaps
+// that cannot take the allocation within their budget are only used when nothing else fits.
+inline i32 find_memory_type_index(MemoryManager* manager, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, VkMemoryPropertyFlags preferred_properties) {
+    i32 best_type = -1;
+    u32 best_cost = 0xFFFFFFFF;
+    
     for (int i = 0;i < manager->memory_properties.memoryTypeCount;++i) {
         u32 memory_type_bit = (1 << i);
         bool valid_memory_type = requirements.memoryTypeBits & memory_type_bit;
         
-        bool valid_flags = (required_properties & manager->memory_properties.memoryTypes[i].propertyFlags) == required_properties;
+        VkMemoryPropertyFlags flags = manager->memory_properties.memoryTypes[i].propertyFlags;
+        bool valid_flags = (required_properties & flags) == required_properties;
         
-        if (valid_memory_type && valid_flags) return i;
+        if (!valid_memory_type || !valid_flags) continue;
+        
+        u32 cost = __builtin_popcount(preferred_properties & ~flags);
+        if (is_heap_over_budget(manager, manager->memory_properties.memoryTypes[i].heapIndex, requirements.size)) {
+            cost += 32;
+        }
+        
+        if (cost < best_cost) {
+            best_type = i;
+            best_cost = cost;
+        }
+    }
+    
+    return best_type;
+}
+
+inline u32 get_buddy_order(MemoryManager* manager, VkDeviceSize size) {
+    u32 order = 0;
+    while ((manager->min_page_size << order) < size) {
+        order++;
+    }
+    
+    return order;
+}
+
+inline u32 get_buddy_node(MemoryPool* pool, u32 order, u32 page) {
+    u32 level = pool->max_order - order;
+    return ((1u << level) - 1) + (page >> order);
+}
+
+// The node gives both the level in the tree and the position in that level
+inline u32 get_buddy_node_order(MemoryPool* pool, u32 node) {
+    u32 level = 31 - __builtin_clz(node + 1);
+    return pool->max_order - level;
+}
+
+inline u32 get_buddy_node_page(MemoryPool* pool, u32 node) {
+    u32 level = 31 - __builtin_clz(node + 1);
+    return (node - ((1u << level) - 1)) << (pool->max_order - level);
+}
+
+inline void push_free_block(MemoryPool* pool, u32 order, u32 page) {
+    u32 head = pool->free_lists[order];
+    
+    pool->next_free[page] = head;
+    pool->previous_free[page] = BUDDY_NONE;
+    if (head != BUDDY_NONE) {
+        pool->previous_free[head] = page;
+    }
+    
+    pool->free_lists[order] = page;
+    pool->free_order_mask |= (1u << order);
+    
+    u32 node = get_buddy_node(pool, order, page);
+    set_bit(pool->free_bits, node);
+}
+
+inline void remove_free_block(MemoryPool* pool, u32 order, u32 page) {
+    u32 next = pool->next_free[page];
+    u32 previous = pool->previous_free[page];
+    
+    if (previous != BUDDY_NONE) {
+        pool->next_free[previous] = next;
+    } else {
+        pool->free_lists[order] = next;
     }
     
-    return -1;
+    if (next != BUDDY_NONE) {
+        pool->previous_free[next] = previous;
+    }
+    
+    if (pool->free_lists[order] == BUDDY_NONE) {
+        pool->free_order_mask &= ~(1u << order);
+    }
+    
+    u32 node = get_buddy_node(pool, order, page);
+    clear_bit(pool->free_bits, node);
 }
 
-inline bool allocate_pool_for_type(MemoryManager* manager, VkDevice device, u32 type, VkMemoryPropertyFlags flags, MemoryPool** pool) {
-    MemoryPool* new_pool = (MemoryPool*)calloc(1, sizeof(MemoryPool));
-    new_pool->base_chunk.size = manager->allocation_size;
+// Links, bitmaps and tags of a pool, in the order they are laid out in its bookkeeping element
+inline u64 get_pool_bookkeeping_size(u32 page_count) {
+    u64 node_count = 2 * (u64)page_count - 1;
+    u64 bitmap_size = (node_count + 7) / 8;
+    u64 link_size = page_count * sizeof(u32);
+    
+    u64 bookkeeping_size = 2 * link_size + 2 * bitmap_size;
+#ifdef MEMORY_TAGGING
+    bookkeeping_size += link_size + page_count;
+#endif
+    
+    return bookkeeping_size;
+}
+
+// Creating a pool is rare enough to hold the global lock all along, the slot found in the table
+// stays free until the pool is stored in it.
+inline bool allocate_pool_for_type(MemoryManager* manager, VkDevice device, u32 type, MemoryPool** pool) {
+    pthread_mutex_lock(&manager->global_lock);
+    
+    u32 index = 0;
+    while (index < MAX_MEMORY_POOL_COUNT && manager->pool_table[index] != 0) {
+        index++;
+    }
+    
+    if (index == MAX_MEMORY_POOL_COUNT) {
+        println("Error: too many memory pools");
+        pthread_mutex_unlock(&manager->global_lock);
+        return false;
+    }
+    
+    MemoryPool* new_pool = pool_zero_allocate_struct(&manager->pool_allocator, MemoryPool);
+    u8* bookkeeping = (u8*)pool_zero_allocate(&manager->bookkeeping_allocator);
+    if (new_pool == 0 || bookkeeping == 0) {
+        println("Error: no storage left for a memory pool");
+        pool_free(&manager->bookkeeping_allocator, bookkeeping);
+        pool_free(&manager->pool_allocator, new_pool);
+        pthread_mutex_unlock(&manager->global_lock);
+        return false;
+    }
+    
     new_pool->memory_type = type;
+    new_pool->index = index;
+    new_pool->page_count = manager->page_count;
+    new_pool->max_order = manager->max_order;
+    
+    // All the bookkeeping is taken once here, allocations and frees never touch the heap
+    u64 node_count = 2 * (u64)manager->page_count - 1;
+    u64 bitmap_size = (node_count + 7) / 8;
+    u64 link_size = manager->page_count * sizeof(u32);
+    
+    new_pool->next_free     = (u32*)bookkeeping;
+    new_pool->previous_free = (u32*)(bookkeeping + link_size);
+    new_pool->split_bits    = bookkeeping + 2 * link_size;
+    new_pool->free_bits     = bookkeeping + 2 * link_size + bitmap_size;
+    
+#ifdef MEMORY_TAGGING
+    new_pool->block_requested_sizes = (u32*)(bookkeeping + 2 * link_size + 2 * bitmap_size);
+    new_pool->block_tags            = bookkeeping + 3 * link_size + 2 * bitmap_size;
+    memset(new_pool->block_tags, MEMORY_TAG_NOT_HANDED_OUT, manager->page_count);
+#endif
+    
+    for (u32 i = 0;i < MAX_BUDDY_ORDER_COUNT;++i) {
+        new_pool->free_lists[i] = BUDDY_NONE;
+    }
+    push_free_block(new_pool, new_pool->max_order, 0);
+    
+    update_memory_budget(manager);
     
     VkMemoryAllocateInfo allocate_info = {};
     allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
@@ -84,207 +495,768 @@ inline bool allocate_pool_for_type(MemoryManager* manager, VkDevice device, u32
     VkResult result = vkAllocateMemory(device, &allocate_info, nullptr, &new_pool->device_memory);
     
     if (result != VK_SUCCESS) {
-        free_null(new_pool);
+        pool_free(&manager->bookkeeping_allocator, bookkeeping);
+        pool_free(&manager->pool_allocator, new_pool);
+        pthread_mutex_unlock(&manager->global_lock);
         return false;
     }
     
-    if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    // Pools are shared by everything using the type, map them whenever the type allows it
+    if (manager->memory_properties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
         new_pool->mappable = true;
         VkResult result = vkMapMemory(device, new_pool->device_memory, 0, VK_WHOLE_SIZE, 0, &new_pool->data);
         if (result != VK_SUCCESS) {
             vkFreeMemory(device, new_pool->device_memory, nullptr);
-            free_null(new_pool);
+            pool_free(&manager->bookkeeping_allocator, bookkeeping);
+            pool_free(&manager->pool_allocator, new_pool);
+            pthread_mutex_unlock(&manager->global_lock);
             return false;
         }
     }
     
+    manager->pool_table[index] = new_pool;
     *pool = new_pool;
     
+    manager->statistics.pool_count++;
+    manager->statistics.pool_size += manager->allocation_size;
+    update_memory_usage(manager, type, manager->allocation_size, 0);
+    
+    pthread_mutex_unlock(&manager->global_lock);
+    
     return true;
 }
 
-inline bool allocate(MemoryManager* manager, VkDevice device, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk) {
-    if (requirements.size > manager->allocation_size) return false; // We will never find a spot big enough
+// Creates pools up front for a declared budget, so that the allocations made later in the type
+// picked for these properties do not wait on the driver. Pools already reserved for the type count.
+inline bool reserve_memory(MemoryManager* manager, VkDevice device, VkMemoryPropertyFlags required_properties, VkMemoryPropertyFlags preferred_properties, VkDeviceSize size) {
+    VkMemoryRequirements requirements = {};
+    requirements.size = manager->allocation_size;
+    requirements.alignment = 1;
+    requirements.memoryTypeBits = ~0u;
     
-    i32 memory_type = find_memory_type_index(manager, requirements, required_properties);
-    if (memory_type == -1) return false;
+    i32 memory_type = find_memory_type_index(manager, requirements, required_properties, preferred_properties);
+    if (memory_type == -1) {
+        println("Error: no memory type to reserve %lu KB in", size / 1024);
+        return false;
+    }
     
-    MemoryPool* pool = manager->pools[memory_type];
-    if (!pool) {
-        MemoryPool* just_allocated_pool = 0;
-        if(!allocate_pool_for_type(manager, device, memory_type, required_properties, &just_allocated_pool)) {
+    u64 pool_count = (size + manager->allocation_size - 1) / manager->allocation_size;
+    
+    lock_memory_type(manager, memory_type);
+    
+    MemoryPool** link = &manager->pools[memory_type];
+    while (*link) {
+        if ((*link)->reserved) pool_count = pool_count > 0 ? pool_count - 1 : 0;
+        link = &(*link)->next;
+    }
+    
+    for (u64 i = 0;i < pool_count;++i) {
+        MemoryPool* pool = 0;
+        if (!allocate_pool_for_type(manager, device, memory_type, &pool)) {
+            unlock_memory_type(manager, memory_type);
+            println("Error: failed to reserve a pool of type %d", memory_type);
             return false;
         }
         
-        manager->pools[memory_type] = just_allocated_pool;
+        pool->reserved = true;
+        *link = pool;
+        link = &pool->next;
+    }
+    
+    unlock_memory_type(manager, memory_type);
+    
+    return true;
+}
+
+inline bool allocate(MemoryManager* manager, VkDevice device, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk, VkMemoryPropertyFlags preferred_properties, MemoryTag tag) {
+    // Big resources would take a large part of a pool, give them their own memory instead
+    if (requirements.size > manager->dedicated_threshold) {
+        return allocate_dedicated(manager, device, requirements, required_properties, preferred_properties, 0, 0, allocated_chunk, tag);
+    }
+    
+    // When a type runs out of memory, fall back to the next best one
+    VkMemoryRequirements candidates = requirements;
+    i32 memory_type = find_memory_type_index(manager, candidates, required_properties, preferred_properties);
+    while (memory_type != -1) {
+        if (allocate_from_type(manager, device, memory_type, requirements, allocated_chunk)) {
+            tag_memory_chunk(manager, allocated_chunk, tag);
+            return true;
+        }
+        
+        candidates.memoryTypeBits &= ~(1u << memory_type);
+        memory_type = find_memory_type_index(manager, candidates, required_properties, preferred_properties);
+    }
+    
+    return false;
+}
+
+inline bool allocate_from_type(MemoryManager* manager, VkDevice device, u32 memory_type, VkMemoryRequirements requirements, AllocatedMemoryChunk* allocated_chunk) {
+    if (requirements.size > manager->allocation_size) return false;
+    
+    // Buddy blocks are aligned on their own size, so asking for at least the alignment is enough
+    VkDeviceSize size = requirements.size > requirements.alignment ? requirements.size : requirements.alignment;
+    u32 order = get_buddy_order(manager, size);
+    
+    ThreadMemoryCache* cache = get_thread_memory_cache(manager);
+    if (!cache) return false;
+    
+    // Small blocks come from the thread cache, the shared pools are only locked to refill it
+    if (manager->thread_cache_enabled && order <= MEMORY_CACHE_MAX_ORDER) {
+        MemoryCacheBin* bin = &cache->bins[memory_type][order];
+        if (bin->count == 0 && !refill_memory_cache_bin(manager, device, memory_type, order, bin)) {
+            return false;
+        }
+        
+        MemoryHandle handle = bin->blocks[--bin->count];
+        MemoryPool* pool = manager->pool_table[handle.pool_index];
+        VkDeviceSize offset = (VkDeviceSize)get_buddy_node_page(pool, handle.node) * manager->min_page_size;
+        
+        allocated_chunk->device_memory  = pool->device_memory;
+        allocated_chunk->memory_type    = pool->memory_type;
+        allocated_chunk->allocated_size = manager->min_page_size << order;
+        allocated_chunk->real_size      = requirements.size;
+        allocated_chunk->offset         = offset;
+        allocated_chunk->mappable       = pool->mappable;
+        allocated_chunk->data           = pool->mappable ? (u8*)pool->data + offset : 0;
+        allocated_chunk->handle         = handle;
+        allocated_chunk->dedicated      = false;
+        
+        cache->statistics.pooled_allocation_count++;
+        cache->statistics.pooled_requested_size += allocated_chunk->real_size;
+        cache->statistics.pooled_allocated_size += allocated_chunk->allocated_size;
         
-        return allocate_from_pool(manager, just_allocated_pool, requirements, allocated_chunk);
+        return true;
     }
     
+    lock_memory_type(manager, memory_type);
+    
     MemoryPool* last_pool = 0;
+    MemoryPool* pool = manager->pools[memory_type];
     while (pool) {
-        if (allocate_from_pool(manager, pool, requirements, allocated_chunk)) return true;
+        if (allocate_from_pool(manager, pool, requirements, allocated_chunk)) {
+            unlock_memory_type(manager, memory_type);
+            return true;
+        }
         last_pool = pool;
         pool = pool->next;
     }
     
     MemoryPool* just_allocated_pool = 0;
-    if(!allocate_pool_for_type(manager, device, memory_type, required_properties, &just_allocated_pool)) {
+    if(!allocate_pool_for_type(manager, device, memory_type, &just_allocated_pool)) {
+        unlock_memory_type(manager, memory_type);
         return false;
     }
     
-    last_pool->next = just_allocated_pool;
+    if (last_pool) {
+        last_pool->next = just_allocated_pool;
+    } else {
+        manager->pools[memory_type] = just_allocated_pool;
+    }
+    
+    bool result = allocate_from_pool(manager, just_allocated_pool, requirements, allocated_chunk);
+    unlock_memory_type(manager, memory_type);
+    
+    return result;
+}
+
+// Takes the smallest free block that fits and splits it down to the requested order
+inline bool take_buddy_block(MemoryPool* pool, u32 order, u32* block_page) {
+    if (order > pool->max_order) return false;
+    
+    u32 available_orders = pool->free_order_mask >> order;
+    if (available_orders == 0) return false;
+    
+    u32 current_order = order + __builtin_ctz(available_orders);
+    u32 page = pool->free_lists[current_order];
+    remove_free_block(pool, current_order, page);
+    
+    while (current_order > order) {
+        set_bit(pool->split_bits, get_buddy_node(pool, current_order, page));
+        current_order--;
+        push_free_block(pool, current_order, page + (1u << current_order));
+    }
+    
+    *block_page = page;
+    return true;
+}
+
+// Merges the block with its buddy as long as it is free
+inline void release_buddy_block(MemoryPool* pool, u32 order, u32 page) {
+    while (order < pool->max_order) {
+        u32 buddy_page = page ^ (1u << order);
+        if (!get_bit(pool->free_bits, get_buddy_node(pool, order, buddy_page))) break;
+        
+        remove_free_block(pool, order, buddy_page);
+        page &= ~(1u << order);
+        order++;
+        clear_bit(pool->split_bits, get_buddy_node(pool, order, page));
+    }
     
-    return allocate_from_pool(manager, just_allocated_pool, requirements, allocated_chunk);
+    push_free_block(pool, order, page);
 }
 
 inline bool allocate_from_pool(MemoryManager* manager, MemoryPool* pool, VkMemoryRequirements requirements, AllocatedMemoryChunk* allocated_chunk) {
     if (pool == 0) return false;
     if (requirements.size > manager->allocation_size) return false;
     
-    return allocate_from_chunk(manager, pool, &pool->base_chunk, requirements, allocated_chunk);
+    ThreadMemoryCache* cache = get_thread_memory_cache(manager);
+    if (!cache) return false;
+    
+    VkDeviceSize size = requirements.size > requirements.alignment ? requirements.size : requirements.alignment;
+    u32 order = get_buddy_order(manager, size);
+    
+    u32 page = 0;
+    if (!take_buddy_block(pool, order, &page)) return false;
+    
+    VkDeviceSize offset = (VkDeviceSize)page * manager->min_page_size;
+    
+    allocated_chunk->device_memory  = pool->device_memory;
+    allocated_chunk->memory_type    = pool->memory_type;
+    allocated_chunk->allocated_size = manager->min_page_size << order;
+    allocated_chunk->real_size      = requirements.size;
+    allocated_chunk->offset         = offset;
+    allocated_chunk->mappable       = pool->mappable;
+    allocated_chunk->data           = pool->mappable ? (u8*)pool->data + offset : 0;
+    
+    allocated_chunk->handle.pool_index = pool->index;
+    allocated_chunk->handle.node       = get_buddy_node(pool, order, page);
+    allocated_chunk->dedicated         = false;
+    
+    cache->statistics.pooled_allocation_count++;
+    cache->statistics.pooled_requested_size += allocated_chunk->real_size;
+    cache->statistics.pooled_allocated_size += allocated_chunk->allocated_size;
+    update_memory_usage(manager, pool->memory_type, 0, allocated_chunk->allocated_size);
+    
+    return true;
 }
 
-inline bool allocate_from_chunk(MemoryManager* manager, MemoryPool* pool, MemoryChunk* chunk, VkMemoryRequirements requirements, AllocatedMemoryChunk* allocated_chunk) {
-    if (chunk->full) {
-        return false;
+inline bool allocate_dedicated(MemoryManager* manager, VkDevice device, VkMemoryRequirements requirements, VkMemoryPropertyFlags required_properties, VkMemoryPropertyFlags preferred_properties, VkBuffer buffer, VkImage image, AllocatedMemoryChunk* allocated_chunk, MemoryTag tag) {
+    pthread_mutex_lock(&manager->global_lock);
+    update_memory_budget(manager);
+    pthread_mutex_unlock(&manager->global_lock);
+    
+    VkMemoryAllocateInfo allocate_info = {};
+    allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocate_info.allocationSize = requirements.size;
+    
+    // Tell the driver which resource will live in this memory, some of them can optimize for it
+    VkMemoryDedicatedAllocateInfo dedicated_info = {};
+    dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    dedicated_info.buffer = buffer;
+    dedicated_info.image = image;
+    if (manager->dedicated_allocation_supported && (buffer || image)) {
+        allocate_info.pNext = &dedicated_info;
     }
-    if (requirements.size > chunk->size) return false; // This should never happen
     
-    if (chunk->size == manager->min_page_size) {
-        allocated_chunk->device_memory  = pool->device_memory;
-        allocated_chunk->memory_type    = pool->memory_type;
-        allocated_chunk->allocated_size = chunk->size;
-        allocated_chunk->real_size      = requirements.size;
-        allocated_chunk->offset         = chunk->offset;
-        allocated_chunk->mappable       = pool->mappable;
-        allocated_chunk->data           = (u8*)pool->data + chunk->offset;
+    // When a type runs out of memory, fall back to the next best one
+    VkMemoryRequirements candidates = requirements;
+    VkDeviceMemory device_memory = 0;
+    i32 memory_type = find_memory_type_index(manager, candidates, required_properties, preferred_properties);
+    while (memory_type != -1) {
+        allocate_info.memoryTypeIndex = memory_type;
+        if (vkAllocateMemory(device, &allocate_info, nullptr, &device_memory) == VK_SUCCESS) break;
         
-        chunk->full = true;
-        return true;
+        candidates.memoryTypeBits &= ~(1u << memory_type);
+        memory_type = find_memory_type_index(manager, candidates, required_properties, preferred_properties);
     }
     
-    VkDeviceSize sub_chunk_size = chunk->size / 2;
-    if (requirements.size > sub_chunk_size) {
-        if (!chunk->left && !chunk->right) {
-            allocated_chunk->device_memory  = pool->device_memory;
-            allocated_chunk->memory_type    = pool->memory_type;
-            allocated_chunk->allocated_size = chunk->size;
-            allocated_chunk->real_size      = requirements.size;
-            allocated_chunk->offset         = chunk->offset;
-            allocated_chunk->mappable       = pool->mappable;
-            allocated_chunk->data           = (u8*)pool->data + chunk->offset;
-            chunk->full = true;
-            return true;
+    if (memory_type == -1) return false;
+    
+    void* data = 0;
+    bool mappable = manager->memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    if (mappable) {
+        VkResult result = vkMapMemory(device, device_memory, 0, VK_WHOLE_SIZE, 0, &data);
+        if (result != VK_SUCCESS) {
+            vkFreeMemory(device, device_memory, nullptr);
+            return false;
         }
-        
-        return false;
     }
     
-    if (chunk->left == 0 && chunk->right == 0) {
-        MemoryChunk* left  = (MemoryChunk*)calloc(1, sizeof(MemoryChunk));
-        left->offset = chunk->offset;
-        left->size   = sub_chunk_size;
+    allocated_chunk->device_memory  = device_memory;
+    allocated_chunk->memory_type    = memory_type;
+    allocated_chunk->allocated_size = requirements.size;
+    allocated_chunk->real_size      = requirements.size;
+    allocated_chunk->offset         = 0;
+    allocated_chunk->mappable       = mappable;
+    allocated_chunk->data           = data;
+    
+    allocated_chunk->handle    = {};
+    allocated_chunk->dedicated = true;
+    
+    pthread_mutex_lock(&manager->global_lock);
+    manager->statistics.dedicated_allocation_count++;
+    manager->statistics.dedicated_size += requirements.size;
+    pthread_mutex_unlock(&manager->global_lock);
+    update_memory_usage(manager, memory_type, requirements.size, requirements.size);
+    tag_memory_chunk(manager, allocated_chunk, tag);
+    
+    return true;
+}
+
+inline bool allocate_for_buffer(MemoryManager* manager, VkDevice device, VkBuffer buffer, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk, VkMemoryPropertyFlags preferred_properties, MemoryTag tag) {
+    VkMemoryRequirements requirements = {};
+    bool prefers_dedicated = false;
+    
+    if (manager->dedicated_allocation_supported) {
+        VkBufferMemoryRequirementsInfo2 requirements_info = {};
+        requirements_info.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+        requirements_info.buffer = buffer;
+        
+        VkMemoryDedicatedRequirements dedicated_requirements = {};
+        dedicated_requirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+        
+        VkMemoryRequirements2 requirements2 = {};
+        requirements2.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+        requirements2.pNext = &dedicated_requirements;
         
-        MemoryChunk* right = (MemoryChunk*)calloc(1, sizeof(MemoryChunk));
-        right->offset = chunk->offset + sub_chunk_size;
-        right->size   = sub_chunk_size;
+        vkGetBufferMemoryRequirements2(device, &requirements_info, &requirements2);
         
-        chunk->left = left;
-        chunk->right = right;
-        return allocate_from_chunk(manager, pool, chunk->left, requirements, allocated_chunk); // This should never fail because we created a chunk big enough
+        requirements = requirements2.memoryRequirements;
+        prefers_dedicated = dedicated_requirements.prefersDedicatedAllocation || dedicated_requirements.requiresDedicatedAllocation;
+    } else {
+        vkGetBufferMemoryRequirements(device, buffer, &requirements);
     }
     
-    bool found_left = allocate_from_chunk(manager, pool, chunk->left, requirements, allocated_chunk);
-    if (found_left) {
-        chunk->full = chunk->left->full && chunk->right->full;
-        
-        return true;
+    if (prefers_dedicated || requirements.size > manager->dedicated_threshold) {
+        return allocate_dedicated(manager, device, requirements, required_properties, preferred_properties, buffer, 0, allocated_chunk, tag);
     }
     
-    bool found_right = allocate_from_chunk(manager, pool, chunk->right, requirements, allocated_chunk);
-    if (found_right) {
-        chunk->full = chunk->left->full && chunk->right->full;
+    return allocate(manager, device, requirements, required_properties, allocated_chunk, preferred_properties, tag);
+}
+
+inline bool allocate_for_image(MemoryManager* manager, VkDevice device, VkImage image, VkMemoryPropertyFlags required_properties, AllocatedMemoryChunk* allocated_chunk, VkMemoryPropertyFlags preferred_properties, MemoryTag tag) {
+    VkMemoryRequirements requirements = {};
+    bool prefers_dedicated = false;
+    
+    if (manager->dedicated_allocation_supported) {
+        VkImageMemoryRequirementsInfo2 requirements_info = {};
+        requirements_info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+        requirements_info.image = image;
         
-        return true;
+        VkMemoryDedicatedRequirements dedicated_requirements = {};
+        dedicated_requirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+        
+        VkMemoryRequirements2 requirements2 = {};
+        requirements2.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+        requirements2.pNext = &dedicated_requirements;
+        
+        vkGetImageMemoryRequirements2(device, &requirements_info, &requirements2);
+        
+        requirements = requirements2.memoryRequirements;
+        prefers_dedicated = dedicated_requirements.prefersDedicatedAllocation || dedicated_requirements.requiresDedicatedAllocation;
+    } else {
+        vkGetImageMemoryRequirements(device, image, &requirements);
+    }
+    
+    if (prefers_dedicated || requirements.size > manager->dedicated_threshold) {
+        return allocate_dedicated(manager, device, requirements, required_properties, preferred_properties, 0, image, allocated_chunk, tag);
+    }
+    
+    return allocate(manager, device, requirements, required_properties, allocated_chunk, preferred_properties, tag);
+}
+
+// Tagging is compiled out in release builds, these functions are then empty. Counters live in the
+// thread caches like the pooled statistics, see get_memory_tag_usage().
+inline void tag_memory_chunk(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk, MemoryTag tag) {
+#ifdef MEMORY_TAGGING
+    ThreadMemoryCache* cache = get_thread_memory_cache(manager);
+    if (!cache) return;
+    
+    allocated_chunk->tag = tag;
+    
+    MemoryTagUsage* usage = &cache->tag_usage[tag];
+    usage->allocation_count++;
+    usage->requested_size += allocated_chunk->real_size;
+    usage->allocated_size += allocated_chunk->allocated_size;
+    
+    if (!allocated_chunk->dedicated) {
+        MemoryPool* pool = manager->pool_table[allocated_chunk->handle.pool_index];
+        u32 page = get_buddy_node_page(pool, allocated_chunk->handle.node);
+        pool->block_tags[page] = tag;
+        pool->block_requested_sizes[page] = (u32)allocated_chunk->real_size;
     }
+#endif
+}
+
+inline void untag_memory_chunk(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk) {
+#ifdef MEMORY_TAGGING
+    ThreadMemoryCache* cache = get_thread_memory_cache(manager);
+    if (!cache) return;
     
-    // @Note: maybe we should assert that when we come to this portion we are not in the case where the children have just been created ?
+    MemoryTagUsage* usage = &cache->tag_usage[allocated_chunk->tag];
+    usage->allocation_count--;
+    usage->requested_size -= allocated_chunk->real_size;
+    usage->allocated_size -= allocated_chunk->allocated_size;
     
-    return false; // In the case where two children tree already exist and we've not found a suitable location.
+    if (!allocated_chunk->dedicated) {
+        MemoryPool* pool = manager->pool_table[allocated_chunk->handle.pool_index];
+        pool->block_tags[get_buddy_node_page(pool, allocated_chunk->handle.node)] = MEMORY_TAG_NOT_HANDED_OUT;
+    }
+#endif
+}
+
+inline MemoryTag get_memory_tag(AllocatedMemoryChunk* allocated_chunk) {
+#ifdef MEMORY_TAGGING
+    return allocated_chunk->tag;
+#else
+    return MEMORY_TAG_UNKNOWN;
+#endif
+}
+
+inline void get_memory_tag_usage(MemoryManager* manager, MemoryTag tag, MemoryTagUsage* usage) {
+    *usage = {};
+    
+#ifdef MEMORY_TAGGING
+    for (u32 i = 0;i < MAX_MEMORY_THREAD_COUNT;++i) {
+        ThreadMemoryCache* cache = manager->thread_caches[i];
+        if (!cache) continue;
+        
+        usage->allocation_count += cache->tag_usage[tag].allocation_count;
+        usage->requested_size += cache->tag_usage[tag].requested_size;
+        usage->allocated_size += cache->tag_usage[tag].allocated_size;
+    }
+#endif
 }
 
 inline void free(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk) {
     if (!allocated_chunk) return;
     if (!allocated_chunk->device_memory) return;
     
-    MemoryPool* pool = manager->pools[allocated_chunk->memory_type];
-    while (pool) {
-        if (pool->device_memory == allocated_chunk->device_memory) {
-            free_from_pool(manager, pool, allocated_chunk);
-            return;
+    if (allocated_chunk->dedicated) {
+        free_dedicated(manager, allocated_chunk);
+        return;
+    }
+    
+    if (allocated_chunk->handle.pool_index >= MAX_MEMORY_POOL_COUNT) return;
+    
+    MemoryPool* pool = manager->pool_table[allocated_chunk->handle.pool_index];
+    if (!pool) return;
+    if (allocated_chunk->device_memory != pool->device_memory) return;
+    
+    ThreadMemoryCache* cache = get_thread_memory_cache(manager);
+    if (!cache) return;
+    
+    untag_memory_chunk(manager, allocated_chunk);
+    
+    u32 type = allocated_chunk->memory_type;
+    u32 order = get_buddy_order(manager, allocated_chunk->allocated_size);
+    
+    // Small blocks go back to the cache of the freeing thread, half of a full bin returns to the pools
+    if (manager->thread_cache_enabled && order <= MEMORY_CACHE_MAX_ORDER) {
+        MemoryCacheBin* bin = &cache->bins[type][order];
+        if (bin->count == MEMORY_CACHE_BLOCK_COUNT) {
+            flush_memory_cache_bin(manager, type, order, bin, MEMORY_CACHE_BLOCK_COUNT / 2);
         }
-        pool = pool->next;
+        bin->blocks[bin->count++] = allocated_chunk->handle;
+        
+        cache->statistics.pooled_allocation_count--;
+        cache->statistics.pooled_requested_size -= allocated_chunk->real_size;
+        cache->statistics.pooled_allocated_size -= allocated_chunk->allocated_size;
+        
+        allocated_chunk->device_memory = 0;
+        allocated_chunk->data = 0;
+        return;
     }
+    
+    lock_memory_type(manager, type);
+    free_from_pool(manager, pool, allocated_chunk);
+    unlock_memory_type(manager, type);
 }
 
 inline void free_from_pool(MemoryManager* manager, MemoryPool* pool, AllocatedMemoryChunk* allocated_chunk) {
     if (allocated_chunk->device_memory != pool->device_memory) return;
     
-    free_from_chunk(manager, pool, &pool->base_chunk, allocated_chunk);
+    u32 node = allocated_chunk->handle.node;
+    if (node >= 2 * pool->page_count - 1) return;
+    
+    if (get_bit(pool->free_bits, node) || get_bit(pool->split_bits, node)) {
+        println("**** ERROR ****");
+        // Error this should not happen. This means that the chunk was already freed or never allocated
+        return;
+    }
+    
+    ThreadMemoryCache* cache = get_thread_memory_cache(manager);
+    if (!cache) return;
+    
+    release_buddy_block(pool, get_buddy_node_order(pool, node), get_buddy_node_page(pool, node));
+    
+    cache->statistics.pooled_allocation_count--;
+    cache->statistics.pooled_requested_size -= allocated_chunk->real_size;
+    cache->statistics.pooled_allocated_size -= allocated_chunk->allocated_size;
+    update_memory_usage(manager, pool->memory_type, 0, -(i64)allocated_chunk->allocated_size);
+    
+    allocated_chunk->device_memory = 0;
+    allocated_chunk->data = 0;
 }
 
-inline void free_from_chunk(MemoryManager* manager, MemoryPool* pool, MemoryChunk* chunk, AllocatedMemoryChunk* allocated_chunk) {
-    if (allocated_chunk->allocated_size == chunk->size && allocated_chunk->offset == chunk->offset) {
-        chunk->full = false;
-        return;
+inline void free_dedicated(MemoryManager* manager, AllocatedMemoryChunk* allocated_chunk) {
+    untag_memory_chunk(manager, allocated_chunk);
+    
+    if (allocated_chunk->mappable) {
+        vkUnmapMemory(manager->device, allocated_chunk->device_memory);
     }
+    vkFreeMemory(manager->device, allocated_chunk->device_memory, nullptr);
     
-    u32 sub_chunk_size = chunk->size / 2;
-    if (allocated_chunk->offset >= chunk->offset + sub_chunk_size) {
-        if (chunk->right == 0) {
-            println("**** ERROR ****");
-            // Error this should not happen. This means that this chunk has not been split but we have an allocated subchunk
-            return;
-        }
-        free_from_chunk(manager, pool, chunk->right, allocated_chunk);
-    } else {
-        if (chunk->left == 0) {
-            println("**** ERROR ****");
-            // Error this should not happen. This means that this chunk has not been split but we have an allocated subchunk
-            return;
+    pthread_mutex_lock(&manager->global_lock);
+    manager->statistics.dedicated_allocation_count--;
+    manager->statistics.dedicated_size -= allocated_chunk->allocated_size;
+    pthread_mutex_unlock(&manager->global_lock);
+    update_memory_usage(manager, allocated_chunk->memory_type, -(i64)allocated_chunk->allocated_size, -(i64)allocated_chunk->allocated_size);
+    
+    allocated_chunk->device_memory = 0;
+    allocated_chunk->data = 0;
+}
+
+inline void memory_snapshot(MemoryManager* manager, MemoryPool* pool, u8* occupancy) {
+    memset(occupancy, 1, pool->page_count);
+    
+    for (u32 order = 0;order <= pool->max_order;++order) {
+        u32 page = pool->free_lists[order];
+        while (page != BUDDY_NONE) {
+            memset(occupancy + page, 0, 1u << order);
+            page = pool->next_free[page];
         }
-        free_from_chunk(manager, pool, chunk->left, allocated_chunk);
     }
+}
+
+inline bool is_pool_empty(MemoryPool* pool) {
+    return (pool->free_order_mask >> pool->max_order) & 1;
+}
+
+// Gives the device memory of a pool back to the driver. The pool must not hold any allocation.
+inline void release_pool(MemoryManager* manager, VkDevice device, MemoryPool* pool) {
+    MemoryPool** link = &manager->pools[pool->memory_type];
+    while (*link && *link != pool) {
+        link = &(*link)->next;
+    }
+    if (*link == 0) return;
+    *link = pool->next;
+    
+    pthread_mutex_lock(&manager->global_lock);
+    manager->pool_table[pool->index] = 0;
+    manager->statistics.pool_count--;
+    manager->statistics.pool_size -= manager->allocation_size;
+    pthread_mutex_unlock(&manager->global_lock);
+    update_memory_usage(manager, pool->memory_type, -(i64)manager->allocation_size, 0);
     
-    if (!chunk->left->left && !chunk->left->right && !chunk->right->left && !chunk->right->right && !chunk->left->full && !chunk->right->full) {
-        free_null(chunk->left);
-        free_null(chunk->right);
+    cleanup_pool(manager, device, pool);
+    vkFreeMemory(device, pool->device_memory, nullptr);
+    
+    pthread_mutex_lock(&manager->global_lock);
+    pool_free(&manager->pool_allocator, pool);
+    pthread_mutex_unlock(&manager->global_lock);
+}
+
+// Applies the residency policy, meant to be called regularly. The first empty pools of each type
+// stay warm, the next ones are released once they have been empty for the idle time. When the heap
+// is over its budget, every empty pool that is not reserved goes back to the driver right away.
+inline u32 release_empty_pools(MemoryManager* manager, VkDevice device) {
+    u64 now = get_time_ns();
+    MemoryResidencyPolicy* policy = &manager->residency_policy;
+    
+    u32 released_count = 0;
+    for (u32 i = 0;i < manager->memory_properties.memoryTypeCount;++i) {
+        bool over_budget = is_heap_over_budget(manager, manager->memory_properties.memoryTypes[i].heapIndex, 0);
+        
+        lock_memory_type(manager, i);
+        
+        u32 warm_count = 0;
+        MemoryPool* current = manager->pools[i];
+        while (current) {
+            MemoryPool* next = current->next;
+            if (!is_pool_empty(current)) {
+                current->empty_since = 0;
+            } else if (!current->reserved) {
+                if (current->empty_since == 0) {
+                    current->empty_since = now;
+                }
+                
+                if (over_budget || (warm_count == policy->warm_pool_count && now - current->empty_since >= policy->idle_time_ns)) {
+                    release_pool(manager, device, current);
+                    released_count++;
+                } else if (warm_count < policy->warm_pool_count) {
+                    warm_count++;
+                }
+            }
+            current = next;
+        }
+        
+        unlock_memory_type(manager, i);
     }
     
-    chunk->full = false;
-    return;
+    return released_count;
 }
 
-inline void memory_snapshot(MemoryManager* manager, MemoryPool* pool, u8* occupancy) {
-    memory_snapshot_chunk(manager, &pool->base_chunk, occupancy);
+inline VkDeviceSize get_pool_free_size(MemoryManager* manager, MemoryPool* pool) {
+    VkDeviceSize free_size = 0;
+    for (u32 order = 0;order <= pool->max_order;++order) {
+        u32 page = pool->free_lists[order];
+        while (page != BUDDY_NONE) {
+            free_size += manager->min_page_size << order;
+            page = pool->next_free[page];
+        }
+    }
+    
+    return free_size;
 }
 
-inline void memory_snapshot_chunk(MemoryManager* manager, MemoryChunk* chunk, u8* occupancy) {
-    if (chunk->full) {
-        u32 start_index = chunk->offset / manager->min_page_size;
-        u32 size = chunk->size / manager->min_page_size;
-        for (int i = start_index;i < start_index + size;++i) {
-            occupancy[i] = 1;
+inline void get_memory_heap_report(MemoryManager* manager, u32 heap, MemoryHeapReport* report) {
+    *report = {};
+    if (heap >= manager->memory_properties.memoryHeapCount) return;
+    
+    MemoryHeapUsage* heap_usage = &manager->heap_usage[heap];
+    report->heap_size = manager->memory_properties.memoryHeaps[heap].size;
+    report->budget = heap_usage->budget;
+    report->usage = heap_usage->usage + heap_usage->reserved_size - heap_usage->reserved_size_at_budget_update;
+    report->reserved_size = heap_usage->reserved_size;
+    report->used_size = heap_usage->used_size;
+    
+    // Free space only helps allocations that fit in one block, the part outside of the largest
+    // block of each pool is counted as fragmented
+    u64 largest_free_size_sum = 0;
+    for (u32 i = 0;i < manager->memory_properties.memoryTypeCount;++i) {
+        if (manager->memory_properties.memoryTypes[i].heapIndex != heap) continue;
+        
+        lock_memory_type(manager, i);
+        for (MemoryPool* pool = manager->pools[i];pool != 0;pool = pool->next) {
+            report->free_size += get_pool_free_size(manager, pool);
+            if (pool->free_order_mask == 0) continue;
+            
+            u64 largest_free_block = manager->min_page_size << (31 - __builtin_clz(pool->free_order_mask));
+            largest_free_size_sum += largest_free_block;
+            if (largest_free_block > report->largest_free_block) {
+                report->largest_free_block = largest_free_block;
+            }
         }
-        return;
+        unlock_memory_type(manager, i);
+    }
+    
+    if (report->free_size != 0) {
+        report->fragmentation = 1.0f - (f32)largest_free_size_sum / (f32)report->free_size;
+    }
+}
+
+// Pooled counters of a thread cache can go below zero when blocks are freed by another thread
+// than the one which allocated them, only their sum makes sense.
+inline void get_memory_statistics(MemoryManager* manager, MemoryStatistics* statistics) {
+    pthread_mutex_lock(&manager->global_lock);
+    *statistics = manager->statistics;
+    pthread_mutex_unlock(&manager->global_lock);
+    
+    for (u32 i = 0;i < MAX_MEMORY_THREAD_COUNT;++i) {
+        ThreadMemoryCache* cache = manager->thread_caches[i];
+        if (!cache) continue;
+        
+        statistics->pooled_allocation_count += cache->statistics.pooled_allocation_count;
+        statistics->pooled_requested_size += cache->statistics.pooled_requested_size;
+        statistics->pooled_allocated_size += cache->statistics.pooled_allocated_size;
     }
+}
+
+inline void print_memory_statistics(MemoryManager* manager) {
+    MemoryStatistics memory_statistics = {};
+    get_memory_statistics(manager, &memory_statistics);
+    MemoryStatistics* statistics = &memory_statistics;
     
-    if (chunk->left) {
-        memory_snapshot_chunk(manager, chunk->left, occupancy);
+    u64 pooled_waste = statistics->pooled_allocated_size - statistics->pooled_requested_size;
+    
+    println("Memory statistics:");
+    println("    Pools: %lu (%lu KB)", statistics->pool_count, statistics->pool_size / 1024);
+    println("    Pooled allocations: %lu (%lu KB requested, %lu KB allocated, %lu KB lost to rounding)",
+            statistics->pooled_allocation_count,
+            statistics->pooled_requested_size / 1024,
+            statistics->pooled_allocated_size / 1024,
+            pooled_waste / 1024);
+    println("    Dedicated allocations: %lu (%lu KB)", statistics->dedicated_allocation_count, statistics->dedicated_size / 1024);
+    
+    for (u32 i = 0;i < manager->memory_properties.memoryHeapCount;++i) {
+        MemoryHeapReport report = {};
+        get_memory_heap_report(manager, i, &report);
+        
+        bool device_local = manager->memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+        println("    Heap #%u%s: %lu MB, budget %lu MB, usage %lu MB", i, device_local ? " (device local)" : "",
+                report.heap_size / (MB(1)), report.budget / (MB(1)), report.usage / (MB(1)));
+        println("        %lu KB reserved, %lu KB used, %lu KB free, largest free block %lu KB, %.1f%% fragmented",
+                report.reserved_size / 1024, report.used_size / 1024, report.free_size / 1024,
+                report.largest_free_block / 1024, 100.0f * report.fragmentation);
+    }
+}
+
+// Prints the device memory owned by each tag, then every pool with its fragmentation and the space
+// lost to the rounding of blocks, each block too when verbose. Other threads must not allocate or
+// free in the meantime, the block tags are written without lock.
+inline void dump_memory_report(MemoryManager* manager, bool verbose) {
+#ifdef MEMORY_TAGGING
+    println("Memory tags:");
+    for (u32 tag = 0;tag < MEMORY_TAG_COUNT;++tag) {
+        MemoryTagUsage usage = {};
+        get_memory_tag_usage(manager, (MemoryTag)tag, &usage);
+        if (usage.allocation_count == 0) continue;
+        
+        println("    %-12s %6lu allocations, %8lu KB requested, %8lu KB allocated, %6lu KB lost to rounding",
+                memory_tag_names[tag], usage.allocation_count, usage.requested_size / 1024,
+                usage.allocated_size / 1024, (usage.allocated_size - usage.requested_size) / 1024);
     }
+#endif
     
-    if (chunk->right) {
-        memory_snapshot_chunk(manager, chunk->right, occupancy);
+    println("Memory pools:");
+    for (u32 type = 0;type < manager->memory_properties.memoryTypeCount;++type) {
+        lock_memory_type(manager, type);
+        
+        for (MemoryPool* pool = manager->pools[type];pool != 0;pool = pool->next) {
+            u64 used_size = 0;
+            u64 cached_size = 0;
+            u64 waste = 0;
+            u64 block_count = 0;
+            
+            // Walk down the buddy tree, a node neither free nor split is a block in use
+            u32 stack[MAX_BUDDY_ORDER_COUNT + 1];
+            u32 stack_size = 0;
+            stack[stack_size++] = 0;
+            while (stack_size > 0) {
+                u32 node = stack[--stack_size];
+                if (get_bit(pool->free_bits, node)) continue;
+                if (get_bit(pool->split_bits, node)) {
+                    stack[stack_size++] = 2 * node + 2;
+                    stack[stack_size++] = 2 * node + 1;
+                    continue;
+                }
+                
+                u32 page = get_buddy_node_page(pool, node);
+                u64 block_size = manager->min_page_size << get_buddy_node_order(pool, node);
+                
+#ifdef MEMORY_TAGGING
+                if (pool->block_tags[page] == MEMORY_TAG_NOT_HANDED_OUT) {
+                    cached_size += block_size;
+                    if (verbose) {
+                        println("        %8lu KB: %6lu KB, cached", page * manager->min_page_size / 1024, block_size / 1024);
+                    }
+                    continue;
+                }
+                
+                waste += block_size - pool->block_requested_sizes[page];
+                if (verbose) {
+                    println("        %8lu KB: %6lu KB, %s (%u bytes requested)", page * manager->min_page_size / 1024, block_size / 1024,
+                            memory_tag_names[pool->block_tags[page]], pool->block_requested_sizes[page]);
+                }
+#else
+                if (verbose) {
+                    println("        %8lu KB: %6lu KB", page * manager->min_page_size / 1024, block_size / 1024);
+                }
+#endif
+                used_size += block_size;
+                block_count++;
+            }
+            
+            u64 free_size = get_pool_free_size(manager, pool);
+            u64 largest_free_block = pool->free_order_mask ? manager->min_page_size << (31 - __builtin_clz(pool->free_order_mask)) : 0;
+            f32 fragmentation = free_size ? 1.0f - (f32)largest_free_block / (f32)free_size : 0.0f;
+            
+            println("    Pool #%u (type %u%s): %lu blocks, %lu KB used, %lu KB cached, %lu KB free, largest free block %lu KB, %.1f%% fragmented, %lu KB lost to rounding",
+                    pool->index, type, pool->reserved ? ", reserved" : "", block_count, used_size / 1024, cached_size / 1024, free_size / 1024,
+                    largest_free_block / 1024, 100.0f * fragmentation, waste / 1024);
+        }
+        
+        unlock_memory_type(manager, type);
     }
 }
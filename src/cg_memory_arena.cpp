@@ -1,48 +1,226 @@
 #include "cg_memory_arena.h"
 
+#include <string.h>
+#include <sys/mman.h>
+
+// Only reserves the address range, nothing is touched until the first allocations
 inline bool init_memory_arena(MemoryArena* arena, u64 size) {
-    arena->data = calloc(size, 1);
+    *arena = {};
+    void* memory = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        println("Error: failed to reserve %lu KB for a memory arena", size / 1024);
+        return false;
+    }
+    
+    arena->data = memory;
     arena->size = size;
-    return (arena->data != 0);
+    arena->reserved_data = memory;
+    arena->reserved_size = size;
+    arena->block_size = size;
+    return true;
 }
 
 inline void destroy_memory_arena(MemoryArena* arena, bool verbose) {
     if (verbose) {
         println("Destroying memory arena");
+        if (arena->max_usage > arena->block_size) {
+            println("    Initial block of %lu KB overflowed, up to %lu KB used", arena->block_size / 1024, arena->max_usage / 1024);
+        }
+        println("    %lu KB committed out of %lu KB reserved", arena->committed_size / 1024, arena->reserved_size / 1024);
+    }
+    while (arena->block) {
+        pop_arena_block(arena);
+    }
+    if (arena->spare_block) {
+        munmap(arena->spare_block, arena->spare_block->mapped_size);
+        arena->spare_block = 0;
+    }
+    munmap(arena->reserved_data, arena->reserved_size);
+    arena->reserved_data = 0;
+    arena->data = 0;
+}
+
+// Makes the initial block usable up to end. Fresh pages read as zero.
+inline bool commit_arena_pages(MemoryArena* arena, u64 end) {
+    if (end <= arena->committed_size) return true;
+    
+    u64 committed_size = (end + ARENA_COMMIT_SIZE - 1) / ARENA_COMMIT_SIZE * ARENA_COMMIT_SIZE;
+    if (committed_size > arena->reserved_size) {
+        committed_size = arena->reserved_size;
     }
-    free(arena->data);
+    
+    u8* start = (u8*)arena->reserved_data + arena->committed_size;
+    if (mprotect(start, committed_size - arena->committed_size, PROT_READ | PROT_WRITE) != 0) {
+        println("Error: failed to commit %lu KB of a memory arena", (committed_size - arena->committed_size) / 1024);
+        return false;
+    }
+    
+    arena->committed_size = committed_size;
+    return true;
 }
 
-inline void* allocate(MemoryArena* arena, u64 size) {
-    void* data = {};
-    if (arena->usage + size < arena->size) {
-        data = (u8*)arena->data + arena->usage;
-        arena->usage += size;
+// Gives the committed pages of the initial block back to the system, the block must be empty
+inline void decommit_arena_pages(MemoryArena* arena) {
+    if (arena->committed_size == 0) return;
+    
+    madvise(arena->reserved_data, arena->committed_size, MADV_DONTNEED);
+    mprotect(arena->reserved_data, arena->committed_size, PROT_NONE);
+    arena->committed_size = 0;
+    arena->dirty_usage = 0;
+}
+
+// Chains a block big enough for min_size bytes, the end of the current block is left unused
+inline bool push_arena_block(MemoryArena* arena, u64 min_size) {
+    MemoryArenaBlock* block = 0;
+    u64 dirty_usage = 0;
+    if (arena->spare_block && arena->spare_block->mapped_size - ARENA_BLOCK_HEADER_SIZE >= min_size) {
+        block = arena->spare_block;
+        dirty_usage = block->dirty_size;
+        arena->spare_block = 0;
     } else {
-        data = malloc(size);
-        println("Memory Arena overflow");
-        arena->outside_usage += size;
+        u64 page_size = (u64)sysconf(_SC_PAGESIZE);
+        u64 mapped_size = min_size > arena->block_size ? min_size : arena->block_size;
+        mapped_size = (mapped_size + ARENA_BLOCK_HEADER_SIZE + page_size - 1) / page_size * page_size;
+        
+        void* memory = mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+            println("Error: failed to map a memory arena block of %lu KB", mapped_size / 1024);
+            return false;
+        }
+        
+        block = (MemoryArenaBlock*)memory;
+        block->mapped_size = mapped_size;
     }
     
-    if (arena->outside_usage + arena->usage > arena->max_usage) {
-        arena->max_usage = arena->outside_usage + arena->usage;
+    block->previous = arena->block;
+    block->previous_data = arena->data;
+    block->previous_size = arena->size;
+    block->previous_usage = arena->usage;
+    block->previous_dirty_usage = arena->dirty_usage;
+    
+    arena->chained_usage += arena->usage;
+    arena->block = block;
+    arena->block_count++;
+    arena->overflow_count++;
+    arena->data = (u8*)block + ARENA_BLOCK_HEADER_SIZE;
+    arena->size = block->mapped_size - ARENA_BLOCK_HEADER_SIZE;
+    arena->usage = 0;
+    arena->dirty_usage = dirty_usage;
+    
+    return true;
+}
+
+// Goes back to the previous block. The biggest of the popped block and the spare one stays mapped.
+inline void pop_arena_block(MemoryArena* arena) {
+    MemoryArenaBlock* block = arena->block;
+    if (block == 0) return;
+    
+    block->dirty_size = arena->dirty_usage;
+    arena->dirty_usage = block->previous_dirty_usage;
+    arena->data = block->previous_data;
+    arena->size = block->previous_size;
+    arena->usage = block->previous_usage;
+    arena->chained_usage -= block->previous_usage;
+    arena->block = block->previous;
+    arena->block_count--;
+    
+    if (arena->spare_block && arena->spare_block->mapped_size >= block->mapped_size) {
+        munmap(block, block->mapped_size);
+        return;
     }
     
-    return data;
+    if (arena->spare_block) {
+        munmap(arena->spare_block, arena->spare_block->mapped_size);
+    }
+    arena->spare_block = block;
+}
+
+// Aligns the address and not the usage, so that alignments bigger than the block start work too
+inline u64 get_aligned_usage(MemoryArena* arena, u64 alignment) {
+    u64 address = (u64)arena->data + arena->usage;
+    u64 aligned_address = (address + alignment - 1) & ~(alignment - 1);
+    
+    return arena->usage + (aligned_address - address);
+}
+
+inline void* allocate(MemoryArena* arena, u64 size, u64 alignment) {
+    u64 dirty_size = 0;
+    
+    return allocate_with_dirty_size(arena, size, alignment, &dirty_size);
 }
 
-inline void* zero_allocate(MemoryArena* arena, u64 size) {
-    void* data = allocate(arena, size);
-    for (u8* d = (u8*)data;d < (u8*)data + size;++d) {
-        *d = 0;
+// dirty_size is how much of the start of the allocation may hold data written before, the rest
+// comes straight from the system and reads as zero
+inline void* allocate_with_dirty_size(MemoryArena* arena, u64 size, u64 alignment, u64* dirty_size) {
+    u64 usage = get_aligned_usage(arena, alignment);
+    if (usage + size > arena->size) {
+        // Chained blocks start after their header, aligned enough for anything but huge alignments
+        u64 padding = alignment > ARENA_BLOCK_HEADER_SIZE ? alignment : 0;
+        if (!push_arena_block(arena, size + padding)) return 0;
+        
+        usage = get_aligned_usage(arena, alignment);
+    } else if (arena->block == 0 && usage + size > arena->committed_size && !commit_arena_pages(arena, usage + size)) {
+        return 0;
+    }
+    
+    void* data = (u8*)arena->data + usage;
+    arena->usage = usage + size;
+    arena->allocation_count++;
+    
+    *dirty_size = 0;
+    if (arena->dirty_usage > usage) {
+        *dirty_size = arena->dirty_usage - usage < size ? arena->dirty_usage - usage : size;
+    }
+    if (arena->usage > arena->dirty_usage) {
+        arena->dirty_usage = arena->usage;
     }
     
+    u64 total_usage = arena->chained_usage + arena->usage;
+    if (total_usage > arena->frame_peak_usage) {
+        arena->frame_peak_usage = total_usage;
+        if (total_usage > arena->max_usage) {
+            arena->max_usage = total_usage;
+        }
+    }
+    
+    return data;
+}
+
+// Only clears what a previous allocation could have written, fresh pages are left untouched so
+// that a big zeroed array costs nothing until it is used
+inline void* zero_allocate(MemoryArena* arena, u64 size, u64 alignment) {
+    u64 dirty_size = 0;
+    void* data = allocate_with_dirty_size(arena, size, alignment, &dirty_size);
+    if (data == 0) return 0;
+    
+    memset(data, 0, dirty_size);
+    
     return data;
 }
 
-inline void reset_arena(MemoryArena* arena) {
+// The spare block outlives the overflows by a few resets, so that an arena overflowing every
+// frame does not map and unmap a block every frame. Releasing the pages is for arenas coming out
+// of a peak, like after loading a level, an arena reset every frame should keep them.
+inline void reset_arena(MemoryArena* arena, bool release_pages) {
+    if (arena->block) {
+        arena->reset_count_without_overflow = 0;
+    } else if (arena->spare_block && ++arena->reset_count_without_overflow >= ARENA_SPARE_BLOCK_DECAY_COUNT) {
+        munmap(arena->spare_block, arena->spare_block->mapped_size);
+        arena->spare_block = 0;
+    }
+    
+    while (arena->block) {
+        pop_arena_block(arena);
+    }
     arena->usage = 0;
-    arena->outside_usage = 0;
+    
+    if (release_pages) {
+        decommit_arena_pages(arena);
+        if (arena->spare_block) {
+            munmap(arena->spare_block, arena->spare_block->mapped_size);
+            arena->spare_block = 0;
+        }
+    }
 }
 
 inline char* to_string(MemoryArena to_print, MemoryArena* arena, u64 indentation_level){
@@ -58,13 +236,15 @@ inline char* to_string(MemoryArena to_print, MemoryArena* arena, u64 indentation
             "%s    data: %p\n"
             "%s    size: %ld\n"
             "%s    usage: %ld\n"
-            "%s    outside_usage: %ld\n"
+            "%s    block_count: %u\n"
+            "%s    chained_usage: %ld\n"
             "%s    max_usage: %ld\n"
             "%s}",
             indent_space, to_print.data,
             indent_space, to_print.size,
             indent_space, to_print.usage,
-            indent_space, to_print.outside_usage,
+            indent_space, to_print.block_count,
+            indent_space, to_print.chained_usage,
             indent_space, to_print.max_usage,
             indent_space);
     
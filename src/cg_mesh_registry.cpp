@@ -0,0 +1,168 @@
+#include "cg_mesh_registry.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cg_macros.h"
+
+inline bool init_mesh_registry(MeshRegistry* registry, u32 capacity) {
+    *registry = {};
+    registry->meshes = (Mesh*)calloc(capacity, sizeof(Mesh));
+    if (registry->meshes == 0) {
+        println("Error: failed to allocate the mesh registry");
+        return false;
+    }
+    
+    registry->capacity = capacity;
+    return true;
+}
+
+inline void destroy_mesh_registry(MeshRegistry* registry, BufferSuballocator* suballocator, bool verbose) {
+    if (verbose) {
+        println("Destroying mesh registry");
+    }
+    for (u32 i = 0;i < registry->mesh_count;++i) {
+        Mesh* mesh = &registry->meshes[i];
+        if (mesh->reference_count == 0) continue;
+        
+        if (verbose) {
+            println("    Destroying mesh %s (%u references)", mesh->name, mesh->reference_count);
+        }
+        free_suballocation(suballocator, &mesh->vertex_range);
+    }
+    free_null(registry->meshes);
+    registry->mesh_count = 0;
+    registry->capacity = 0;
+    if (verbose) {
+        println("");
+    }
+}
+
+// Meshes are only looked up when entities are created, a linear search is enough
+inline u32 find_mesh(MeshRegistry* registry, const char* name) {
+    for (u32 i = 0;i < registry->mesh_count;++i) {
+        Mesh* mesh = &registry->meshes[i];
+        if (mesh->reference_count != 0 && strncmp(mesh->name, name, MAX_MESH_NAME_LENGTH) == 0) return i;
+    }
+    
+    return MESH_INVALID_INDEX;
+}
+
+// The mesh starts with a reference held by the caller, released like the ones of the entities
+inline bool add_mesh(MeshRegistry* registry, const char* name, BufferRange vertex_range, u32 vertex_count, EntityBounds bounds, u32* mesh_index) {
+    u32 index = 0;
+    while (index < registry->mesh_count && registry->meshes[index].reference_count != 0) {
+        index++;
+    }
+    
+    if (index == registry->capacity) {
+        Mesh* meshes = (Mesh*)realloc(registry->meshes, 2 * registry->capacity * sizeof(Mesh));
+        if (meshes == 0) {
+            println("Error: failed to grow the mesh registry");
+            return false;
+        }
+        registry->meshes = meshes;
+        registry->capacity *= 2;
+    }
+    if (index == registry->mesh_count) {
+        registry->mesh_count++;
+    }
+    
+    Mesh* mesh = &registry->meshes[index];
+    *mesh = {};
+    strncpy(mesh->name, name, MAX_MESH_NAME_LENGTH - 1);
+    mesh->vertex_range = vertex_range;
+    mesh->first_vertex = (u32)(vertex_range.offset / sizeof(Vertex));
+    mesh->vertex_count = vertex_count;
+    mesh->bounds = bounds;
+    mesh->reference_count = 1;
+    
+    *mesh_index = index;
+    return true;
+}
+
+inline void acquire_mesh(MeshRegistry* registry, u32 mesh_index) {
+    registry->meshes[mesh_index].reference_count++;
+}
+
+// Returns true when the last reference is gone. The slot is free right away, vertex_range is set to the
+// vertices the caller must free once the frames that may draw the mesh are finished.
+inline bool release_mesh(MeshRegistry* registry, u32 mesh_index, BufferRange* vertex_range) {
+    Mesh* mesh = &registry->meshes[mesh_index];
+    if (mesh->reference_count == 0 || --mesh->reference_count != 0) return false;
+    
+    *vertex_range = mesh->vertex_range;
+    *mesh = {};
+    return true;
+}
+
+// Groups the entities by mesh with a counting sort, each mesh gets its instances next to each other
+// starting at first_instance. An instance is the index of the entity transform, offset by base_index.
+// Entities whose visibility is 0 are left out, every entity is written without visibility. Returns
+// the number of instances written.
+inline u32 write_instance_indices(MeshRegistry* registry, EntityStore* store, u8* visibility, u32 base_index, u32* instances) {
+    for (u32 i = 0;i < registry->mesh_count;++i) {
+        registry->meshes[i].instance_count = 0;
+    }
+    for (u32 i = 0;i < store->count;++i) {
+        if (visibility && !visibility[i]) continue;
+        
+        registry->meshes[store->meshes[i]].instance_count++;
+    }
+    
+    u32 first_instance = 0;
+    for (u32 i = 0;i < registry->mesh_count;++i) {
+        Mesh* mesh = &registry->meshes[i];
+        mesh->first_instance = first_instance;
+        first_instance += mesh->instance_count;
+        mesh->instance_count = 0;
+    }
+    
+    for (u32 i = 0;i < store->count;++i) {
+        if (visibility && !visibility[i]) continue;
+        
+        Mesh* mesh = &registry->meshes[store->meshes[i]];
+        instances[mesh->first_instance + mesh->instance_count++] = base_index + i;
+    }
+    
+    return first_instance;
+}
+
+// Meshes are grouped by vertex block with a counting sort, each batch covers one block. Meshes without
+// instances are skipped. Must be called after write_instance_indices(), returns the number of
+// commands written.
+inline u32 write_indirect_commands(MeshRegistry* registry, u32 first_instance, VkDrawIndirectCommand* commands, IndirectDrawBatch batches[MAX_SUBALLOCATOR_BLOCK_COUNT], u32* batch_count) {
+    u32 block_command_count[MAX_SUBALLOCATOR_BLOCK_COUNT] = {};
+    for (u32 i = 0;i < registry->mesh_count;++i) {
+        Mesh* mesh = &registry->meshes[i];
+        if (mesh->instance_count == 0) continue;
+        
+        block_command_count[mesh->vertex_range.block_index]++;
+    }
+    
+    u32 command_count = 0;
+    u32 block_batch[MAX_SUBALLOCATOR_BLOCK_COUNT] = {};
+    *batch_count = 0;
+    for (u32 i = 0;i < MAX_SUBALLOCATOR_BLOCK_COUNT;++i) {
+        if (block_command_count[i] == 0) continue;
+        
+        block_batch[i] = *batch_count;
+        batches[*batch_count] = { i, command_count, 0 };
+        command_count += block_command_count[i];
+        (*batch_count)++;
+    }
+    
+    for (u32 i = 0;i < registry->mesh_count;++i) {
+        Mesh* mesh = &registry->meshes[i];
+        if (mesh->instance_count == 0) continue;
+        
+        IndirectDrawBatch* batch = &batches[block_batch[mesh->vertex_range.block_index]];
+        VkDrawIndirectCommand* command = &commands[batch->first_command + batch->command_count++];
+        command->vertexCount = mesh->vertex_count;
+        command->instanceCount = mesh->instance_count;
+        command->firstVertex = mesh->first_vertex;
+        command->firstInstance = first_instance + mesh->first_instance;
+    }
+    
+    return command_count;
+}
@@ -52,7 +52,7 @@ inline bool load_obj_file(ConstString* filename, Vertex** vertex_buffer, u32* ve
     }
     
     *vertex_buffer_size = mesh->mNumFaces * 3;
-    Vertex* vertices = (Vertex*)zero_allocate(storage, *vertex_buffer_size * sizeof(Vertex));
+    Vertex* vertices = push_zero_array(storage, Vertex, *vertex_buffer_size);
     
     if (vertices == 0) {
         println("Error: failed to allocate for the vertices.");
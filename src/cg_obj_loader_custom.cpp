@@ -127,43 +127,60 @@ inline bool load_obj_file(ConstString* filename, Vertex** vertex_buffer, u32* ve
         return false;
     }
     
+    // Temporary slots for the vertices/uv/normals and the read buffer, the loader may run on any thread
+    TemporaryMemory scratch = begin_scratch_memory(storage);
+    
+    // The file is read twice character by character, large reads keep that out of the system calls
+    char* read_buffer = push_array(&scratch, char, OBJ_READ_BUFFER_SIZE);
+    if (read_buffer) {
+        setvbuf(file, read_buffer, _IOFBF, OBJ_READ_BUFFER_SIZE);
+    }
+    
     ObjParse obj_parse = {};
     
     bool pre_parse = get_obj_file_info(file, &obj_parse);
-    if (!pre_parse) return false;
+    if (!pre_parse) {
+        fclose(file);
+        end_scratch_memory(&scratch);
+        return false;
+    }
     
     // Allocate the space fot the vertex buffer
     *vertex_buffer_size = obj_parse.face_count * 3;
-    Vertex* vertices = (Vertex*)zero_allocate(storage, *vertex_buffer_size * sizeof(Vertex));
-    if (vertices == 0) return false;
-    
-    // Allocate the temporary slots for the vertices/uv/normals
-    TemporaryMemory temporary_memory = make_temporary_memory(storage);
+    Vertex* vertices = push_zero_array(storage, Vertex, *vertex_buffer_size);
+    if (vertices == 0) {
+        fclose(file);
+        end_scratch_memory(&scratch);
+        return false;
+    }
     
     Vec3f* position = 0;
     Vec2f* uv = 0;
     Vec3f* normal = 0;
     
     if (obj_parse.vertex_count != 0) {
-        position = (Vec3f*)zero_allocate(&temporary_memory, obj_parse.vertex_count * sizeof(Vec3f));
+        position = push_zero_array(&scratch, Vec3f, obj_parse.vertex_count);
         if (position == 0) {
-            destroy_temporary_memory(&temporary_memory);
+            fclose(file);
+            end_scratch_memory(&scratch);
             return false;
         }
     }
     
     if (obj_parse.uv_count != 0) {
-        uv = (Vec2f*)zero_allocate(&temporary_memory, obj_parse.uv_count * sizeof(Vec2f));
+        uv = push_zero_array(&scratch, Vec2f, obj_parse.uv_count);
         if (uv == 0) {
-            destroy_temporary_memory(&temporary_memory);
+            fclose(file);
+            end_scratch_memory(&scratch);
             return false;
         }
     }
     
     if (obj_parse.normal_count != 0) {
-        normal = (Vec3f*)zero_allocate(&temporary_memory, obj_parse.normal_count * sizeof(Vec3f));
+        normal = push_zero_array(&scratch, Vec3f, obj_parse.normal_count);
         if (normal == 0) {
-            destroy_temporary_memory(&temporary_memory);
+            fclose(file);
+            end_scratch_memory(&scratch);
             return false;
         }
     }
@@ -250,8 +267,9 @@ inline bool load_obj_file(ConstString* filename, Vertex** vertex_buffer, u32* ve
         int_c = getc(file);
     }
     
-    destroy_temporary_memory(&temporary_memory);
+    // The read buffer lives in the scratch memory, the file goes first
     fclose(file);
+    end_scratch_memory(&scratch);
     
     *vertex_buffer = vertices;
     
@@ -0,0 +1,68 @@
+#include "cg_pool_allocator.h"
+
+#include <string.h>
+
+inline bool init_pool_allocator(PoolAllocator* pool, MemoryArena* arena, u64 element_size, u64 alignment, u32 capacity) {
+    *pool = {};
+    if (alignment < alignof(void*)) {
+        alignment = alignof(void*);
+    }
+    if (element_size < sizeof(void*)) {
+        element_size = sizeof(void*);
+    }
+    element_size = (element_size + alignment - 1) & ~(alignment - 1);
+    
+    pool->data = (u8*)allocate(arena, element_size * capacity, alignment);
+    if (pool->data == 0) {
+        println("Error: failed to allocate a pool of %u elements", capacity);
+        return false;
+    }
+    
+    pool->element_size = element_size;
+    pool->capacity = capacity;
+    return true;
+}
+
+// Forgets every element, the memory stays in the arena
+inline void reset_pool_allocator(PoolAllocator* pool) {
+    pool->fresh_index = 0;
+    pool->live_count = 0;
+    pool->free_list = 0;
+}
+
+inline void* pool_allocate(PoolAllocator* pool) {
+    void* element = pool->free_list;
+    if (element) {
+        pool->free_list = *(void**)element;
+    } else if (pool->fresh_index < pool->capacity) {
+        element = pool->data + pool->fresh_index * pool->element_size;
+        pool->fresh_index++;
+    } else {
+        return 0;
+    }
+    
+    pool->live_count++;
+    return element;
+}
+
+inline void* pool_zero_allocate(PoolAllocator* pool) {
+    void* element = pool_allocate(pool);
+    if (element) {
+        memset(element, 0, pool->element_size);
+    }
+    
+    return element;
+}
+
+inline void pool_free(PoolAllocator* pool, void* element) {
+    if (element == 0) return;
+    
+    *(void**)element = pool->free_list;
+    pool->free_list = element;
+    pool->live_count--;
+}
+
+inline bool owns_pool_element(PoolAllocator* pool, void* element) {
+    u8* bytes = (u8*)element;
+    return bytes >= pool->data && bytes < pool->data + pool->fresh_index * pool->element_size && (bytes - pool->data) % pool->element_size == 0;
+}
@@ -7,56 +7,41 @@
 #include "cg_vk_helper.h"
 #include "cg_utils.h"
 
-inline bool load_shader_code(const char* filename, u32** code, u32* code_size) {
+// Mapped instead of copied, the driver reads the SPIR-V straight from the page cache. Mappings
+// are page aligned, which covers the alignment of pCode.
+inline bool load_shader_code(const char* filename, MappedFile* code) {
     char full_filename[256] = {0};
     // @Warning: this is unchecked
     get_full_path_from_root(filename, full_filename);
     
-    FILE* file = fopen(full_filename, "rb");
-    
-    if (!file) {
-        return false;
-    }
-    
-    *code_size = get_file_size(file);
-    
-    u8* char_code = (u8*)malloc(*code_size);
-    
-    copy_file_to(file, char_code, *code_size);
-    
-    *code = (u32*)char_code;
-    
-    fclose(file);
-    
-    return true;
+    return map_file(full_filename, code);
 }
 
-inline void free_shader_code(u32* code) {
-    free_null(code);
+inline void free_shader_code(MappedFile* code) {
+    unmap_file(code);
 }
 
 inline bool create_shader_module(VkDevice device, const char* filename, VkShaderModule* module) {
-    u32  code_size = 0;
-    u32* code = 0;
+    MappedFile code = {};
     
-    if (!load_shader_code(filename, &code, &code_size)) {
-        free_null(code);
+    if (!load_shader_code(filename, &code)) {
+        println("Error: failed to load shader %s", filename);
         return false;
     }
     
     VkShaderModuleCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    create_info.codeSize = code_size;
-    create_info.pCode = code;
+    create_info.codeSize = code.size;
+    create_info.pCode = (u32*)code.data;
     
     VkResult result = vkCreateShaderModule(device, &create_info, nullptr, module);
     if (result != VK_SUCCESS) {
         println("vkCreateShaderModule returned (%s)", vk_error_code_str(result));
-        free_null(code);
+        free_shader_code(&code);
         return false;
     }
     
-    free_null(code);
+    free_shader_code(&code);
     return true;
 }
 
@@ -3,22 +3,76 @@
 inline TemporaryMemory make_temporary_memory(MemoryArena* arena) {
     TemporaryMemory memory = {};
     memory.arena = arena;
+    memory.saved_block = arena->block;
     memory.saved_usage = arena->usage;
     
     return memory;
 }
 
 inline void destroy_temporary_memory(TemporaryMemory* memory) {
+    while (memory->arena->block && memory->arena->block != memory->saved_block) {
+        pop_arena_block(memory->arena);
+    }
     memory->arena->usage = memory->saved_usage;
     
     memory->arena = 0;
+    memory->saved_block = 0;
     memory->saved_usage = 0;
 }
 
-inline void* allocate(TemporaryMemory* memory, u64 size) {
-    return allocate(memory->arena, size);
+// Scratch arenas of a thread, reserved on first use and released when the thread exits
+struct ScratchArenas {
+    MemoryArena arenas[SCRATCH_ARENA_COUNT];
+    bool initialized = false;
+    
+    ~ScratchArenas() {
+        if (!initialized) return;
+        for (u32 i = 0;i < SCRATCH_ARENA_COUNT;++i) {
+            destroy_memory_arena(&arenas[i], false);
+        }
+    }
+};
+
+thread_local ScratchArenas scratch_arenas;
+
+// A function allocating its result in an arena passes it as the conflict, so that its temporaries
+// do not end up in the middle of its result when that arena is itself a scratch arena
+inline MemoryArena* get_scratch_arena(MemoryArena* conflict) {
+    if (!scratch_arenas.initialized) {
+        for (u32 i = 0;i < SCRATCH_ARENA_COUNT;++i) {
+            if (!init_memory_arena(&scratch_arenas.arenas[i], SCRATCH_ARENA_SIZE)) return 0;
+        }
+        scratch_arenas.initialized = true;
+    }
+    
+    for (u32 i = 0;i < SCRATCH_ARENA_COUNT;++i) {
+        if (&scratch_arenas.arenas[i] != conflict) return &scratch_arenas.arenas[i];
+    }
+    
+    return 0;
+}
+
+// Scopes nest like the calls, the scratch memory must be ended in the reverse order it was begun
+inline TemporaryMemory begin_scratch_memory(MemoryArena* conflict) {
+    TemporaryMemory scratch = {};
+    MemoryArena* arena = get_scratch_arena(conflict);
+    if (arena) {
+        scratch = make_temporary_memory(arena);
+    }
+    
+    return scratch;
+}
+
+inline void end_scratch_memory(TemporaryMemory* scratch) {
+    if (scratch->arena) {
+        destroy_temporary_memory(scratch);
+    }
+}
+
+inline void* allocate(TemporaryMemory* memory, u64 size, u64 alignment) {
+    return allocate(memory->arena, size, alignment);
 }
 
-inline void* zero_allocate(TemporaryMemory* memory, u64 size) {
-    return zero_allocate(memory->arena, size);
+inline void* zero_allocate(TemporaryMemory* memory, u64 size, u64 alignment) {
+    return zero_allocate(memory->arena, size, alignment);
 }
@@ -1,15 +1,51 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <vulkan/vulkan.h>
 
 #include "cg_macros.h"
+#include "cg_types.h"
 #include "cg_string.h"
 #include "cg_timer.h"
 #include "cg_math.h"
+#include "cg_memory.h"
+#include "cg_memory_arena.h"
+#include "cg_arena_stats.h"
+#include "cg_pool_allocator.h"
+#include "cg_temporary_memory.h"
+#include "cg_buffer_suballocator.h"
+#include "cg_dirty_buffer.h"
+#include "cg_defragmenter.h"
+#include "cg_fonts.h"
+#include "cg_entity_store.h"
+#include "cg_mesh_registry.h"
+#include "cg_frustum.h"
+#include "cg_command_recorder.h"
+#include "cg_color.h"
+#include "cg_files.h"
+#include "cg_vertex.h"
 
 #include "cg_string.cpp"
 #include "cg_timer.cpp"
 #include "cg_math.cpp"
+#include "cg_memory.cpp"
+#include "cg_memory_arena.cpp"
+#include "cg_arena_stats.cpp"
+#include "cg_pool_allocator.cpp"
+#include "cg_temporary_memory.cpp"
+#include "cg_buffer_suballocator.cpp"
+#include "cg_dirty_buffer.cpp"
+#include "cg_defragmenter.cpp"
+#include "cg_files.cpp"
+#include "cg_vertex.cpp"
+#include "cg_entity_store.cpp"
+#include "cg_mesh_registry.cpp"
+#include "cg_frustum.cpp"
+#include "cg_command_recorder.cpp"
 
 #define STRING_SIZE 20
 
@@ -35,9 +71,7 @@ void print_matrix(Mat4f m) {
             m.m30, m.m31, m.m32, m.m33);
 }
 
-int main() {
-    println("bjr");
-    return 0;
+int matrix_benchmark() {
     srand(get_time_ns());
     
     u64 cumulated_time = 0;
@@ -57,4 +91,1528 @@ int main() {
     
     println("Computed %d matrix inversion in %lu ns", repetition, cumulated_time);
     return 0;
-}
\ No newline at end of file
+}
+
+// Fake device used to drive the memory manager without a GPU. Device memory handles are just
+// increasing integers and nothing is ever mappable. Pools can be created from several threads.
+u64 fake_device_memory_counter = 0;
+u64 fake_device_allocation_count = 0;
+
+VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceMemoryProperties(VkPhysicalDevice physical_device, VkPhysicalDeviceMemoryProperties* properties) {
+    *properties = {};
+    properties->memoryTypeCount = 1;
+    properties->memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    properties->memoryTypes[0].heapIndex = 0;
+    properties->memoryHeapCount = 1;
+    properties->memoryHeaps[0].size = GB(8ull);
+    properties->memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceMemoryProperties2(VkPhysicalDevice physical_device, VkPhysicalDeviceMemoryProperties2* properties) {
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &properties->memoryProperties);
+    
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT* budget = (VkPhysicalDeviceMemoryBudgetPropertiesEXT*)properties->pNext;
+    if (budget && budget->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT) {
+        budget->heapBudget[0] = GB(6ull);
+        budget->heapUsage[0] = 0;
+    }
+}
+
+VKAPI_ATTR void VKAPI_CALL vkGetPhysicalDeviceProperties(VkPhysicalDevice physical_device, VkPhysicalDeviceProperties* properties) {
+    *properties = {};
+    properties->apiVersion = VK_API_VERSION_1_0;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkAllocateMemory(VkDevice device, const VkMemoryAllocateInfo* allocate_info, const VkAllocationCallbacks* allocator, VkDeviceMemory* memory) {
+    *memory = (VkDeviceMemory)__atomic_add_fetch(&fake_device_memory_counter, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&fake_device_allocation_count, 1, __ATOMIC_RELAXED);
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkFreeMemory(VkDevice device, VkDeviceMemory memory, const VkAllocationCallbacks* allocator) {
+    if (memory) __atomic_sub_fetch(&fake_device_allocation_count, 1, __ATOMIC_RELAXED);
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkMapMemory(VkDevice device, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size, VkMemoryMapFlags flags, void** data) {
+    *data = 0;
+    return VK_ERROR_MEMORY_MAP_FAILED;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkUnmapMemory(VkDevice device, VkDeviceMemory memory) {}
+
+u64 fake_buffer_counter = 0;
+
+VKAPI_ATTR VkResult VKAPI_CALL vkCreateBuffer(VkDevice device, const VkBufferCreateInfo* create_info, const VkAllocationCallbacks* allocator, VkBuffer* buffer) {
+    *buffer = (VkBuffer)(create_info->size << 16 | ++fake_buffer_counter);
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyBuffer(VkDevice device, VkBuffer buffer, const VkAllocationCallbacks* allocator) {}
+
+VKAPI_ATTR void VKAPI_CALL vkGetBufferMemoryRequirements(VkDevice device, VkBuffer buffer, VkMemoryRequirements* requirements) {
+    requirements->size = (u64)buffer >> 16;
+    requirements->alignment = 256;
+    requirements->memoryTypeBits = 1;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkBindBufferMemory(VkDevice device, VkBuffer buffer, VkDeviceMemory memory, VkDeviceSize offset) {
+    return VK_SUCCESS;
+}
+
+// Command pools and buffers are increasing integers, commands are not recorded anywhere
+u64 fake_command_object_counter = 0;
+
+VKAPI_ATTR VkResult VKAPI_CALL vkCreateCommandPool(VkDevice device, const VkCommandPoolCreateInfo* create_info, const VkAllocationCallbacks* allocator, VkCommandPool* command_pool) {
+    *command_pool = (VkCommandPool)__atomic_add_fetch(&fake_command_object_counter, 1, __ATOMIC_RELAXED);
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR void VKAPI_CALL vkDestroyCommandPool(VkDevice device, VkCommandPool command_pool, const VkAllocationCallbacks* allocator) {}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkResetCommandPool(VkDevice device, VkCommandPool command_pool, VkCommandPoolResetFlags flags) {
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkAllocateCommandBuffers(VkDevice device, const VkCommandBufferAllocateInfo* allocate_info, VkCommandBuffer* command_buffers) {
+    for (u32 i = 0;i < allocate_info->commandBufferCount;++i) {
+        command_buffers[i] = (VkCommandBuffer)__atomic_add_fetch(&fake_command_object_counter, 1, __ATOMIC_RELAXED);
+    }
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkBeginCommandBuffer(VkCommandBuffer command_buffer, const VkCommandBufferBeginInfo* begin_info) {
+    return VK_SUCCESS;
+}
+
+VKAPI_ATTR VkResult VKAPI_CALL vkEndCommandBuffer(VkCommandBuffer command_buffer) {
+    return VK_SUCCESS;
+}
+
+#define MEMORY_BENCHMARK_SLOT_COUNT 4096
+#define MEMORY_BENCHMARK_OPERATION_COUNT 1000000
+
+// Sizes follow roughly what the renderer asks for: mostly small uniform and vertex buffers,
+// sometimes a texture.
+VkDeviceSize random_allocation_size() {
+    u32 r = rand() % 100;
+    if (r < 70) return 256 + rand() % (KB(16));
+    if (r < 95) return KB(16) + rand() % (KB(512));
+    return MB(1) + rand() % (MB(8));
+}
+
+int memory_benchmark() {
+    srand(42);
+    
+    VkDevice device = (VkDevice)1;
+    VkPhysicalDevice physical_device = (VkPhysicalDevice)1;
+    
+    MemoryManager manager = {};
+    VkDeviceSize allocation_size = MB(128);
+    VkDeviceSize min_page_size = KB(4);
+    if (!init_memory(&manager, allocation_size, min_page_size, physical_device, device)) {
+        println("Error: failed to initialize the memory manager");
+        return 1;
+    }
+    
+    AllocatedMemoryChunk* chunks = (AllocatedMemoryChunk*)calloc(MEMORY_BENCHMARK_SLOT_COUNT, sizeof(AllocatedMemoryChunk));
+    
+    u64 allocation_count = 0;
+    u64 free_count = 0;
+    u64 failed_count = 0;
+    u64 allocation_time = 0;
+    u64 free_time = 0;
+    
+    for (u32 i = 0;i < MEMORY_BENCHMARK_OPERATION_COUNT;++i) {
+        AllocatedMemoryChunk* chunk = chunks + (rand() % MEMORY_BENCHMARK_SLOT_COUNT);
+        
+        if (chunk->device_memory) {
+            u64 start = get_time_ns();
+            free(&manager, chunk);
+            free_time += get_time_ns() - start;
+            chunk->device_memory = 0;
+            free_count++;
+        } else {
+            VkMemoryRequirements requirements = {};
+            requirements.size = random_allocation_size();
+            requirements.alignment = 256;
+            requirements.memoryTypeBits = 1;
+            
+            MemoryTag tag = (MemoryTag)(rand() % MEMORY_TAG_COUNT);
+            
+            u64 start = get_time_ns();
+            bool allocated = allocate(&manager, device, requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, chunk, 0, tag);
+            allocation_time += get_time_ns() - start;
+            if (allocated) {
+                allocation_count++;
+            } else {
+                failed_count++;
+            }
+        }
+    }
+    
+    u32 pool_count = 0;
+    for (MemoryPool* pool = manager.pools[0];pool != 0;pool = pool->next) {
+        pool_count++;
+    }
+    
+    // Resources bigger than a pool must still be allocated, in their own memory
+    VkMemoryRequirements large_requirements = {};
+    large_requirements.size = 2 * allocation_size;
+    large_requirements.alignment = 256;
+    large_requirements.memoryTypeBits = 1;
+    
+    AllocatedMemoryChunk large_chunk = {};
+    if (!allocate(&manager, device, large_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &large_chunk) || !large_chunk.dedicated) {
+        println("Error: large allocation did not go through a dedicated allocation");
+        return 1;
+    }
+    
+    print_memory_statistics(&manager);
+    dump_memory_report(&manager);
+    free(&manager, &large_chunk);
+    
+    for (u32 i = 0;i < MEMORY_BENCHMARK_SLOT_COUNT;++i) {
+        if (chunks[i].device_memory) {
+            free(&manager, chunks + i);
+            chunks[i].device_memory = 0;
+        }
+    }
+    
+    // Every page must be free again once all the chunks are released and the cache is flushed
+    flush_thread_memory_cache(&manager);
+    
+    u32 page_count = allocation_size / min_page_size;
+    u8* occupancy = (u8*)calloc(page_count, 1);
+    u64 leaked_pages = 0;
+    for (MemoryPool* pool = manager.pools[0];pool != 0;pool = pool->next) {
+        memset(occupancy, 0, page_count);
+        memory_snapshot(&manager, pool, occupancy);
+        for (u32 i = 0;i < page_count;++i) {
+            leaked_pages += occupancy[i];
+        }
+    }
+    free_null(occupancy);
+    
+    MemoryHeapReport report = {};
+    get_memory_heap_report(&manager, 0, &report);
+    if (report.used_size != 0 || report.reserved_size != manager.statistics.pool_size || report.free_size != report.reserved_size) {
+        println("Error: heap report does not match the pools (%lu used, %lu reserved, %lu free)", report.used_size, report.reserved_size, report.free_size);
+        return 1;
+    }
+    
+    // Only the first pool of the type survives once everything is free and the idle time is over
+    manager.residency_policy.idle_time_ns = 0;
+    u32 released_pool_count = release_empty_pools(&manager, device);
+    if (manager.statistics.pool_count != 1) {
+        println("Error: %lu pools left after releasing %u empty pools", manager.statistics.pool_count, released_pool_count);
+        return 1;
+    }
+    
+    MemoryStatistics statistics = {};
+    get_memory_statistics(&manager, &statistics);
+    
+    for (u32 i = 0;i < MEMORY_TAG_COUNT;++i) {
+        MemoryTagUsage usage = {};
+        get_memory_tag_usage(&manager, (MemoryTag)i, &usage);
+        if (usage.allocation_count != 0 || usage.allocated_size != 0) {
+            println("Error: %lu allocations left with tag %s", usage.allocation_count, memory_tag_names[i]);
+            return 1;
+        }
+    }
+    
+    cleanup_memory(&manager, device);
+    free_null(chunks);
+    
+    println("Memory benchmark:");
+    println("    %lu allocations in %lu ns (%.1f ns/allocation)", allocation_count, allocation_time, (f64)allocation_time / (allocation_count + failed_count));
+    println("    %lu frees in %lu ns (%.1f ns/free)", free_count, free_time, (f64)free_time / free_count);
+    println("    %lu failed allocations, %u pools, %lu leaked pages", failed_count, pool_count, leaked_pages);
+    
+    if (leaked_pages != 0 || fake_device_allocation_count != 0 || statistics.pooled_allocation_count != 0) {
+        println("Error: memory was leaked");
+        return 1;
+    }
+    
+    return 0;
+}
+
+#define MEMORY_CONTENTION_SLOT_COUNT 256
+#define MEMORY_CONTENTION_OPERATION_COUNT 200000
+
+struct MemoryContentionThread {
+    pthread_t thread;
+    MemoryManager* manager;
+    VkDevice device;
+    u32 seed;
+    u64 failed_count;
+};
+
+// Small allocations only, the ones going through the thread caches, with some bigger ones taking
+// the lock of the memory type every time
+void* memory_contention_thread(void* parameter) {
+    MemoryContentionThread* thread = (MemoryContentionThread*)parameter;
+    AllocatedMemoryChunk chunks[MEMORY_CONTENTION_SLOT_COUNT] = {};
+    
+    for (u32 i = 0;i < MEMORY_CONTENTION_OPERATION_COUNT;++i) {
+        AllocatedMemoryChunk* chunk = chunks + (rand_r(&thread->seed) % MEMORY_CONTENTION_SLOT_COUNT);
+        if (chunk->device_memory) {
+            free(thread->manager, chunk);
+            continue;
+        }
+        
+        VkMemoryRequirements requirements = {};
+        requirements.size = rand_r(&thread->seed) % 10 == 0 ? KB(128) + rand_r(&thread->seed) % (KB(128)) : 256 + rand_r(&thread->seed) % (KB(32));
+        requirements.alignment = 256;
+        requirements.memoryTypeBits = 1;
+        if (!allocate(thread->manager, thread->device, requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, chunk)) {
+            thread->failed_count++;
+        }
+    }
+    
+    for (u32 i = 0;i < MEMORY_CONTENTION_SLOT_COUNT;++i) {
+        free(thread->manager, chunks + i);
+    }
+    
+    return 0;
+}
+
+// Runs the same work on 1 to N threads, each of them doing a fixed number of operations. N is the
+// number of cores unless given.
+int memory_contention_benchmark(u32 max_thread_count) {
+    VkDevice device = (VkDevice)1;
+    VkPhysicalDevice physical_device = (VkPhysicalDevice)1;
+    
+    if (max_thread_count == 0) max_thread_count = (u32)sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_thread_count > MAX_MEMORY_THREAD_COUNT / 2) max_thread_count = MAX_MEMORY_THREAD_COUNT / 2;
+    
+    MemoryContentionThread* threads = (MemoryContentionThread*)calloc(max_thread_count, sizeof(MemoryContentionThread));
+    
+    println("Memory contention benchmark (%d operations per thread):", MEMORY_CONTENTION_OPERATION_COUNT);
+    for (u32 cached = 0;cached < 2;++cached) {
+        f64 single_thread_rate = 0.0;
+        
+        u32 thread_count = 1;
+        while (thread_count <= max_thread_count) {
+            MemoryManager manager = {};
+            if (!init_memory(&manager, MB(64), KB(4), physical_device, device)) {
+                println("Error: failed to initialize the memory manager");
+                return 1;
+            }
+            manager.thread_cache_enabled = cached;
+            
+            u64 start = get_time_ns();
+            for (u32 i = 0;i < thread_count;++i) {
+                threads[i] = {};
+                threads[i].manager = &manager;
+                threads[i].device = device;
+                threads[i].seed = 42 + i;
+                pthread_create(&threads[i].thread, nullptr, memory_contention_thread, threads + i);
+            }
+            
+            u64 failed_count = 0;
+            for (u32 i = 0;i < thread_count;++i) {
+                pthread_join(threads[i].thread, nullptr);
+                failed_count += threads[i].failed_count;
+            }
+            u64 elapsed_time = get_time_ns() - start;
+            
+            MemoryStatistics statistics = {};
+            get_memory_statistics(&manager, &statistics);
+            cleanup_memory(&manager, device);
+            
+            if (statistics.pooled_allocation_count != 0 || failed_count != 0 || fake_device_allocation_count != 0) {
+                println("Error: %lu allocations leaked, %lu failed", statistics.pooled_allocation_count, failed_count);
+                return 1;
+            }
+            
+            f64 rate = (f64)thread_count * MEMORY_CONTENTION_OPERATION_COUNT / ((f64)elapsed_time / 1e9);
+            if (thread_count == 1) single_thread_rate = rate;
+            println("    %s, %2u threads: %12.0f operations/s (x%.2f)", cached ? "thread caches" : "type locks only", thread_count, rate, rate / single_thread_rate);
+            
+            if (thread_count == max_thread_count) break;
+            thread_count = thread_count * 2 > max_thread_count ? max_thread_count : thread_count * 2;
+        }
+    }
+    
+    free_null(threads);
+    
+    return 0;
+}
+
+// Reserved pools must survive everything, warm pools must survive until the heap goes over budget
+// and the other empty pools must wait for the idle time
+int memory_residency_test() {
+    VkDevice device = (VkDevice)1;
+    VkPhysicalDevice physical_device = (VkPhysicalDevice)1;
+    
+    MemoryManager manager = {};
+    if (!init_memory(&manager, MB(1), KB(4), physical_device, device)) {
+        println("Error: failed to initialize the memory manager");
+        return 1;
+    }
+    manager.residency_policy.warm_pool_count = 1;
+    manager.residency_policy.idle_time_ns = 60000000000ull;
+    
+    VkDeviceSize reserve_size = KB(2560);
+    if (!reserve_memory(&manager, device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, reserve_size)) return 1;
+    u64 reserved_pool_count = manager.statistics.pool_count;
+    
+    // Blocks too big for the thread cache, two pools more than the reserve
+    VkMemoryRequirements requirements = {};
+    requirements.size = KB(256);
+    requirements.alignment = 256;
+    requirements.memoryTypeBits = 1;
+    
+    AllocatedMemoryChunk chunks[20] = {};
+    for (u32 i = 0;i < 20;++i) {
+        if (!allocate_from_type(&manager, device, 0, requirements, chunks + i)) {
+            println("Error: allocation %u failed", i);
+            return 1;
+        }
+    }
+    u64 full_pool_count = manager.statistics.pool_count;
+    
+    for (u32 i = 0;i < 20;++i) {
+        free(&manager, chunks + i);
+    }
+    
+    u32 released_before_idle = release_empty_pools(&manager, device);
+    
+    manager.residency_policy.idle_time_ns = 0;
+    u32 released_after_idle = release_empty_pools(&manager, device);
+    u64 warm_pool_count = manager.statistics.pool_count;
+    
+    // Reserving again only tops up what is missing
+    reserve_memory(&manager, device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, reserve_size);
+    u64 pool_count_after_reserve = manager.statistics.pool_count;
+    
+    manager.heap_usage[0].budget = 0;
+    u32 released_over_budget = release_empty_pools(&manager, device);
+    
+    println("Memory residency: %lu reserved pools, %lu pools when full, released %u before idle time, %u after, %u over budget",
+            reserved_pool_count, full_pool_count, released_before_idle, released_after_idle, released_over_budget);
+    
+    bool valid = reserved_pool_count == 3 && full_pool_count == 5 && released_before_idle == 0 && released_after_idle == 1
+              && warm_pool_count == 4 && pool_count_after_reserve == 4 && released_over_budget == 1 && manager.statistics.pool_count == 3;
+    cleanup_memory(&manager, device);
+    
+    if (!valid) {
+        println("Error: unexpected pool residency");
+        return 1;
+    }
+    
+    return 0;
+}
+
+// A sparse reserved pool stays allocated whatever happens to its blocks, moving them out would
+// only cost copies: the defragmenter must pick the other pool, or nothing when it is the only candidate
+int defrag_victim_test() {
+    VkDevice device = (VkDevice)1;
+    VkPhysicalDevice physical_device = (VkPhysicalDevice)1;
+    
+    MemoryManager manager = {};
+    if (!init_memory(&manager, MB(1), KB(4), physical_device, device)) {
+        println("Error: failed to initialize the memory manager");
+        return 1;
+    }
+    
+    if (!reserve_memory(&manager, device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, MB(1))) return 1;
+    
+    // Fill the reserved pool and start a second one
+    VkMemoryRequirements requirements = {};
+    requirements.size = KB(256);
+    requirements.alignment = 256;
+    requirements.memoryTypeBits = 1;
+    
+    AllocatedMemoryChunk chunks[5] = {};
+    for (u32 i = 0;i < 5;++i) {
+        if (!allocate_from_type(&manager, device, 0, requirements, chunks + i)) {
+            println("Error: allocation %u failed", i);
+            return 1;
+        }
+    }
+    
+    // Both pools are a quarter full, the reserved one comes first in the list
+    for (u32 i = 1;i < 4;++i) {
+        free(&manager, chunks + i);
+    }
+    
+    MemoryPool* reserved_pool = manager.pools[0];
+    MemoryPool* other_pool = reserved_pool->next;
+    
+    Defragmenter* defragmenter = (Defragmenter*)calloc(1, sizeof(Defragmenter));
+    defragmenter->occupancy = (u8*)calloc(manager.page_count, sizeof(u8));
+    
+    VkBuffer buffers[2] = { (VkBuffer)1, (VkBuffer)2 };
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    register_defrag_buffer(defragmenter, buffers + 0, chunks + 0, KB(256), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    register_defrag_buffer(defragmenter, buffers + 1, chunks + 4, KB(256), usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    
+    MemoryPool* victim = select_defrag_victim(defragmenter, &manager);
+    
+    // Only the block of the reserved pool is movable now
+    defragmenter->buffer_count = 1;
+    MemoryPool* reserved_only_victim = select_defrag_victim(defragmenter, &manager);
+    
+    println("Defrag victim: %s with both pools movable, %s with only the reserved one",
+            victim == other_pool ? "other pool" : victim == reserved_pool ? "reserved pool" : "none",
+            reserved_only_victim == 0 ? "none" : "reserved pool");
+    
+    bool valid = reserved_pool->reserved && !other_pool->reserved && victim == other_pool && reserved_only_victim == 0;
+    
+    free(&manager, chunks + 0);
+    free(&manager, chunks + 4);
+    free_null(defragmenter->occupancy);
+    free_null(defragmenter);
+    cleanup_memory(&manager, device);
+    
+    if (!valid) {
+        println("Error: a reserved pool was picked as a defragmentation victim");
+        return 1;
+    }
+    
+    return 0;
+}
+
+#define SUBALLOCATOR_TEST_SLOT_COUNT 1024
+
+// Random vertex ranges in and out of a suballocator: ranges must never overlap, and every block must
+// be a single free range again once everything is released
+int buffer_suballocator_test() {
+    srand(42);
+    
+    VkDevice device = (VkDevice)1;
+    VkPhysicalDevice physical_device = (VkPhysicalDevice)1;
+    
+    MemoryManager manager = {};
+    if (!init_memory(&manager, MB(64), KB(4), physical_device, device)) {
+        println("Error: failed to initialize the memory manager");
+        return 1;
+    }
+    
+    // Vertices are 44 bytes long, not a power of two
+    VkDeviceSize vertex_size = 44;
+    BufferSuballocator suballocator = {};
+    init_buffer_suballocator(&suballocator, MB(1), vertex_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, MEMORY_TAG_ENTITY, 0);
+    
+    BufferRange* ranges = (BufferRange*)calloc(SUBALLOCATOR_TEST_SLOT_COUNT, sizeof(BufferRange));
+    u8* owners = (u8*)calloc(MAX_SUBALLOCATOR_BLOCK_COUNT * MB(1), 1);
+    
+    u64 error_count = 0;
+    u64 max_block_count = 0;
+    for (u32 i = 0;i < 100000;++i) {
+        BufferRange* range = ranges + (rand() % SUBALLOCATOR_TEST_SLOT_COUNT);
+        if (range->size) {
+            memset(owners + range->block_index * MB(1) + range->offset, 0, range->size);
+            free_suballocation(&suballocator, range);
+            continue;
+        }
+        
+        // From a few triangles to a small model
+        VkDeviceSize size = vertex_size * (3 + rand() % 2000);
+        if (!suballocate(&suballocator, &manager, device, size, range)) {
+            println("Error: suballocation of %lu bytes failed", size);
+            return 1;
+        }
+        
+        if (range->offset % vertex_size != 0 || range->offset + range->size > suballocator.blocks[range->block_index].size) {
+            error_count++;
+        }
+        
+        u8* owner = owners + range->block_index * MB(1) + range->offset;
+        for (u32 j = 0;j < range->size;++j) {
+            error_count += owner[j];
+            owner[j] = 1;
+        }
+        
+        if (suballocator.block_count > max_block_count) max_block_count = suballocator.block_count;
+    }
+    
+    u64 range_count = suballocator.range_count;
+    for (u32 i = 0;i < SUBALLOCATOR_TEST_SLOT_COUNT;++i) {
+        free_suballocation(&suballocator, ranges + i);
+    }
+    
+    for (u32 i = 0;i < suballocator.block_count;++i) {
+        SuballocatorBlock* block = &suballocator.blocks[i];
+        if (block->free_range_count != 1 || block->free_size != block->size) {
+            println("Error: block %u has %u free ranges after releasing everything", i, block->free_range_count);
+            error_count++;
+        }
+    }
+    
+    println("Buffer suballocator: %lu ranges live at the end in %lu blocks, %lu errors", range_count, max_block_count, error_count);
+    
+    destroy_buffer_suballocator(&suballocator, &manager, device);
+    cleanup_memory(&manager, device);
+    free_null(owners);
+    free_null(ranges);
+    
+    return error_count != 0 || suballocator.used_size != 0;
+}
+
+// Checks the memory type selection on a layout like the one of a discrete GPU: plain video memory,
+// a small mappable window into it, and system memory.
+int memory_placement_test() {
+    MemoryManager manager = {};
+    manager.memory_properties.memoryHeapCount = 3;
+    manager.memory_properties.memoryHeaps[0] = { GB(8ull), VK_MEMORY_HEAP_DEVICE_LOCAL_BIT };
+    manager.memory_properties.memoryHeaps[1] = { MB(256ull), VK_MEMORY_HEAP_DEVICE_LOCAL_BIT };
+    manager.memory_properties.memoryHeaps[2] = { GB(16ull), 0 };
+    
+    VkMemoryPropertyFlags host_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    manager.memory_properties.memoryTypeCount = 3;
+    manager.memory_properties.memoryTypes[0] = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0 };
+    manager.memory_properties.memoryTypes[1] = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | host_flags, 1 };
+    manager.memory_properties.memoryTypes[2] = { host_flags, 2 };
+    update_memory_budget(&manager);
+    
+    VkMemoryRequirements requirements = {};
+    requirements.size = MB(16);
+    requirements.alignment = 256;
+    requirements.memoryTypeBits = 0x7;
+    
+    i32 vertex_type = find_memory_type_index(&manager, requirements, host_flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    i32 texture_type = find_memory_type_index(&manager, requirements, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    
+    // Fill the mappable window of video memory, mappable resources must go to system memory now
+    update_memory_usage(&manager, 1, MB(200), MB(200));
+    i32 fallback_type = find_memory_type_index(&manager, requirements, host_flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    
+    // Required properties win over the budget when there is no other choice
+    update_memory_usage(&manager, 0, GB(7ull), GB(7ull));
+    i32 forced_type = find_memory_type_index(&manager, requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    
+    println("Memory placement: vertex %d, texture %d, fallback %d, forced %d", vertex_type, texture_type, fallback_type, forced_type);
+    if (vertex_type != 1 || texture_type != 0 || fallback_type != 2 || forced_type != 0) {
+        println("Error: unexpected memory type selection");
+        return 1;
+    }
+    
+    return 0;
+}
+
+// Overflowing allocations must land in chained blocks that are all given back by temporary memory
+// and resets, and the spare block must go away once the arena stops overflowing
+int memory_arena_test() {
+    MemoryArena arena = {};
+    if (!init_memory_arena(&arena, KB(64))) {
+        println("Error: failed to initialize the arena");
+        return 1;
+    }
+    
+    u64 error_count = 0;
+    
+    // Fill the initial block, then overflow it with an allocation bigger than a chained block
+    u8* first = (u8*)zero_allocate(&arena, KB(60));
+    u8* big = (u8*)zero_allocate(&arena, KB(200));
+    if (!first || !big || arena.block_count != 1) error_count++;
+    memset(big, 0xAB, KB(200));
+    
+    TemporaryMemory temporary_memory = make_temporary_memory(&arena);
+    for (u32 i = 0;i < 100;++i) {
+        u8* data = (u8*)allocate(&temporary_memory, KB(16));
+        if (!data) error_count++;
+        else data[KB(16) - 1] = (u8)i;
+    }
+    u32 temporary_block_count = arena.block_count;
+    destroy_temporary_memory(&temporary_memory);
+    if (arena.block_count != 1 || arena.usage != KB(200) || big[KB(200) - 1] != 0xAB) error_count++;
+    
+    u64 max_usage = arena.max_usage;
+    reset_arena(&arena);
+    if (arena.block_count != 0 || arena.block != 0 || arena.usage != 0 || arena.spare_block == 0) error_count++;
+    
+    // The spare block takes the next overflow, then decays
+    zero_allocate(&arena, KB(64));
+    MemoryArenaBlock* spare_block = arena.spare_block;
+    zero_allocate(&arena, KB(100));
+    if (arena.spare_block != 0 || arena.block == 0 || spare_block != arena.block) error_count++;
+    
+    for (u32 i = 0;i <= ARENA_SPARE_BLOCK_DECAY_COUNT;++i) {
+        reset_arena(&arena);
+    }
+    if (arena.spare_block != 0) error_count++;
+    
+    // Typed pushes stay aligned after odd sizes, in the initial block and in chained ones
+    for (u32 i = 0;i < 1000;++i) {
+        allocate(&arena, 1 + i % 7);
+        Mat4f* matrices = push_array(&arena, Mat4f, 1 + i % 5);
+        u8* page = (u8*)allocate(&arena, 100, 4096);
+        if ((u64)matrices % ARENA_ARRAY_ALIGNMENT != 0 || (u64)page % 4096 != 0) error_count++;
+    }
+    reset_arena(&arena);
+    
+    // Pages are only committed as the usage grows and released on demand
+    reset_arena(&arena, true);
+    u64 committed_before = arena.committed_size;
+    u8* pages = (u8*)zero_allocate(&arena, KB(20));
+    u64 committed_after = arena.committed_size;
+    pages[0] = 1;
+    reset_arena(&arena, true);
+    if (committed_before != 0 || committed_after != ARENA_COMMIT_SIZE || arena.committed_size != 0) error_count++;
+    pages = (u8*)allocate(&arena, 1);
+    if (pages[0] != 0) error_count++;
+    reset_arena(&arena);
+    
+    // Zeroed memory stays zero when it reuses what earlier allocations wrote, in the initial block,
+    // in chained blocks and in the spare one
+    for (u32 round = 0;round < 3;++round) {
+        for (u32 i = 0;i < 6;++i) {
+            u64 size = KB(10) * (i + 1) + round * 100;
+            u8* data = (u8*)zero_allocate(&arena, size, 16);
+            for (u64 j = 0;j < size;++j) {
+                if (data[j] != 0) {
+                    error_count++;
+                    break;
+                }
+            }
+            memset(data, 0xCD, size);
+        }
+        
+        TemporaryMemory dirty_memory = make_temporary_memory(&arena);
+        memset(allocate(&dirty_memory, KB(40)), 0xCD, KB(40));
+        destroy_temporary_memory(&dirty_memory);
+        u8* data = (u8*)zero_allocate(&arena, KB(40));
+        for (u64 j = 0;j < KB(40);++j) {
+            if (data[j] != 0) {
+                error_count++;
+                break;
+            }
+        }
+        reset_arena(&arena);
+    }
+    
+    println("Memory arena: %u blocks at most, %lu KB used at most, %lu errors", temporary_block_count, max_usage / 1024, error_count);
+    
+    destroy_memory_arena(&arena, false);
+    
+    return error_count != 0;
+}
+
+#define POOL_TEST_CAPACITY 4096
+
+struct PoolTestElement {
+    u64 owner;
+    Vec3f position;
+};
+
+// Random churn: a live element is never handed out twice, and the storage never goes past the
+// number of elements live at the same time
+int pool_allocator_test() {
+    srand(42);
+    
+    MemoryArena arena = {};
+    if (!init_memory_arena(&arena, MB(1))) return 1;
+    
+    PoolAllocator pool = {};
+    if (!init_typed_pool_allocator(&pool, &arena, PoolTestElement, POOL_TEST_CAPACITY)) return 1;
+    
+    PoolTestElement** slots = (PoolTestElement**)calloc(POOL_TEST_CAPACITY, sizeof(PoolTestElement*));
+    u64 error_count = 0;
+    u32 max_live_count = 0;
+    for (u32 i = 0;i < 1000000;++i) {
+        u32 slot = rand() % POOL_TEST_CAPACITY;
+        if (slots[slot]) {
+            if (slots[slot]->owner != slot || !owns_pool_element(&pool, slots[slot])) error_count++;
+            pool_free(&pool, slots[slot]);
+            slots[slot] = 0;
+            continue;
+        }
+        
+        slots[slot] = pool_zero_allocate_struct(&pool, PoolTestElement);
+        if (slots[slot] == 0 || (u64)slots[slot] % alignof(PoolTestElement) != 0) {
+            error_count++;
+            continue;
+        }
+        slots[slot]->owner = slot;
+        if (pool.live_count > max_live_count) max_live_count = pool.live_count;
+    }
+    
+    if (pool.fresh_index != max_live_count) error_count++;
+    
+    // Every element is usable once, then the pool is exhausted
+    reset_pool_allocator(&pool);
+    for (u32 i = 0;i < POOL_TEST_CAPACITY;++i) {
+        if (pool_allocate(&pool) == 0) error_count++;
+    }
+    if (pool_allocate(&pool) != 0) error_count++;
+    
+    println("Pool allocator: %u live elements at most, %lu errors", max_live_count, error_count);
+    
+    free_null(slots);
+    destroy_memory_arena(&arena, false);
+    
+    return error_count != 0;
+}
+
+#define SCRATCH_TEST_THREAD_COUNT 8
+
+struct ScratchTestThread {
+    u32 index;
+    u64 error_count;
+};
+
+// Nested scopes on both scratch arenas, the patterns written by a thread must never be overwritten
+void* scratch_test_thread(void* data) {
+    ScratchTestThread* thread = (ScratchTestThread*)data;
+    
+    for (u32 i = 0;i < 1000;++i) {
+        TemporaryMemory outer = begin_scratch_memory();
+        u32 outer_count = 1 + i % 1000;
+        u32* outer_data = push_array(&outer, u32, outer_count);
+        for (u32 j = 0;j < outer_count;++j) outer_data[j] = thread->index;
+        
+        TemporaryMemory inner = begin_scratch_memory(outer.arena);
+        u32 inner_count = 1 + (i * 7) % 5000;
+        u32* inner_data = push_array(&inner, u32, inner_count);
+        for (u32 j = 0;j < inner_count;++j) inner_data[j] = ~thread->index;
+        
+        TemporaryMemory nested = begin_scratch_memory(inner.arena);
+        u32* nested_data = push_array(&nested, u32, 64);
+        for (u32 j = 0;j < 64;++j) nested_data[j] = thread->index + 1;
+        
+        if (inner.arena == outer.arena || nested.arena != outer.arena) thread->error_count++;
+        for (u32 j = 0;j < outer_count;++j) thread->error_count += outer_data[j] != thread->index;
+        for (u32 j = 0;j < inner_count;++j) thread->error_count += inner_data[j] != ~thread->index;
+        
+        end_scratch_memory(&nested);
+        end_scratch_memory(&inner);
+        end_scratch_memory(&outer);
+        
+        if (get_scratch_arena()->usage != 0) thread->error_count++;
+    }
+    
+    return 0;
+}
+
+int scratch_memory_test() {
+    pthread_t threads[SCRATCH_TEST_THREAD_COUNT];
+    ScratchTestThread thread_data[SCRATCH_TEST_THREAD_COUNT] = {};
+    for (u32 i = 0;i < SCRATCH_TEST_THREAD_COUNT;++i) {
+        thread_data[i].index = i;
+        pthread_create(&threads[i], 0, scratch_test_thread, &thread_data[i]);
+    }
+    
+    u64 error_count = 0;
+    for (u32 i = 0;i < SCRATCH_TEST_THREAD_COUNT;++i) {
+        pthread_join(threads[i], 0);
+        error_count += thread_data[i].error_count;
+    }
+    
+    println("Scratch memory: %u threads, %lu errors", SCRATCH_TEST_THREAD_COUNT, error_count);
+    return error_count != 0;
+}
+
+// A frame arena growing by a KB a frame and a persistent one, over more frames than the history
+int arena_stats_test() {
+    MemoryArena frame_arena = {};
+    MemoryArena persistent_arena = {};
+    if (!init_memory_arena(&frame_arena, KB(64)) || !init_memory_arena(&persistent_arena, MB(1))) return 1;
+    
+    ArenaRegistry registry = {};
+    register_arena(&registry, &frame_arena, "frame");
+    register_arena(&registry, &persistent_arena, "persistent");
+    
+    u64 error_count = 0;
+    u32 frame_count = ARENA_STATS_HISTORY_SIZE + 40;
+    for (u32 frame = 0;frame < frame_count;++frame) {
+        reset_arena(&frame_arena);
+        for (u32 i = 0;i <= frame;++i) {
+            allocate(&frame_arena, KB(1));
+        }
+        allocate(&persistent_arena, 100);
+        record_arena_stats(&registry);
+    }
+    
+    ArenaStatsEntry* frame_entry = &registry.entries[0];
+    ArenaStatsEntry* persistent_entry = &registry.entries[1];
+    if (get_arena_history_size(&registry) != ARENA_STATS_HISTORY_SIZE) error_count++;
+    
+    for (u32 frames_ago = 0;frames_ago < ARENA_STATS_HISTORY_SIZE;++frames_ago) {
+        u32 frame = frame_count - 1 - frames_ago;
+        ArenaFrameStats* stats = get_arena_frame_stats(&registry, frame_entry, frames_ago);
+        if (stats->peak_usage != (u64)KB(1) * (frame + 1) || stats->allocation_count != frame + 1) error_count++;
+        
+        // Overflows only happen once a frame does not fit in the initial block
+        if ((stats->overflow_count != 0) != (frame + 1 > 64)) error_count++;
+        
+        stats = get_arena_frame_stats(&registry, persistent_entry, frames_ago);
+        if (stats->peak_usage != 100 * (u64)(frame + 1) || stats->allocation_count != 1 || stats->overflow_count != 0) error_count++;
+    }
+    if (frame_entry->max_peak_usage != frame_arena.max_usage || frame_entry->total_overflow_count == 0) error_count++;
+    
+    println("Arena stats: %lu frames, frame arena peak %lu KB with %lu overflows",
+            registry.frame_count, frame_entry->max_peak_usage / 1024, frame_entry->total_overflow_count);
+    
+    unregister_arena(&registry, &frame_arena);
+    if (registry.entry_count != 1 || registry.entries[0].arena != &persistent_arena) error_count++;
+    
+    println("Arena stats: %lu errors", error_count);
+    
+    destroy_memory_arena(&frame_arena, false);
+    destroy_memory_arena(&persistent_arena, false);
+    
+    return error_count != 0;
+}
+
+#define ALIGNMENT_BENCHMARK_VERTEX_COUNT 300000
+#define ALIGNMENT_BENCHMARK_ENTITY_COUNT 4096
+#define ALIGNMENT_BENCHMARK_RUN_COUNT 20
+
+struct AlignmentBenchmarkResult {
+    u64 vertex_time;
+    u64 upload_time;
+};
+
+// What the OBJ loader and the transform upload do, on arrays placed after an odd sized string like
+// before (alignment 1) or with push_array(). Best of several runs. The arrays are only accessed with
+// memcpy, a misaligned Vec3f or Mat4f pointer would be undefined behavior, and both layouts run the
+// same code.
+void run_alignment_benchmark(MemoryArena* arena, u64 alignment, u8* mapped_memory, AlignmentBenchmarkResult* result) {
+    reset_arena(arena);
+    allocate(arena, 13);
+    
+    u32 source_count = ALIGNMENT_BENCHMARK_VERTEX_COUNT / 3;
+    u64 position_alignment = alignment ? alignment : get_array_alignment(Vec3f);
+    u8* positions = (u8*)zero_allocate(arena, source_count * sizeof(Vec3f), position_alignment);
+    allocate(arena, 13);
+    u8* uvs = (u8*)zero_allocate(arena, source_count * sizeof(Vec2f), alignment ? alignment : get_array_alignment(Vec2f));
+    allocate(arena, 13);
+    u8* normals = (u8*)zero_allocate(arena, source_count * sizeof(Vec3f), position_alignment);
+    allocate(arena, 13);
+    u8* vertices = (u8*)zero_allocate(arena, ALIGNMENT_BENCHMARK_VERTEX_COUNT * sizeof(Vertex), alignment ? alignment : get_array_alignment(Vertex));
+    allocate(arena, 13);
+    u8* transforms = (u8*)zero_allocate(arena, 2 * ALIGNMENT_BENCHMARK_ENTITY_COUNT * sizeof(Mat4f), alignment ? alignment : get_array_alignment(Mat4f));
+    
+    for (u32 i = 0;i < source_count;++i) {
+        Vec3f position = new_vec3f(randf(), randf(), randf());
+        Vec2f uv = new_vec2f(randf(), randf());
+        Vec3f normal = new_vec3f(randf(), randf(), randf());
+        memcpy(positions + i * sizeof(Vec3f), &position, sizeof(Vec3f));
+        memcpy(uvs + i * sizeof(Vec2f), &uv, sizeof(Vec2f));
+        memcpy(normals + i * sizeof(Vec3f), &normal, sizeof(Vec3f));
+    }
+    for (u32 i = 0;i < 2 * ALIGNMENT_BENCHMARK_ENTITY_COUNT;++i) {
+        Mat4f transform = random_matrix();
+        memcpy(transforms + i * sizeof(Mat4f), &transform, sizeof(Mat4f));
+    }
+    
+    result->vertex_time = UINT64_MAX;
+    result->upload_time = UINT64_MAX;
+    for (u32 run = 0;run < ALIGNMENT_BENCHMARK_RUN_COUNT;++run) {
+        u64 start = get_time_ns();
+        for (u32 i = 0;i < ALIGNMENT_BENCHMARK_VERTEX_COUNT;++i) {
+            u32 index = (i * 7919) % source_count;
+            Vec3f position, normal;
+            Vec2f uv;
+            memcpy(&position, positions + index * sizeof(Vec3f), sizeof(Vec3f));
+            memcpy(&uv, uvs + index * sizeof(Vec2f), sizeof(Vec2f));
+            memcpy(&normal, normals + index * sizeof(Vec3f), sizeof(Vec3f));
+            
+            Vertex vertex = make_vertex(position, uv, normal);
+            memcpy(vertices + i * sizeof(Vertex), &vertex, sizeof(Vertex));
+        }
+        u64 end = get_time_ns();
+        if (end - start < result->vertex_time) result->vertex_time = end - start;
+        
+        start = get_time_ns();
+        for (u32 frame = 0;frame < 16;++frame) {
+            memcpy(mapped_memory, transforms, 2 * ALIGNMENT_BENCHMARK_ENTITY_COUNT * sizeof(Mat4f));
+        }
+        end = get_time_ns();
+        if (end - start < result->upload_time) result->upload_time = end - start;
+    }
+    
+    // Keep the compiler from dropping the vertex loop
+    Vertex check = {};
+    memcpy(&check, vertices + source_count * sizeof(Vertex), sizeof(Vertex));
+    if (check.position.x < -1.0f) println("Unexpected vertex");
+}
+
+int memory_arena_alignment_benchmark() {
+    MemoryArena arena = {};
+    if (!init_memory_arena(&arena, MB(64))) {
+        println("Error: failed to initialize the arena");
+        return 1;
+    }
+    
+    // Mapped Vulkan memory is at least 64 bytes aligned
+    u8* mapped_memory = (u8*)aligned_alloc(256, 2 * ALIGNMENT_BENCHMARK_ENTITY_COUNT * sizeof(Mat4f));
+    
+    AlignmentBenchmarkResult packed = {};
+    AlignmentBenchmarkResult aligned = {};
+    run_alignment_benchmark(&arena, 1, mapped_memory, &packed);
+    run_alignment_benchmark(&arena, 0, mapped_memory, &aligned);
+    
+    println("Memory arena alignment:");
+    println("    OBJ vertices (%u): %lu ns packed, %lu ns aligned", ALIGNMENT_BENCHMARK_VERTEX_COUNT, packed.vertex_time, aligned.vertex_time);
+    println("    Transform upload (%u entities x 16 frames): %lu ns packed, %lu ns aligned", ALIGNMENT_BENCHMARK_ENTITY_COUNT, packed.upload_time, aligned.upload_time);
+    
+    free(mapped_memory);
+    destroy_memory_arena(&arena, false);
+    
+    return 0;
+}
+
+#define BULK_BENCHMARK_CLEAR_SIZE MB(64)
+#define BULK_BENCHMARK_FILE_SIZE MB(16)
+#define BULK_BENCHMARK_RUN_COUNT 3
+
+// What zero_allocate and copy_file_to used to do
+__attribute__((noinline)) void clear_bytes(u8* data, u64 size) {
+    for (u8* d = data;d < data + size;++d) {
+        *d = 0;
+        asm volatile("" : : "r"(d) : "memory");
+    }
+}
+
+__attribute__((noinline)) void read_file_bytes(FILE* file, u8* dest, u32 file_size) {
+    u8* pos = dest;
+    for (u32 i = 0;i < file_size;++i) {
+        *pos++ = fgetc(file);
+    }
+}
+
+// Only the clears are timed. Skipping the clear of fresh pages also moves their page faults to the
+// first write, which is not counted here.
+int bulk_memory_benchmark() {
+    u64 error_count = 0;
+    u64 loop_time = UINT64_MAX;
+    u64 memset_time = UINT64_MAX;
+    u64 fresh_time = UINT64_MAX;
+    for (u32 run = 0;run < BULK_BENCHMARK_RUN_COUNT;++run) {
+        MemoryArena arena = {};
+        if (!init_memory_arena(&arena, 2 * BULK_BENCHMARK_CLEAR_SIZE)) return 1;
+        
+        u64 start = get_time_ns();
+        u8* data = (u8*)zero_allocate(&arena, BULK_BENCHMARK_CLEAR_SIZE);
+        u64 end = get_time_ns();
+        if (end - start < fresh_time) fresh_time = end - start;
+        for (u64 i = 0;i < BULK_BENCHMARK_CLEAR_SIZE;i += KB(4)) {
+            if (data[i] != 0) error_count++;
+            data[i] = 1;
+        }
+        
+        // The pages are dirty now, the second round clears them for real
+        reset_arena(&arena);
+        start = get_time_ns();
+        data = (u8*)zero_allocate(&arena, BULK_BENCHMARK_CLEAR_SIZE);
+        end = get_time_ns();
+        if (end - start < memset_time) memset_time = end - start;
+        for (u64 i = 0;i < BULK_BENCHMARK_CLEAR_SIZE;i += KB(4)) {
+            if (data[i] != 0) error_count++;
+            data[i] = 1;
+        }
+        
+        start = get_time_ns();
+        clear_bytes(data, BULK_BENCHMARK_CLEAR_SIZE);
+        end = get_time_ns();
+        if (end - start < loop_time) loop_time = end - start;
+        
+        destroy_memory_arena(&arena, false);
+    }
+    
+    char filename[] = "/tmp/cg_bulk_benchmark_XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd == -1) return 1;
+    
+    u8* file_data = (u8*)malloc(BULK_BENCHMARK_FILE_SIZE);
+    u8* read_data = (u8*)malloc(BULK_BENCHMARK_FILE_SIZE);
+    for (u32 i = 0;i < BULK_BENCHMARK_FILE_SIZE;++i) {
+        file_data[i] = (u8)(i * 31 + (i >> 12));
+    }
+    if (write(fd, file_data, BULK_BENCHMARK_FILE_SIZE) != BULK_BENCHMARK_FILE_SIZE) error_count++;
+    close(fd);
+    
+    u64 fgetc_time = UINT64_MAX;
+    u64 fread_time = UINT64_MAX;
+    u64 mmap_time = UINT64_MAX;
+    for (u32 run = 0;run < BULK_BENCHMARK_RUN_COUNT;++run) {
+        FILE* file = fopen(filename, "rb");
+        u64 start = get_time_ns();
+        read_file_bytes(file, read_data, get_file_size(file));
+        u64 end = get_time_ns();
+        fclose(file);
+        if (end - start < fgetc_time) fgetc_time = end - start;
+        if (memcmp(read_data, file_data, BULK_BENCHMARK_FILE_SIZE) != 0) error_count++;
+        
+        memset(read_data, 0, BULK_BENCHMARK_FILE_SIZE);
+        file = fopen(filename, "rb");
+        start = get_time_ns();
+        if (!copy_file_to(file, read_data)) error_count++;
+        end = get_time_ns();
+        fclose(file);
+        if (end - start < fread_time) fread_time = end - start;
+        if (memcmp(read_data, file_data, BULK_BENCHMARK_FILE_SIZE) != 0) error_count++;
+        
+        // Copied out like the other two, so that every page of the mapping is read
+        MappedFile mapped_file = {};
+        start = get_time_ns();
+        if (!map_file(filename, &mapped_file)) error_count++;
+        memcpy(read_data, mapped_file.data, mapped_file.size);
+        end = get_time_ns();
+        if (end - start < mmap_time) mmap_time = end - start;
+        if (mapped_file.size != BULK_BENCHMARK_FILE_SIZE || memcmp(read_data, file_data, BULK_BENCHMARK_FILE_SIZE) != 0) error_count++;
+        unmap_file(&mapped_file);
+    }
+    
+    unlink(filename);
+    free(file_data);
+    free(read_data);
+    
+    println("Bulk memory:");
+    println("    Clear %lu KB: %lu us byte loop, %lu us memset, %lu us fresh pages",
+            (u64)BULK_BENCHMARK_CLEAR_SIZE / 1024, loop_time / 1000, memset_time / 1000, fresh_time / 1000);
+    println("    Read %lu KB: %lu us fgetc, %lu us fread, %lu us mmap", (u64)BULK_BENCHMARK_FILE_SIZE / 1024, fgetc_time / 1000, fread_time / 1000, mmap_time / 1000);
+    println("    %lu errors", error_count);
+    
+    return error_count != 0;
+}
+
+#define ENTITY_TEST_HANDLE_COUNT 5000
+
+// Random adds and removes past the initial capacity. Live handles must find their own entity, the
+// transform x translation is used as a tag, and removed handles must stay dead.
+int entity_store_test() {
+    srand(7);
+    
+    EntityStore store = {};
+    if (!init_entity_store(&store, 16)) return 1;
+    
+    EntityHandle* handles = (EntityHandle*)calloc(ENTITY_TEST_HANDLE_COUNT, sizeof(EntityHandle));
+    bool* alive = (bool*)calloc(ENTITY_TEST_HANDLE_COUNT, sizeof(bool));
+    EntityHandle* dead_handles = (EntityHandle*)calloc(ENTITY_TEST_HANDLE_COUNT, sizeof(EntityHandle));
+    u32 dead_count = 0;
+    u32 alive_count = 0;
+    u64 error_count = 0;
+    
+    for (u32 i = 0;i < 200000;++i) {
+        u32 tag = rand() % ENTITY_TEST_HANDLE_COUNT;
+        if (alive[tag]) {
+            if (!remove_entity(&store, handles[tag])) error_count++;
+            if (remove_entity(&store, handles[tag]) || is_entity_alive(&store, handles[tag])) error_count++;
+            if (dead_count < ENTITY_TEST_HANDLE_COUNT) dead_handles[dead_count++] = handles[tag];
+            alive[tag] = false;
+            alive_count--;
+        } else {
+            if (!add_entity(&store, &handles[tag])) {
+                error_count++;
+                continue;
+            }
+            set_entity_transform(&store, get_entity_index(&store, handles[tag]), translation_matrix((f32)tag, 0.0f, 0.0f));
+            alive[tag] = true;
+            alive_count++;
+        }
+    }
+    
+    if (store.count != alive_count || store.slot_count > store.capacity) error_count++;
+    for (u32 tag = 0;tag < ENTITY_TEST_HANDLE_COUNT;++tag) {
+        if (!alive[tag]) continue;
+        
+        u32 index = get_entity_index(&store, handles[tag]);
+        if (index >= store.count || store.slots[index] != handles[tag].slot || store.transforms[index].model_matrix.m03 != (f32)tag) error_count++;
+    }
+    for (u32 i = 0;i < dead_count;++i) {
+        if (is_entity_alive(&store, dead_handles[i])) error_count++;
+    }
+    
+    // Bounds of the unit cube
+    Vertex cube[8] = {};
+    for (u32 i = 0;i < 8;++i) {
+        cube[i].position = new_vec3f(i & 1 ? 1.0f : -1.0f, i & 2 ? 3.0f : 1.0f, i & 4 ? 1.0f : -1.0f);
+    }
+    EntityBounds bounds = compute_entity_bounds(cube, 8);
+    if (bounds.center.y != 2.0f || bounds.radius < 1.732f || bounds.radius > 1.733f) error_count++;
+    
+    println("Entity store: %u entities, %u slots, capacity %u, %lu errors", store.count, store.slot_count, store.capacity, error_count);
+    
+    free_null(handles);
+    free_null(alive);
+    free_null(dead_handles);
+    destroy_entity_store(&store);
+    
+    return error_count != 0;
+}
+
+int mesh_registry_test() {
+    MeshRegistry registry = {};
+    EntityStore store = {};
+    BufferSuballocator suballocator = {};
+    if (!init_mesh_registry(&registry, 2) || !init_entity_store(&store, 16)) return 1;
+    
+    u64 error_count = 0;
+    
+    // Ranges without a block are ignored by the suballocator, the registry bookkeeping is all that is tested
+    // Meshes 0 and 2 share a vertex block
+    u32 mesh_indices[3] = {};
+    for (u32 i = 0;i < 3;++i) {
+        char name[8] = {};
+        snprintf(name, sizeof(name), "mesh %u", i);
+        BufferRange range = { 2 - i % 2, i * 36 * sizeof(Vertex), 0 };
+        if (!add_mesh(&registry, name, range, 36, {}, &mesh_indices[i])) error_count++;
+    }
+    if (find_mesh(&registry, "mesh 1") != mesh_indices[1] || find_mesh(&registry, "mesh 3") != MESH_INVALID_INDEX) error_count++;
+    
+    // Entities alternate between the meshes, the instances must come out grouped and in order
+    for (u32 i = 0;i < 30;++i) {
+        EntityHandle handle = {};
+        if (!add_entity(&store, &handle)) return 1;
+        
+        u32 index = get_entity_index(&store, handle);
+        store.meshes[index] = mesh_indices[i % 3];
+        set_entity_transform(&store, index, translation_matrix((f32)i, 0.0f, 0.0f));
+        acquire_mesh(&registry, mesh_indices[i % 3]);
+    }
+    
+    u32* instances = (u32*)calloc(store.count, sizeof(u32));
+    if (write_instance_indices(&registry, &store, 0, 1000, instances) != store.count) error_count++;
+    
+    for (u32 i = 0;i < 3;++i) {
+        Mesh* mesh = &registry.meshes[mesh_indices[i]];
+        if (mesh->instance_count != 10) error_count++;
+        for (u32 j = 0;j < mesh->instance_count;++j) {
+            u32 index = instances[mesh->first_instance + j] - 1000;
+            if (index >= store.count || store.transforms[index].model_matrix.m03 != (f32)(j * 3 + i)) error_count++;
+        }
+    }
+    
+    // One batch per vertex block, every command selects the instances of its mesh
+    VkDrawIndirectCommand commands[3] = {};
+    IndirectDrawBatch batches[MAX_SUBALLOCATOR_BLOCK_COUNT] = {};
+    u32 batch_count = 0;
+    if (write_indirect_commands(&registry, 100, commands, batches, &batch_count) != 3 || batch_count != 2) error_count++;
+    if (batches[0].block_index != 1 || batches[0].command_count != 1 || batches[1].block_index != 2 || batches[1].command_count != 2) error_count++;
+    for (u32 i = 0;i < batch_count;++i) {
+        for (u32 j = 0;j < batches[i].command_count;++j) {
+            VkDrawIndirectCommand* command = &commands[batches[i].first_command + j];
+            Mesh* mesh = &registry.meshes[mesh_indices[command->firstVertex / 36]];
+            if (mesh->vertex_range.block_index != batches[i].block_index || command->instanceCount != 10 ||
+                command->firstInstance != 100 + mesh->first_instance) error_count++;
+        }
+    }
+    
+    // Releasing every reference frees the slot for the next mesh, its vertices go back to the caller
+    for (u32 i = 0;i < 11;++i) {
+        BufferRange vertex_range = {};
+        bool last_reference = release_mesh(&registry, mesh_indices[1], &vertex_range);
+        if (last_reference != (i == 10) || (last_reference && vertex_range.offset != 36 * sizeof(Vertex))) error_count++;
+    }
+    u32 reused_index = 0;
+    if (find_mesh(&registry, "mesh 1") != MESH_INVALID_INDEX || !add_mesh(&registry, "mesh 4", {}, 36, {}, &reused_index) || reused_index != mesh_indices[1]) error_count++;
+    
+    println("Mesh registry: %u meshes, capacity %u, %lu errors", registry.mesh_count, registry.capacity, error_count);
+    
+    free_null(instances);
+    destroy_entity_store(&store);
+    destroy_mesh_registry(&registry, &suballocator);
+    
+    return error_count != 0;
+}
+
+#define DIRTY_TEST_ELEMENT_COUNT 1000
+#define DIRTY_TEST_COPY_COUNT 3
+
+// Random changes over many frames, every copy must match the source after its upload. Entity
+// transforms go through the store dirty bits, the rest is found by comparison with a shadow copy.
+int dirty_tracker_test() {
+    srand(7);
+    
+    u64 error_count = 0;
+    
+    DirtyTracker tracker = {};
+    if (!init_dirty_tracker(&tracker, DIRTY_TEST_ELEMENT_COUNT, DIRTY_TEST_COPY_COUNT)) return 1;
+    
+    u32* source = (u32*)calloc(DIRTY_TEST_ELEMENT_COUNT, sizeof(u32));
+    u32* shadow = (u32*)calloc(DIRTY_TEST_ELEMENT_COUNT, sizeof(u32));
+    u32* copies = (u32*)calloc(DIRTY_TEST_ELEMENT_COUNT * DIRTY_TEST_COPY_COUNT, sizeof(u32));
+    for (u32 i = 0;i < DIRTY_TEST_ELEMENT_COUNT * DIRTY_TEST_COPY_COUNT;++i) {
+        copies[i] = 0xDEADBEEF;
+    }
+    
+    // Everything is written the first time a copy is used, in one span
+    DirtyUploadStats stats = upload_dirty_elements(&tracker, 0, source, copies, sizeof(u32), DIRTY_TEST_ELEMENT_COUNT);
+    if (stats.span_count != 1 || stats.element_count != DIRTY_TEST_ELEMENT_COUNT) error_count++;
+    stats = upload_dirty_elements(&tracker, 0, source, copies, sizeof(u32), DIRTY_TEST_ELEMENT_COUNT);
+    if (stats.element_count != 0) error_count++;
+    
+    // Neighbouring ranges are merged, across a word boundary too
+    mark_dirty(&tracker, 60, 4);
+    mark_dirty(&tracker, 64, 10);
+    mark_dirty(&tracker, 500, 1);
+    stats = upload_dirty_elements(&tracker, 0, source, copies, sizeof(u32), DIRTY_TEST_ELEMENT_COUNT);
+    if (stats.span_count != 2 || stats.element_count != 15) error_count++;
+    
+    u64 uploaded_count = 0;
+    for (u32 frame = 0;frame < 1000;++frame) {
+        u32 count = DIRTY_TEST_ELEMENT_COUNT / 2 + rand() % (DIRTY_TEST_ELEMENT_COUNT / 2);
+        
+        // Explicit marks, like the entity store, and silent changes found by the comparison
+        for (u32 i = 0;i < 8;++i) {
+            u32 first = rand() % DIRTY_TEST_ELEMENT_COUNT;
+            u32 length = 1 + rand() % 20;
+            for (u32 j = first;j < first + length && j < DIRTY_TEST_ELEMENT_COUNT;++j) {
+                source[j] = rand();
+                shadow[j] = source[j];
+            }
+            mark_dirty(&tracker, first, length);
+        }
+        for (u32 i = 0;i < 8;++i) {
+            source[rand() % DIRTY_TEST_ELEMENT_COUNT] = rand();
+        }
+        mark_changed_elements(&tracker, shadow, source, sizeof(u32), DIRTY_TEST_ELEMENT_COUNT);
+        
+        u32 copy = frame % DIRTY_TEST_COPY_COUNT;
+        u32* destination = copies + copy * DIRTY_TEST_ELEMENT_COUNT;
+        uploaded_count += upload_dirty_elements(&tracker, copy, source, destination, sizeof(u32), count).element_count;
+        if (memcmp(destination, source, count * sizeof(u32)) != 0) error_count++;
+    }
+    
+    // Only the changed transforms are written once the store was handed to every copy
+    EntityStore store = {};
+    if (!init_entity_store(&store, 128)) return 1;
+    for (u32 i = 0;i < 100;++i) {
+        EntityHandle handle = {};
+        add_entity(&store, &handle);
+        set_entity_transform(&store, i, translation_matrix((f32)i, 0.0f, 0.0f));
+    }
+    
+    DirtyTracker transform_tracker = {};
+    if (!init_dirty_tracker(&transform_tracker, store.capacity, DIRTY_TEST_COPY_COUNT)) return 1;
+    EntityTransformData* transforms = (EntityTransformData*)calloc(store.capacity * DIRTY_TEST_COPY_COUNT, sizeof(EntityTransformData));
+    for (u32 frame = 0;frame < 2 * DIRTY_TEST_COPY_COUNT;++frame) {
+        if (frame == DIRTY_TEST_COPY_COUNT) {
+            set_entity_transform(&store, 42, translation_matrix(0.0f, 1.0f, 0.0f));
+        }
+        
+        mark_dirty_bits(&transform_tracker, store.dirty_bits, store.count);
+        clear_entity_dirty_bits(&store);
+        
+        u32 copy = frame % DIRTY_TEST_COPY_COUNT;
+        EntityTransformData* destination = transforms + copy * store.capacity;
+        stats = upload_dirty_elements(&transform_tracker, copy, store.transforms, destination, sizeof(EntityTransformData), store.count);
+        
+        u32 expected_count = frame < DIRTY_TEST_COPY_COUNT ? store.count : 1;
+        if (stats.element_count != expected_count || memcmp(destination, store.transforms, store.count * sizeof(EntityTransformData)) != 0) error_count++;
+    }
+    
+    println("Dirty tracker: %lu elements uploaded over 1000 frames, %lu errors", uploaded_count, error_count);
+    
+    free_null(transforms);
+    destroy_dirty_tracker(&transform_tracker);
+    destroy_entity_store(&store);
+    free_null(source);
+    free_null(shadow);
+    free_null(copies);
+    destroy_dirty_tracker(&tracker);
+    
+    return error_count != 0;
+}
+
+#define CULLING_BENCHMARK_MAX_ENTITY_COUNT 100000
+#define CULLING_BENCHMARK_RUN_COUNT 20
+
+int frustum_culling_benchmark() {
+    srand(11);
+    
+    u64 error_count = 0;
+    
+    // The camera stays at the origin and looks down -z, the far plane is at 100
+    Mat4f projection = perspective(60.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+    Frustum frustum = extract_frustum(&projection);
+    
+    f32 known_x[5] = { 0.0f, 0.0f, 0.0f, 1000.0f, 0.0f };
+    f32 known_y[5] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    f32 known_z[5] = { -10.0f, 10.0f, -200.0f, -10.0f, 10.0f };
+    f32 known_radius[5] = { 1.0f, 1.0f, 1.0f, 1.0f, 20.0f };
+    u8 expected[5] = { 1, 0, 0, 0, 1 };
+    u8 known_visibility[5] = {};
+    cull_spheres(&frustum, known_x, known_y, known_z, known_radius, 5, known_visibility);
+    if (memcmp(known_visibility, expected, 5) != 0) error_count++;
+    
+    // Cubes scattered around the camera, about a tenth of them end up in the frustum
+    EntityStore store = {};
+    if (!init_entity_store(&store, CULLING_BENCHMARK_MAX_ENTITY_COUNT)) return 1;
+    
+    EntityBounds cube_bounds = { new_vec3f(0.0f, 0.0f, 0.0f), 0.35f };
+    for (u32 i = 0;i < CULLING_BENCHMARK_MAX_ENTITY_COUNT;++i) {
+        EntityHandle handle = {};
+        if (!add_entity(&store, &handle)) return 1;
+        
+        set_entity_bounds(&store, i, cube_bounds);
+        set_entity_transform(&store, i, translation_matrix(randf() * 200.0f - 100.0f, randf() * 200.0f - 100.0f, randf() * 200.0f - 100.0f));
+    }
+    
+    u8* visibility = (u8*)calloc(CULLING_BENCHMARK_MAX_ENTITY_COUNT, sizeof(u8));
+    u8* scalar_visibility = (u8*)calloc(CULLING_BENCHMARK_MAX_ENTITY_COUNT, sizeof(u8));
+    for (u32 count = 1000;count <= CULLING_BENCHMARK_MAX_ENTITY_COUNT;count *= 10) {
+        u64 scalar_time = UINT64_MAX;
+        u64 batch_time = UINT64_MAX;
+        u32 scalar_visible_count = 0;
+        u32 visible_count = 0;
+        for (u32 run = 0;run < CULLING_BENCHMARK_RUN_COUNT;++run) {
+            u64 start = get_time_ns();
+            scalar_visible_count = cull_spheres_scalar(&frustum, store.sphere_x, store.sphere_y, store.sphere_z, store.sphere_radius, count, scalar_visibility);
+            u64 end = get_time_ns();
+            if (end - start < scalar_time) scalar_time = end - start;
+            
+            start = get_time_ns();
+            visible_count = cull_spheres(&frustum, store.sphere_x, store.sphere_y, store.sphere_z, store.sphere_radius, count, visibility);
+            end = get_time_ns();
+            if (end - start < batch_time) batch_time = end - start;
+        }
+        
+        if (visible_count != scalar_visible_count || memcmp(visibility, scalar_visibility, count) != 0) error_count++;
+        
+        println("Frustum culling of %6u entities: %5u visible, scalar %7lu ns, batched %7lu ns",
+                count, visible_count, scalar_time, batch_time);
+    }
+    
+    println("Frustum culling: %lu errors", error_count);
+    
+    free_null(visibility);
+    free_null(scalar_visibility);
+    destroy_entity_store(&store);
+    
+    return error_count != 0;
+}
+
+#define RECORDER_TEST_ITEM_COUNT 4096
+#define RECORDER_TEST_RUN_COUNT 50
+#define RECORDER_TEST_WORK_PER_ITEM 2000
+
+struct RecorderTestJob {
+    u32 item_records[RECORDER_TEST_ITEM_COUNT];
+    VkCommandBuffer item_command_buffers[RECORDER_TEST_ITEM_COUNT];
+    u32 work_per_item;
+    u64 sink;
+};
+
+// Stands in for the draw calls, the work per item is a rough cost of recording a draw
+void record_test_items(VkCommandBuffer command_buffer, void* user_data, u32 first, u32 count) {
+    RecorderTestJob* job = (RecorderTestJob*)user_data;
+    u64 value = first;
+    for (u32 i = first;i < first + count;++i) {
+        job->item_records[i]++;
+        job->item_command_buffers[i] = command_buffer;
+        for (u32 j = 0;j < job->work_per_item;++j) {
+            value = value * 6364136223846793005ull + 1442695040888963407ull;
+        }
+    }
+    __atomic_add_fetch(&job->sink, value, __ATOMIC_RELAXED);
+}
+
+int command_recorder_test() {
+    // At least 4 threads so that the splitting is tested on small machines too
+    u32 core_count = (u32)sysconf(_SC_NPROCESSORS_ONLN);
+    CommandRecorder recorder = {};
+    if (!init_command_recorder(&recorder, (VkDevice)1, 0, core_count > 4 ? core_count : 4)) return 1;
+    
+    VkCommandBufferInheritanceInfo inheritance = {};
+    RecorderTestJob* job = (RecorderTestJob*)calloc(1, sizeof(RecorderTestJob));
+    VkCommandBuffer command_buffers[MAX_RECORD_THREAD_COUNT] = {};
+    u64 error_count = 0;
+    
+    // Every item is recorded once, by the command buffer of its range, and ranges come back in order
+    for (u32 thread_count = 1;thread_count <= recorder.thread_count;++thread_count) {
+        for (u32 slot = 0;slot < 3;++slot) {
+            memset(job->item_records, 0, sizeof(job->item_records));
+            job->work_per_item = 0;
+            
+            u32 item_count = slot == 0 ? RECORDER_TEST_ITEM_COUNT : thread_count / 2 + 1;
+            u32 command_buffer_count = 0;
+            if (!begin_record_slot(&recorder, slot) ||
+                !record_secondary_command_buffers(&recorder, &inheritance, record_test_items, job, item_count, thread_count, command_buffers, &command_buffer_count)) {
+                error_count++;
+                continue;
+            }
+            
+            u32 expected_count = thread_count < item_count ? thread_count : item_count;
+            if (command_buffer_count != expected_count) error_count++;
+            
+            u32 buffer_index = 0;
+            for (u32 i = 0;i < item_count;++i) {
+                if (job->item_records[i] != 1) error_count++;
+                if (job->item_command_buffers[i] != command_buffers[buffer_index]) {
+                    buffer_index++;
+                    if (buffer_index == command_buffer_count || job->item_command_buffers[i] != command_buffers[buffer_index]) error_count++;
+                }
+            }
+            for (u32 i = 1;i < command_buffer_count;++i) {
+                if (command_buffers[i] == command_buffers[i - 1]) error_count++;
+            }
+        }
+    }
+    
+    // Scaling with the number of threads, the first run is the one thread baseline
+    println("Command recorder: %u items of %u iterations", RECORDER_TEST_ITEM_COUNT, RECORDER_TEST_WORK_PER_ITEM);
+    job->work_per_item = RECORDER_TEST_WORK_PER_ITEM;
+    u64 single_thread_time = 0;
+    for (u32 thread_count = 1;thread_count <= recorder.thread_count;++thread_count) {
+        u64 best_time = UINT64_MAX;
+        for (u32 run = 0;run < RECORDER_TEST_RUN_COUNT;++run) {
+            u32 command_buffer_count = 0;
+            u64 start = get_time_ns();
+            if (!begin_record_slot(&recorder, run % MAX_RECORD_SLOT_COUNT) ||
+                !record_secondary_command_buffers(&recorder, &inheritance, record_test_items, job, RECORDER_TEST_ITEM_COUNT, thread_count, command_buffers, &command_buffer_count)) {
+                error_count++;
+            }
+            u64 end = get_time_ns();
+            if (end - start < best_time) best_time = end - start;
+        }
+        if (thread_count == 1) single_thread_time = best_time;
+        
+        println("    %u threads: %8lu ns, speedup %.2f", thread_count, best_time, (f64)single_thread_time / (f64)best_time);
+    }
+    
+    println("Command recorder: %u threads, %lu errors", recorder.thread_count, error_count);
+    
+    free_null(job);
+    destroy_command_recorder(&recorder);
+    
+    return error_count != 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "matrix") == 0) {
+        return matrix_benchmark();
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "memory") == 0) {
+        if (memory_benchmark() != 0) return 1;
+        if (memory_residency_test() != 0) return 1;
+        if (defrag_victim_test() != 0) return 1;
+        if (buffer_suballocator_test() != 0) return 1;
+        return memory_placement_test();
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "arena") == 0) {
+        if (memory_arena_test() != 0) return 1;
+        if (scratch_memory_test() != 0) return 1;
+        if (pool_allocator_test() != 0) return 1;
+        if (arena_stats_test() != 0) return 1;
+        if (bulk_memory_benchmark() != 0) return 1;
+        return memory_arena_alignment_benchmark();
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "entity") == 0) {
+        if (entity_store_test() != 0) return 1;
+        if (mesh_registry_test() != 0) return 1;
+        return dirty_tracker_test();
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "recorder") == 0) {
+        return command_recorder_test();
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "culling") == 0) {
+        return frustum_culling_benchmark();
+    }
+    
+    if (argc > 1 && strcmp(argv[1], "memory_contention") == 0) {
+        return memory_contention_benchmark(argc > 2 ? atoi(argv[2]) : 0);
+    }
+    
+    println("Usage: %s [matrix|memory|arena|entity|recorder|culling|memory_contention [thread count]]", argv[0]);
+    return 0;
+}
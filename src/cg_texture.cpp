@@ -22,13 +22,9 @@ inline bool create_texture_catalog_staging_buffer(RendererState* state) {
         return false;
     }
     
-    VkMemoryRequirements requirements = {};
-    
-    vkGetBufferMemoryRequirements(state->device, state->texture_catalog.staging_buffer, &requirements);
-    
     VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
     
-    if(!allocate(&state->memory_manager, state->device, requirements, memory_flags, &state->texture_catalog.allocation)) {
+    if(!allocate_for_buffer(&state->memory_manager, state->device, state->texture_catalog.staging_buffer, memory_flags, &state->texture_catalog.allocation, 0, MEMORY_TAG_STAGING)) {
         return false;
     }
     
@@ -154,13 +150,10 @@ inline bool create_texture(RendererState* state, Texture* texture, u32 width, u3
         return false;
     }
     
-    VkMemoryRequirements requirements = {};
-    
-    vkGetImageMemoryRequirements(state->device, texture->image, &requirements);
-    
-    VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    // Sampling from system memory is slow but still better than failing when video memory is full
+    VkMemoryPropertyFlags preferred_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
     
-    if(!allocate(&state->memory_manager, state->device, requirements, memory_flags, &texture->allocation)) {
+    if(!allocate_for_image(&state->memory_manager, state->device, texture->image, 0, &texture->allocation, preferred_flags, MEMORY_TAG_TEXTURE)) {
         println("Error: failed to allocate for image");
         return false;
     }
@@ -334,23 +327,93 @@ inline bool load_texture(RendererState* state, const u8* pixels, u32 width, u32
     return true;
 }
 
+// Arena used by stb_image on this thread, allocations fall back to malloc outside of a decoding
+thread_local MemoryArena* texture_decoder_arena = 0;
+
+// Precedes every block handed to stb_image, which only gives the pointer back on realloc and free
+struct TextureDecoderBlock {
+    u64 size;
+    u64 in_arena;
+};
+
+inline void* texture_decoder_allocate(u64 size) {
+    TextureDecoderBlock* block = 0;
+    if (texture_decoder_arena) {
+        block = (TextureDecoderBlock*)allocate(texture_decoder_arena, sizeof(TextureDecoderBlock) + size, 16);
+    } else {
+        block = (TextureDecoderBlock*)malloc(sizeof(TextureDecoderBlock) + size);
+    }
+    if (block == 0) return 0;
+    
+    block->size = size;
+    block->in_arena = texture_decoder_arena != 0;
+    return block + 1;
+}
+
+// The decoders grow their output a few times, the last block of the arena grows in place
+inline void* texture_decoder_reallocate(void* data, u64 size) {
+    if (data == 0) return texture_decoder_allocate(size);
+    
+    TextureDecoderBlock* block = (TextureDecoderBlock*)data - 1;
+    if (!block->in_arena) {
+        block = (TextureDecoderBlock*)realloc(block, sizeof(TextureDecoderBlock) + size);
+        if (block == 0) return 0;
+        
+        block->size = size;
+        return block + 1;
+    }
+    
+    MemoryArena* arena = texture_decoder_arena;
+    u8* end = (u8*)data + block->size;
+    u64 usage = arena ? arena->usage - block->size + size : 0;
+    if (arena && end == (u8*)arena->data + arena->usage && usage <= arena->size &&
+        (arena->block != 0 || commit_arena_pages(arena, usage))) {
+        arena->usage = usage;
+        if (usage > arena->dirty_usage) {
+            arena->dirty_usage = usage;
+        }
+        block->size = size;
+        return data;
+    }
+    
+    void* new_data = texture_decoder_allocate(size);
+    if (new_data == 0) return 0;
+    
+    memcpy(new_data, data, block->size < size ? block->size : size);
+    return new_data;
+}
+
+// Arena blocks are released with the scratch memory of the decoding
+inline void texture_decoder_free(void* data) {
+    if (data == 0) return;
+    
+    TextureDecoderBlock* block = (TextureDecoderBlock*)data - 1;
+    if (!block->in_arena) {
+        free(block);
+    }
+}
+
 inline bool load_texture_from_filename(RendererState *state, const char* filename, const char* texture_name) {
     char full_filename[256] = {0};
     // @Warning: this is unchecked
     get_full_path_from_root(filename, full_filename);
     
+    TemporaryMemory scratch = begin_scratch_memory();
+    texture_decoder_arena = scratch.arena;
+    
     int width, height, channels;
     u8* pixels = stbi_load(full_filename, &width, &height, &channels, 4);
+    texture_decoder_arena = 0;
+    
     if (!pixels) {
         println("Error: failed to load image '%s'.", filename);
+        end_scratch_memory(&scratch);
         return false;
     }
     
-    if (!load_texture(state, pixels, width, height, channels, texture_name)) {
-        stbi_image_free(pixels);
-        return false;
-    }
+    bool loaded = load_texture(state, pixels, width, height, channels, texture_name);
     
     stbi_image_free(pixels);
-    return true;
+    end_scratch_memory(&scratch);
+    return loaded;
 }
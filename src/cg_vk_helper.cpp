@@ -409,6 +409,35 @@ inline bool check_required_device_extensions(VkPhysicalDevice physical_device) {
     return true;
 }
 
+inline bool is_device_extension_available(VkPhysicalDevice physical_device, const char* extension) {
+    u32 extension_property_count = 0;
+    VkResult result = vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_property_count, nullptr);
+    
+    if (result != VK_SUCCESS) {
+        println("vkEnumerateDeviceExtensionProperties returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    VkExtensionProperties* extension_properties = (VkExtensionProperties*)calloc(extension_property_count, sizeof(VkExtensionProperties));
+    result = vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &extension_property_count, extension_properties);
+    
+    if (result != VK_SUCCESS) {
+        println("vkEnumerateDeviceExtensionProperties returned (%s)", vk_error_code_str(result));
+        free_null(extension_properties);
+        return false;
+    }
+    
+    bool found = false;
+    for (int i = 0;i < extension_property_count;++i) {
+        if (strcmp(extension, extension_properties[i].extensionName) == 0) {
+            found = true;
+        }
+    }
+    
+    free_null(extension_properties);
+    return found;
+}
+
 inline bool create_instance(VkInstance* instance) {
     u32 version;
     VkResult result = vkEnumerateInstanceVersion(&version);
@@ -485,8 +514,25 @@ inline bool create_device_and_queues(RendererState* state) {
     device_create_info.pQueueCreateInfos = queue_create_info;
     device_create_info.enabledLayerCount = array_size(required_layers);
     device_create_info.ppEnabledLayerNames = required_layers;
-    device_create_info.enabledExtensionCount = array_size(required_device_extensions);
-    device_create_info.ppEnabledExtensionNames = required_device_extensions;
+    // Optional extensions are appended to the required ones when the device has them
+    const char* enabled_device_extensions[array_size(required_device_extensions) + 1] = {};
+    u32 enabled_device_extension_count = 0;
+    for (int i = 0;i < array_size(required_device_extensions);++i) {
+        enabled_device_extensions[enabled_device_extension_count++] = required_device_extensions[i];
+    }
+    if (state->selection.memory_budget_supported) {
+        enabled_device_extensions[enabled_device_extension_count++] = VK_EXT_MEMORY_BUDGET_EXTENSION_NAME;
+    }
+    
+    device_create_info.enabledExtensionCount = enabled_device_extension_count;
+    device_create_info.ppEnabledExtensionNames = enabled_device_extensions;
+    
+    VkPhysicalDeviceFeatures enabled_features = {};
+    if (state->selection.multi_draw_indirect_supported) {
+        enabled_features.multiDrawIndirect = VK_TRUE;
+        enabled_features.drawIndirectFirstInstance = VK_TRUE;
+    }
+    device_create_info.pEnabledFeatures = &enabled_features;
     
     VkResult result = vkCreateDevice(state->selection.device, &device_create_info, nullptr, &state->device);
     
@@ -524,7 +570,12 @@ inline bool create_swapchain(RendererState* state) {
     swapchain_create_info.imageColorSpace = state->surface_format.colorSpace;
     swapchain_create_info.imageExtent = surface_capabilities.currentExtent;
     swapchain_create_info.imageArrayLayers = 1;
-    swapchain_create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    // Transfers out of the images are only used to capture frames, they are optional
+    state->swapchain_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (surface_capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT) {
+        state->swapchain_usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
+    swapchain_create_info.imageUsage = state->swapchain_usage;
     
     u32 queue_indices[2] = {0};
     u32 queue_indice_count = 0;
@@ -577,6 +628,9 @@ inline bool get_swapchain_images(RendererState* state) {
         return false;
     }
     
+    // No frame rendered to the new images yet
+    state->image_fences = (VkFence*)calloc(state->swapchain_image_count, sizeof(VkFence));
+    
     return true;
 }
 
@@ -667,13 +721,9 @@ inline bool create_depth_images(RendererState* state) {
     }
     
     for (int i = 0;i < state->swapchain_image_count;++i) {
-        VkMemoryRequirements requirements = {};
-        
-        vkGetImageMemoryRequirements(state->device, state->depth_images[i], &requirements);
-        
         VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
         
-        if(!allocate(&state->memory_manager, state->device, requirements, memory_flags, &state->depth_image_allocations[i])) {
+        if(!allocate_for_image(&state->memory_manager, state->device, state->depth_images[i], memory_flags, &state->depth_image_allocations[i], 0, MEMORY_TAG_DEPTH_BUFFER)) {
             println("Error: failed to allocate memory chunk for image.");
             free_null(state->depth_image_allocations);
             return false;
@@ -699,7 +749,7 @@ inline bool create_semaphore(RendererState* state) {
     create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
     
     state->present_semaphores = (VkSemaphore*)calloc(state->swapchain_image_count, sizeof(VkSemaphore));
-    state->acquire_semaphores = (VkSemaphore*)calloc(state->swapchain_image_count, sizeof(VkSemaphore));
+    state->acquire_semaphores = (VkSemaphore*)calloc(state->frames_in_flight, sizeof(VkSemaphore));
     
     for (int i = 0;i < state->swapchain_image_count;++i) {
         VkResult result = vkCreateSemaphore(state->device, &create_info, nullptr, &state->present_semaphores[i]);
@@ -709,7 +759,7 @@ inline bool create_semaphore(RendererState* state) {
         }
     }
     
-    for (int i = 0;i < state->swapchain_image_count;++i) {
+    for (int i = 0;i < state->frames_in_flight;++i) {
         VkResult result = vkCreateSemaphore(state->device, &create_info, nullptr, &state->acquire_semaphores[i]);
         if (result != VK_SUCCESS) {
             println("vkCreateSemaphore returned (%s)", vk_error_code_str(result));
@@ -724,10 +774,10 @@ inline bool create_submit_fences(RendererState* state) {
     create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
     create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
     
-    state->submit_fences = (VkFence*)calloc(state->swapchain_image_count, sizeof(VkFence));
-    state->submissions = (CommandBufferSubmission*)calloc(state->swapchain_image_count, sizeof(CommandBufferSubmission));
+    state->submit_fences = (VkFence*)calloc(state->frames_in_flight, sizeof(VkFence));
+    state->submissions = (CommandBufferSubmission*)calloc(state->frames_in_flight, sizeof(CommandBufferSubmission));
     
-    for (int i = 0;i < state->swapchain_image_count;++i) {
+    for (int i = 0;i < state->frames_in_flight;++i) {
         VkResult result = vkCreateFence(state->device, &create_info, nullptr, &state->submit_fences[i]);
         if (result != VK_SUCCESS) {
             println("vkCreateFence returned (%s)", vk_error_code_str(result));
@@ -740,46 +790,42 @@ inline bool create_submit_fences(RendererState* state) {
     return true;
 }
 
-inline bool create_acquire_fences(RendererState* state) {
-    VkFenceCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    
-    state->acquire_fences = (VkFence*)calloc(state->swapchain_image_count, sizeof(VkFence));
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        VkResult result = vkCreateFence(state->device, &create_info, nullptr, &state->acquire_fences[i]);
-        if (result != VK_SUCCESS) {
-            println("vkCreateFence returned (%s)", vk_error_code_str(result));
-            return false;
-        }
-    }
-    
-    return true;
-}
-
+// The image is acquired without a fence, the submit fence of the frame in flight is what throttles the CPU
 inline bool create_fences(RendererState* state) {
     if (!create_submit_fences(state)) {
         return false;
     }
     
-    if (!create_acquire_fences(state)) {
-        return false;
-    }
-    
     return true;
 }
 
 
-inline bool create_command_pool(RendererState* state) {
+// One pool per submission so that a frame resets its own pool without touching the ones in flight
+inline bool create_command_pools(RendererState* state) {
     VkCommandPoolCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
     create_info.queueFamilyIndex = state->selection.graphics_queue_family_index;
     
-    VkResult result = vkCreateCommandPool(state->device, &create_info, nullptr, &state->command_pool);
-    if (result != VK_SUCCESS) {
-        println("vkCreateCommandPool returned (%s)", vk_error_code_str(result));
-        return false;
+    for (int i = 0;i < state->frames_in_flight;++i) {
+        CommandBufferSubmission* submission = &state->submissions[i];
+        VkResult result = vkCreateCommandPool(state->device, &create_info, nullptr, &submission->command_pool);
+        if (result != VK_SUCCESS) {
+            println("vkCreateCommandPool returned (%s)", vk_error_code_str(result));
+            return false;
+        }
+        
+        VkCommandBufferAllocateInfo allocate_info = {};
+        allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocate_info.commandPool = submission->command_pool;
+        allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocate_info.commandBufferCount = 1;
+        
+        result = vkAllocateCommandBuffers(state->device, &allocate_info, &submission->command_buffer);
+        if (result != VK_SUCCESS) {
+            println("vkAllocateCommandBuffers returned (%s)", vk_error_code_str(result));
+            return false;
+        }
     }
     
     return true;
@@ -789,7 +835,7 @@ inline bool create_descriptor_set_layout(RendererState* state) {
     // Create Camera descriptor set layout
     VkDescriptorSetLayoutBinding binding = {};
     binding.binding = 0;
-    binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     binding.descriptorCount = 1;
     binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
     
@@ -805,10 +851,10 @@ inline bool create_descriptor_set_layout(RendererState* state) {
         return false;
     }
     
-    // Create model transform descriptor set layout
+    // Create model transform descriptor set layout, the transforms of every instance of a frame
     binding = {};
     binding.binding = 0;
-    binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
     binding.descriptorCount = 1;
     binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     
@@ -922,12 +968,17 @@ inline bool create_graphics_pipeline(RendererState* state) {
     }
     stage_create_info[1].pName = "main";
     
-    VkVertexInputBindingDescription binding_description = {};
-    binding_description.binding = 0;
-    binding_description.stride = sizeof(Vertex);
-    binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    // The second binding holds the entity index of every instance, written in the frame ring
+    VkVertexInputBindingDescription binding_description[2] = {};
+    binding_description[0].binding = 0;
+    binding_description[0].stride = sizeof(Vertex);
+    binding_description[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    
+    binding_description[1].binding = 1;
+    binding_description[1].stride = sizeof(u32);
+    binding_description[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
     
-    VkVertexInputAttributeDescription attribute_description[4] = {};
+    VkVertexInputAttributeDescription attribute_description[5] = {};
     attribute_description[0].location = 0;
     attribute_description[0].binding = 0;
     attribute_description[0].format = VK_FORMAT_R32G32B32_SFLOAT;
@@ -948,10 +999,15 @@ inline bool create_graphics_pipeline(RendererState* state) {
     attribute_description[3].format = VK_FORMAT_R32G32B32_SFLOAT;
     attribute_description[3].offset = offsetof(Vertex, color);
     
+    attribute_description[4].location = 4;
+    attribute_description[4].binding = 1;
+    attribute_description[4].format = VK_FORMAT_R32_UINT;
+    attribute_description[4].offset = 0;
+    
     VkPipelineVertexInputStateCreateInfo vertex_input_state_create_info = {};
     vertex_input_state_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_state_create_info.vertexBindingDescriptionCount = 1;
-    vertex_input_state_create_info.pVertexBindingDescriptions = &binding_description;
+    vertex_input_state_create_info.vertexBindingDescriptionCount = array_size(binding_description);
+    vertex_input_state_create_info.pVertexBindingDescriptions = binding_description;
     vertex_input_state_create_info.vertexAttributeDescriptionCount = array_size(attribute_description);
     vertex_input_state_create_info.pVertexAttributeDescriptions = attribute_description;
     
@@ -1067,13 +1123,15 @@ inline bool create_framebuffers(RendererState* state) {
 }
 
 inline bool create_descriptor_pool(RendererState* state) {
-    VkDescriptorPoolSize pool_sizes[3] = {};
+    VkDescriptorPoolSize pool_sizes[4] = {};
     pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
     pool_sizes[0].descriptorCount = 256;
     pool_sizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     pool_sizes[1].descriptorCount = 256;
     pool_sizes[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     pool_sizes[2].descriptorCount = 256;
+    pool_sizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_sizes[3].descriptorCount = 256;
     
     VkDescriptorPoolCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -1191,15 +1249,26 @@ inline void destroy_pipeline_layout(RendererState* state, bool verbose) {
     }
 }
 
-inline void destroy_command_pool(RendererState* state, bool verbose) {
-    if (state->command_pool) {
-        if (verbose) {
-            println("Destroying command pool (%p)", state->command_pool);
-        }
-        vkDestroyCommandPool(state->device, state->command_pool, nullptr);
+// Destroying the pools frees their command buffers
+inline void destroy_command_pools(RendererState* state, bool verbose) {
+    if (!state->submissions) return;
+    
+    if (verbose) {
+        println("Destroying command pools");
+    }
+    for (int i = 0;i < state->frames_in_flight;++i) {
+        CommandBufferSubmission* submission = &state->submissions[i];
+        if (!submission->command_pool) continue;
+        
         if (verbose) {
-            println("");
+            println("    Destroying command pool (%p)", submission->command_pool);
         }
+        vkDestroyCommandPool(state->device, submission->command_pool, nullptr);
+        submission->command_pool = VK_NULL_HANDLE;
+        submission->command_buffer = VK_NULL_HANDLE;
+    }
+    if (verbose) {
+        println("");
     }
 }
 
@@ -1208,22 +1277,13 @@ inline void destroy_fences(RendererState* state, bool verbose) {
         println("Destroying fences");
     }
     if (state->submit_fences) {
-        for (int i = 0;i < state->swapchain_image_count;++i) {
+        for (int i = 0;i < state->frames_in_flight;++i) {
             println("    Destroying submit fence (%p)", state->submit_fences[i]);
             vkDestroyFence(state->device, state->submit_fences[i], nullptr);
         }
         
         free_null(state->submit_fences);
     }
-    
-    if (state->acquire_fences) {
-        for (int i = 0;i < state->swapchain_image_count;++i) {
-            println("    Destroying acquire fence (%p)", state->acquire_fences[i]);
-            vkDestroyFence(state->device, state->acquire_fences[i], nullptr);
-        }
-        
-        free_null(state->acquire_fences);
-    }
     if (verbose) {
         println("");
     }
@@ -1260,7 +1320,7 @@ inline void destroy_semaphores(RendererState* state, bool verbose) {
     }
     
     if (state->acquire_semaphores) {
-        for (int i = 0;i < state->swapchain_image_count;++i) {
+        for (int i = 0;i < state->frames_in_flight;++i) {
             if (verbose) {
                 println("    Destroying acquire semaphore (%p)", state->acquire_semaphores[i]);
             }
@@ -1350,6 +1410,7 @@ inline void destroy_swapchain(RendererState* state, bool verbose) {
             println("    Freeing swapchain images");
         }
         free_null(state->swapchain_images);
+        free_null(state->image_fences);
     }
     if (verbose) {
         println("");
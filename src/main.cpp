@@ -15,22 +15,32 @@
 
 #include "cg_types.h"
 
+#include "cg_arena_stats.h"
 #include "cg_benchmark.h"
+#include "cg_buffer_suballocator.h"
 #include "cg_camera.h"
 #include "cg_color.h"
+#include "cg_command_recorder.h"
+#include "cg_defragmenter.h"
+#include "cg_dirty_buffer.h"
+#include "cg_entity_store.h"
 #include "cg_files.h"
 #include "cg_fonts.h"
+#include "cg_frame_ring.h"
 #include "cg_gui.h"
 #include "cg_hash.h"
 #include "cg_input.h"
 #include "cg_macros.h"
 #include "cg_memory.h"
 #include "cg_obj_loader.h"
+#include "cg_pool_allocator.h"
 #include "cg_renderer.h"
 #include "cg_shaders.h"
 #include "cg_string.h"
 #include "cg_material.h"
 #include "cg_memory_arena.h"
+#include "cg_mesh_registry.h"
+#include "cg_frustum.h"
 #include "cg_random.h"
 #include "cg_texture.h"
 #include "cg_temporary_memory.h"
@@ -41,6 +51,10 @@
 #include "cg_window.h"
 #include "cg_window_user_data.h"
 
+// Image decoding goes to the scratch memory of the loading thread, see load_texture_from_filename()
+#define STBI_MALLOC(size) texture_decoder_allocate(size)
+#define STBI_REALLOC(data, size) texture_decoder_reallocate(data, size)
+#define STBI_FREE(data) texture_decoder_free(data)
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #undef STB_IMAGE_IMPLEMENTATION
@@ -58,20 +72,30 @@
 #undef STB_TRUETYPE_IMPLEMENTATION
 
 
+#include "cg_arena_stats.cpp"
 #include "cg_benchmark.cpp"
+#include "cg_buffer_suballocator.cpp"
 #include "cg_color.cpp"
+#include "cg_command_recorder.cpp"
+#include "cg_defragmenter.cpp"
+#include "cg_dirty_buffer.cpp"
+#include "cg_entity_store.cpp"
 #include "cg_files.cpp"
 #include "cg_fonts.cpp"
+#include "cg_frame_ring.cpp"
 #include "cg_gui.cpp"
 #include "cg_hash.cpp"
 #include "cg_input.cpp"
 #include "cg_math.cpp"
 #include "cg_memory.cpp"
 #include "cg_obj_loader.cpp"
+#include "cg_pool_allocator.cpp"
 #include "cg_shaders.cpp"
 #include "cg_string.cpp"
 #include "cg_material.cpp"
 #include "cg_memory_arena.cpp"
+#include "cg_mesh_registry.cpp"
+#include "cg_frustum.cpp"
 #include "cg_random.cpp"
 #include "cg_texture.cpp"
 #include "cg_temporary_memory.cpp"
@@ -86,6 +110,8 @@ struct FpsCounter {
     u64 start;
     u64 end;
     u64 cumulated_frame_duration;
+    f64 cumulated_squared_frame_duration;   // In ms², for the frame time standard deviation
+    u64 cumulated_record_duration;
     u32 frame_count;
 };
 
@@ -127,30 +153,42 @@ inline void update_fps_counter(RendererState* state, GLFWwindow* window, FpsCoun
     u64 last_start = fps_counter->start;
     fps_counter->start = get_time_ns();
     
-    fps_counter->cumulated_frame_duration += fps_counter->end - last_start;
+    u64 frame_duration = fps_counter->end - last_start;
+    fps_counter->cumulated_frame_duration += frame_duration;
+    fps_counter->cumulated_squared_frame_duration += ((f64)frame_duration / 1000000.0) * ((f64)frame_duration / 1000000.0);
+    fps_counter->cumulated_record_duration += state->temp_data.record_time;
     fps_counter->frame_count++;
     
-    TemporaryMemory temporary_memory = make_temporary_memory(&state->main_arena);
+    TemporaryMemory scratch = begin_scratch_memory();
     
     if (fps_counter->frame_count == state->temp_data.frame_count_update) {
         f64 average_frame_duration = (f64)fps_counter->cumulated_frame_duration / (f64)fps_counter->frame_count;
         average_frame_duration /= 1000000000.0;
+        f64 average_record_duration = (f64)fps_counter->cumulated_record_duration / (f64)fps_counter->frame_count / 1000000.0;
+        
+        f64 average_frame_ms = average_frame_duration * 1000.0;
+        f64 frame_variance = fps_counter->cumulated_squared_frame_duration / (f64)fps_counter->frame_count - average_frame_ms * average_frame_ms;
+        f64 frame_deviation = frame_variance > 0 ? sqrt(frame_variance) : 0;
         
         fps_counter->frame_count = 0;
         fps_counter->cumulated_frame_duration = 0;
+        fps_counter->cumulated_squared_frame_duration = 0;
+        fps_counter->cumulated_record_duration = 0;
         
-        String temp = push_string(&temporary_memory, 1000);
+        String temp = push_string(&scratch, 1000);
         
-        string_format(temp, "%f fps", 1.0 / average_frame_duration);
+        string_format(temp, "%f fps (%.3f ms +- %.3f, %u frames in flight), %u/%u entities visible, %u transforms uploaded, recorded in %.3f ms on %u threads",
+                      1.0 / average_frame_duration, average_frame_ms, frame_deviation, state->frames_in_flight,
+                      state->entity_resources.visible_count, state->entity_store.count,
+                      state->entity_resources.transform_buffer.last_upload.element_count,
+                      average_record_duration, state->temp_data.record_thread_count);
         glfwSetWindowTitle(window, temp.str);
         
         u32 int_fps = 1.0 / average_frame_duration;
         state->temp_data.frame_count_update = int_fps;
     }
     
-    char* data = (char*)allocate(&temporary_memory, 100000000);
-    
-    destroy_temporary_memory(&temporary_memory);
+    end_scratch_memory(&scratch);
 }
 
 
@@ -182,6 +220,7 @@ inline bool handle_swapchain_recreation(RendererState* state, WindowUserData* wi
         }
         
         free_null(state->swapchain_images);
+        free_null(state->image_fences);
         if (!get_swapchain_images(state)) {
             println("Failed to get swapchain images");
             return false;
@@ -228,57 +267,94 @@ inline bool handle_swapchain_recreation(RendererState* state, WindowUserData* wi
 }
 
 
-inline bool create_entity(RendererState* state, Vertex* vertex_buffer, u32 vertex_buffer_size, u32* entity_id) {
-    if (state->entity_count == MAX_ENTITY_COUNT) return false;
-    
+// The caller owns the first reference of the mesh, entities take their own. It must be released
+// with release_entity_mesh() once the entities are created, so that the last one frees the mesh.
+inline bool create_mesh(RendererState* state, const char* name, Vertex* vertex_buffer, u32 vertex_buffer_size, u32* mesh_index) {
     u32 buffer_size = vertex_buffer_size * sizeof(Vertex);
     
-    VkBufferCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_info.size = buffer_size;
-    create_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    create_info.queueFamilyIndexCount = 1;
-    create_info.pQueueFamilyIndices = &state->selection.graphics_queue_family_index;
-    
-    Entity* entity = &state->entities[state->entity_count];
+    BufferSuballocator* suballocator = &state->entity_resources.vertex_suballocator;
+    BufferRange vertex_range = {};
     
-    VkResult result = vkCreateBuffer(state->device, &create_info, nullptr, &entity->buffer);
-    if (result != VK_SUCCESS) {
-        println("vkCreateBuffer returned (%s)", vk_error_code_str(result));
+    u32 block_count = suballocator->block_count;
+    if (!suballocate(suballocator, &state->memory_manager, state->device, buffer_size, &vertex_range)) {
+        println("Error: failed to suballocate mesh vertices");
         return false;
     }
     
-    VkMemoryRequirements requirements = {};
-    
-    vkGetBufferMemoryRequirements(state->device, entity->buffer, &requirements);
-    
-    VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    // New blocks can be moved by the defragmenter like any other buffer, meshes only keep the block index
+    SuballocatorBlock* block = &suballocator->blocks[vertex_range.block_index];
+    if (suballocator->block_count != block_count) {
+        if (!register_defrag_buffer(&state->defragmenter, &block->buffer, &block->allocation, block->size, suballocator->usage, suballocator->memory_flags)) {
+            println("Warning: entity vertex block will not be defragmented");
+        }
+    }
     
-    if(!allocate(&state->memory_manager, state->device, requirements, memory_flags, &entity->allocation)) {
+    EntityBounds bounds = compute_entity_bounds(vertex_buffer, vertex_buffer_size);
+    if (!wait_for_defrag_buffer(&state->defragmenter, state, &block->buffer) ||
+        !add_mesh(&state->mesh_registry, name, vertex_range, vertex_buffer_size, bounds, mesh_index)) {
+        free_suballocation(suballocator, &vertex_range);
         return false;
     }
     
-    result = vkBindBufferMemory(state->device, entity->buffer, entity->allocation.device_memory, entity->allocation.offset);
-    if (result != VK_SUCCESS) {
-        println("vkBindBufferMemory returned (%s)", vk_error_code_str(result));
+    // Ranges are aligned on the vertex size, the offset is a whole number of vertices
+    memcpy(get_suballocation_data(suballocator, &vertex_range), vertex_buffer, buffer_size);
+    
+    return true;
+}
+
+inline bool create_entity(RendererState* state, u32 mesh_index, EntityHandle* handle) {
+    if (!add_entity(&state->entity_store, handle)) {
         return false;
     }
     
-    memcpy(entity->allocation.data, vertex_buffer, buffer_size);
-    
-    entity->offset = state->entity_count * sizeof(EntityTransformData);
-    entity->transform_data = &state->entity_resources.transform_data[state->entity_count];
-    entity->transform_data->model_matrix = identity_mat4f();
-    entity->transform_data->normal_matrix = identity_mat4f();
-    entity->size = vertex_buffer_size;
-    entity->id = state->entity_count + 1;
-    *entity_id = entity->id;
-    state->entity_count++;
+    u32 index = get_entity_index(&state->entity_store, *handle);
+    state->entity_store.meshes[index] = mesh_index;
+    set_entity_bounds(&state->entity_store, index, state->mesh_registry.meshes[mesh_index].bounds);
+    acquire_mesh(&state->mesh_registry, mesh_index);
     
     return true;
 }
 
+inline void free_released_mesh_ranges(RendererState* state, u32 frame_index) {
+    EntityResources* resources = &state->entity_resources;
+    for (u32 i = 0;i < resources->released_range_count[frame_index];++i) {
+        free_suballocation(&resources->vertex_suballocator, &resources->released_ranges[frame_index][i]);
+    }
+    resources->released_range_count[frame_index] = 0;
+}
+
+// The frames in flight may still draw the mesh, its vertices are kept until the fence of the frame
+// being prepared signaled. Frames are submitted in order, the older ones are finished by then.
+inline void release_entity_mesh(RendererState* state, u32 mesh_index) {
+    BufferRange vertex_range = {};
+    if (!release_mesh(&state->mesh_registry, mesh_index, &vertex_range)) return;
+    
+    EntityResources* resources = &state->entity_resources;
+    u32 frame = state->frame_index;
+    if (resources->released_range_count[frame] == resources->released_range_capacity[frame]) {
+        u32 capacity = resources->released_range_capacity[frame] ? 2 * resources->released_range_capacity[frame] : 16;
+        BufferRange* ranges = (BufferRange*)realloc(resources->released_ranges[frame], capacity * sizeof(BufferRange));
+        if (ranges == 0) {
+            println("Error: failed to defer the release of mesh vertices, waiting for the device");
+            vkDeviceWaitIdle(state->device);
+            free_suballocation(&resources->vertex_suballocator, &vertex_range);
+            return;
+        }
+        resources->released_ranges[frame] = ranges;
+        resources->released_range_capacity[frame] = capacity;
+    }
+    
+    resources->released_ranges[frame][resources->released_range_count[frame]++] = vertex_range;
+}
+
+inline void destroy_entity(RendererState* state, EntityHandle handle) {
+    u32 index = get_entity_index(&state->entity_store, handle);
+    if (index == ENTITY_INVALID_INDEX) return;
+    
+    release_entity_mesh(state, state->entity_store.meshes[index]);
+    remove_entity(&state->entity_store, handle);
+}
+
 inline bool create_square_entity(RendererState* state) {
     f32 z = 0.0f;
     Vertex vertex_buffer[6] = {};
@@ -296,9 +372,20 @@ inline bool create_square_entity(RendererState* state) {
     vertex_buffer[5].position = new_vec3f(0.5, -0.5, z);
     vertex_buffer[5].color    = new_vec3f(0.0, 0.0, 1.0);
     
-    u32 entity_id = 0;
+    u32 mesh_index = find_mesh(&state->mesh_registry, "square");
+    bool mesh_created = mesh_index == MESH_INVALID_INDEX;
+    if (mesh_created && !create_mesh(state, "square", vertex_buffer, array_size(vertex_buffer), &mesh_index)) {
+        return false;
+    }
+    
+    EntityHandle handle = {};
+    
+    bool entity_created = create_entity(state, mesh_index, &handle);
+    if (mesh_created) {
+        release_entity_mesh(state, mesh_index);
+    }
     
-    return create_entity(state, vertex_buffer, array_size(vertex_buffer), &entity_id);
+    return entity_created;
 }
 
 inline void create_cube(Vec3f size, Vertex* vertices) {
@@ -593,21 +680,34 @@ inline Mat4f random_rotation_matrix() {
                            2.0f * PI * randf());
 }
 
-inline bool create_cube_entity(RendererState* state, Mat4f transform_matrix) {
-    Vertex vertex_buffer[36] = {};
-    create_cube(new_vec3f(0.2f, 0.2f, 0.2f), vertex_buffer);
+// Every cube shares the same mesh, they are drawn with a single instanced draw
+inline bool create_cube_entity(RendererState* state, Mat4f transform_matrix, EntityHandle* handle = 0) {
+    u32 mesh_index = find_mesh(&state->mesh_registry, "cube");
+    bool mesh_created = mesh_index == MESH_INVALID_INDEX;
+    if (mesh_created) {
+        Vertex vertex_buffer[36] = {};
+        create_cube(new_vec3f(0.2f, 0.2f, 0.2f), vertex_buffer);
+        
+        if (!create_mesh(state, "cube", vertex_buffer, array_size(vertex_buffer), &mesh_index)) {
+            return false;
+        }
+    }
     
-    u32 entity_id = 0;
+    EntityHandle entity_handle = {};
     
-    if(!create_entity(state, vertex_buffer, array_size(vertex_buffer), &entity_id)) {
+    bool entity_created = create_entity(state, mesh_index, &entity_handle);
+    if (mesh_created) {
+        release_entity_mesh(state, mesh_index);
+    }
+    if (!entity_created) {
         return false;
     }
     
-    Entity* entity = &state->entities[entity_id - 1];
-    
-    entity->transform_data->model_matrix = transform_matrix;
-    entity->transform_data->normal_matrix = transpose_inverse(&entity->transform_data->model_matrix);
+    set_entity_transform(&state->entity_store, get_entity_index(&state->entity_store, entity_handle), transform_matrix);
     
+    if (handle) {
+        *handle = entity_handle;
+    }
     return true;
 }
 
@@ -621,125 +721,76 @@ inline bool create_cube_entity(RendererState* state, Vec3f position) {
     return create_cube_entity(state, translation_matrix(position.x, position.y, position.z));
 }
 
-inline bool create_cube_entity_color(RendererState* state, Mat4f transform_matrix, Vec3f color) {
-    Vertex vertex_buffer[36] = {};
-    create_cube(new_vec3f(0.2f, 0.2f, 0.2f), color, vertex_buffer);
+inline bool create_cube_entity_color(RendererState* state, Mat4f transform_matrix, Vec3f color, EntityHandle* handle = 0) {
+    char temp[MAX_MESH_NAME_LENGTH] = {};
+    String mesh_name = make_string(temp, MAX_MESH_NAME_LENGTH - 1);
+    string_format(mesh_name, "cube %.3f %.3f %.3f", color.x, color.y, color.z);
+    
+    u32 mesh_index = find_mesh(&state->mesh_registry, mesh_name.str);
+    bool mesh_created = mesh_index == MESH_INVALID_INDEX;
+    if (mesh_created) {
+        Vertex vertex_buffer[36] = {};
+        create_cube(new_vec3f(0.2f, 0.2f, 0.2f), color, vertex_buffer);
+        
+        if (!create_mesh(state, mesh_name.str, vertex_buffer, array_size(vertex_buffer), &mesh_index)) {
+            return false;
+        }
+    }
     
-    u32 entity_id = 0;
+    EntityHandle entity_handle = {};
     
-    if(!create_entity(state, vertex_buffer, array_size(vertex_buffer), &entity_id)) {
+    bool entity_created = create_entity(state, mesh_index, &entity_handle);
+    if (mesh_created) {
+        release_entity_mesh(state, mesh_index);
+    }
+    if (!entity_created) {
         return false;
     }
     
-    Entity* entity = &state->entities[entity_id - 1];
-    
-    entity->transform_data->model_matrix = transform_matrix;
-    entity->transform_data->normal_matrix = transpose_inverse(&entity->transform_data->model_matrix);
+    set_entity_transform(&state->entity_store, get_entity_index(&state->entity_store, entity_handle), transform_matrix);
     
+    if (handle) {
+        *handle = entity_handle;
+    }
     return true;
 }
 
-inline bool create_cube_entity_color(RendererState* state, Vec3f position, Vec3f color) {
-    return create_cube_entity_color(state, translation_matrix(position.x, position.y, position.z), color);
+inline bool create_cube_entity_color(RendererState* state, Vec3f position, Vec3f color, EntityHandle* handle = 0) {
+    return create_cube_entity_color(state, translation_matrix(position.x, position.y, position.z), color, handle);
 }
 
-inline bool allocate_camera_descriptor_sets(RendererState* state) {
-    state->camera_resources.descriptor_sets = (VkDescriptorSet*)calloc(state->swapchain_image_count, sizeof(VkDescriptorSet));
-    
-    VkDescriptorSetLayout* layouts;
-    layouts = (VkDescriptorSetLayout*)calloc(state->swapchain_image_count, sizeof(VkDescriptorSetLayout));
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        layouts[i] = state->descriptor_set_layouts[CameraDescriptorSetLayout];
-    }
-    
+inline bool allocate_camera_descriptor_set(RendererState* state) {
     VkDescriptorSetAllocateInfo allocate_info = {};
     allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocate_info.descriptorPool = state->descriptor_pool;
-    allocate_info.descriptorSetCount = state->swapchain_image_count;
-    allocate_info.pSetLayouts = layouts;
+    allocate_info.descriptorSetCount = 1;
+    allocate_info.pSetLayouts = &state->descriptor_set_layouts[CameraDescriptorSetLayout];
     
-    VkResult result = vkAllocateDescriptorSets(state->device, &allocate_info, state->camera_resources.descriptor_sets);
+    VkResult result = vkAllocateDescriptorSets(state->device, &allocate_info, &state->camera_resources.descriptor_set);
     if (result != VK_SUCCESS) {
         println("vkAllocateDescriptorSets returned (%s)", vk_error_code_str(result));
         return false;
-        free_null(layouts);
-    }
-    
-    free_null(layouts);
-    
-    return true;
-}
-
-inline bool create_camera_buffers(RendererState* state) {
-    state->camera_resources.buffers     = (VkBuffer*)            calloc(state->swapchain_image_count, sizeof(VkBuffer));
-    state->camera_resources.allocations = (AllocatedMemoryChunk*)calloc(state->swapchain_image_count, sizeof(AllocatedMemoryChunk));
-    
-    VkBufferCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_info.size = sizeof(CameraContext);
-    create_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    create_info.queueFamilyIndexCount = 1;
-    create_info.pQueueFamilyIndices = &state->selection.graphics_queue_family_index;
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        VkResult result = vkCreateBuffer(state->device, &create_info, nullptr, &state->camera_resources.buffers[i]);
-        if (result != VK_SUCCESS) {
-            println("vkCreateBuffer returned (%s)", vk_error_code_str(result));
-            return false;
-        }
-        
-        VkMemoryRequirements requirements = {};
-        
-        vkGetBufferMemoryRequirements(state->device, state->camera_resources.buffers[i], &requirements);
-        
-        VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-        
-        if(!allocate(&state->memory_manager, state->device, requirements, memory_flags, &state->camera_resources.allocations[i])) {
-            return false;
-        }
-        
-        result = vkBindBufferMemory(state->device, state->camera_resources.buffers[i], state->camera_resources.allocations[i].device_memory, state->camera_resources.allocations[i].offset);
-        if (result != VK_SUCCESS) {
-            println("vkBindBufferMemory returned (%s)",vk_error_code_str(result));
-            return false;
-        }
-        
-        memcpy(state->camera_resources.allocations[i].data, &state->camera.context, sizeof(CameraContext));
     }
     
     return true;
 }
 
 inline void update_camera_descriptor_set(RendererState* state) {
-    VkDescriptorBufferInfo* buffer_info;
-    
-    buffer_info = (VkDescriptorBufferInfo*)calloc(state->swapchain_image_count, sizeof(VkDescriptorBufferInfo));
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        buffer_info[i].buffer = state->camera_resources.buffers[i];
-        buffer_info[i].offset = 0;
-        buffer_info[i].range = sizeof(CameraContext);
-    }
-    
-    VkWriteDescriptorSet* writes;
-    
-    writes = (VkWriteDescriptorSet*)calloc(state->swapchain_image_count, sizeof(VkWriteDescriptorSet));
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        writes[i].dstSet = state->camera_resources.descriptor_sets[i];
-        writes[i].dstBinding = 0;
-        writes[i].dstArrayElement = 0;
-        writes[i].descriptorCount = 1;
-        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        writes[i].pBufferInfo = &buffer_info[i];
-    }
-    
-    vkUpdateDescriptorSets(state->device, state->swapchain_image_count, writes, 0, nullptr);
-    
-    free_null(buffer_info);
-    free_null(writes);
+    VkDescriptorBufferInfo buffer_info = {};
+    buffer_info.buffer = state->camera_resources.buffer.buffer;
+    buffer_info.offset = 0;
+    buffer_info.range = sizeof(CameraContext);
+    
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = state->camera_resources.descriptor_set;
+    write.dstBinding = 0;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    write.pBufferInfo = &buffer_info;
+    
+    vkUpdateDescriptorSets(state->device, 1, &write, 0, nullptr);
 }
 
 inline bool init_camera(RendererState* state) {
@@ -756,11 +807,17 @@ inline bool init_camera(RendererState* state) {
     state->camera.context.projection = perspective(state->camera.fov, state->camera.aspect, 0.1f, 100.0f);
     state->camera.context.view = look_from_yaw_and_pitch(*state->camera.position, state->camera.yaw, state->camera.pitch, new_vec3f(0.0f, 1.0f, 0.0f));
     
-    if (!allocate_camera_descriptor_sets(state)) {
+    // Every copy starts at a dynamic offset
+    VkPhysicalDeviceProperties physical_device_properties = {};
+    vkGetPhysicalDeviceProperties(state->selection.device, &physical_device_properties);
+    if (!init_dirty_buffer(&state->camera_resources.buffer, &state->memory_manager, state->device,
+                           sizeof(CameraContext), 1, state->frames_in_flight,
+                           physical_device_properties.limits.minUniformBufferOffsetAlignment,
+                           VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, MEMORY_TAG_CAMERA, state->selection.graphics_queue_family_index)) {
         return false;
     }
     
-    if (!create_camera_buffers(state)) {
+    if (!allocate_camera_descriptor_set(state)) {
         return false;
     }
     
@@ -769,115 +826,91 @@ inline bool init_camera(RendererState* state) {
     return true;
 }
 
-inline bool create_entity_buffers(RendererState* state) {
-    state->entity_resources.buffers = (VkBuffer*)calloc(state->swapchain_image_count, sizeof(VkBuffer));
-    state->entity_resources.allocations = (AllocatedMemoryChunk*)calloc(state->swapchain_image_count, sizeof(AllocatedMemoryChunk));
-    
-    VkBufferCreateInfo create_info = {};
-    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_info.size  = MAX_ENTITY_COUNT * sizeof(EntityTransformData);
-    create_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    create_info.queueFamilyIndexCount = 1;
-    create_info.pQueueFamilyIndices = &state->selection.graphics_queue_family_index;
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        VkResult result = vkCreateBuffer(state->device, &create_info, nullptr, &state->entity_resources.buffers[i]);
-        if (result != VK_SUCCESS) {
-            println("vkCreateBuffer returned (%s)", vk_error_code_str(result));
-            return false;
-        }
-        
-        VkMemoryRequirements requirements = {};
-        
-        vkGetBufferMemoryRequirements(state->device, state->entity_resources.buffers[i], &requirements);
-        
-        VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-        
-        if(!allocate(&state->memory_manager, state->device, requirements, memory_flags, &state->entity_resources.allocations[i])) {
-            return false;
-        }
-        
-        result = vkBindBufferMemory(state->device, state->entity_resources.buffers[i], state->entity_resources.allocations[i].device_memory, state->entity_resources.allocations[i].offset);
-        if (result != VK_SUCCESS) {
-            println("vkBindBufferMemory returned (%s)", vk_error_code_str(result));
-            return false;
-        }
-    }
-    
-    return true;
-}
-
-inline bool create_entity_descriptor_sets(RendererState* state) {
-    state->entity_resources.descriptor_sets = (VkDescriptorSet*)calloc(state->swapchain_image_count, sizeof(VkDescriptorSet));
-    
-    VkDescriptorSetLayout* layouts;
-    layouts = (VkDescriptorSetLayout*)calloc(state->swapchain_image_count, sizeof(VkDescriptorSetLayout));
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        layouts[i] = state->descriptor_set_layouts[TransformDescriptorSetLayout];
-    }
-    
+inline bool create_entity_descriptor_set(RendererState* state) {
     VkDescriptorSetAllocateInfo allocate_info = {};
     allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocate_info.descriptorPool = state->descriptor_pool;
-    allocate_info.descriptorSetCount = state->swapchain_image_count;
-    allocate_info.pSetLayouts = layouts;
+    allocate_info.descriptorSetCount = 1;
+    allocate_info.pSetLayouts = &state->descriptor_set_layouts[TransformDescriptorSetLayout];
     
-    VkResult result = vkAllocateDescriptorSets(state->device, &allocate_info, state->entity_resources.descriptor_sets);
+    VkResult result = vkAllocateDescriptorSets(state->device, &allocate_info, &state->entity_resources.descriptor_set);
     if (result != VK_SUCCESS) {
         println("vkAllocateDescriptorSets returned (%s)", vk_error_code_str(result));
         return false;
-        free_null(layouts);
     }
     
-    free_null(layouts);
-    
     return true;
 }
 
-inline void update_entity_descriptor_sets(RendererState* state) {
-    VkDescriptorBufferInfo* buffer_info;
-    
-    buffer_info = (VkDescriptorBufferInfo*)calloc(state->swapchain_image_count, sizeof(VkDescriptorBufferInfo));
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        buffer_info[i].buffer = state->entity_resources.buffers[i];
-        buffer_info[i].offset = 0;
-        buffer_info[i].range = sizeof(EntityTransformData);
+inline void update_entity_descriptor_set(RendererState* state) {
+    VkDescriptorBufferInfo buffer_info = {};
+    buffer_info.buffer = state->entity_resources.transform_buffer.buffer;
+    buffer_info.offset = 0;
+    buffer_info.range = VK_WHOLE_SIZE;
+    
+    // Every copy is visible, the instance entity indices include the offset of this frame copy
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = state->entity_resources.descriptor_set;
+    write.dstBinding = 0;
+    write.dstArrayElement = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &buffer_info;
+    
+    vkUpdateDescriptorSets(state->device, 1, &write, 0, nullptr);
+}
+
+// Copies are aligned on a whole transform so that the shader can index them all from the start
+inline bool create_entity_transform_buffer(RendererState* state, u32 capacity) {
+    if (!init_dirty_buffer(&state->entity_resources.transform_buffer, &state->memory_manager, state->device,
+                           sizeof(EntityTransformData), capacity, state->frames_in_flight, sizeof(EntityTransformData),
+                           VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, MEMORY_TAG_ENTITY, state->selection.graphics_queue_family_index)) {
+        println("Error: failed to create the entity transform buffer");
+        return false;
     }
     
-    VkWriteDescriptorSet* writes;
-    
-    writes = (VkWriteDescriptorSet*)calloc(state->swapchain_image_count, sizeof(VkWriteDescriptorSet));
-    
-    for (int i = 0;i < state->swapchain_image_count;++i) {
-        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        writes[i].dstSet = state->entity_resources.descriptor_sets[i];
-        writes[i].dstBinding = 0;
-        writes[i].dstArrayElement = 0;
-        writes[i].descriptorCount = 1;
-        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-        writes[i].pBufferInfo = &buffer_info[i];
+    update_entity_descriptor_set(state);
+    return true;
+}
+
+// The descriptor set can not be updated while a frame in flight uses it, the device is idled first.
+// The store doubles its capacity, this only happens a few times.
+inline bool grow_entity_transform_buffer(RendererState* state) {
+    VkResult result = vkDeviceWaitIdle(state->device);
+    if (result != VK_SUCCESS) {
+        println("vkDeviceWaitIdle returned (%s)", vk_error_code_str(result));
+        return false;
     }
     
-    vkUpdateDescriptorSets(state->device, state->swapchain_image_count, writes, 0, nullptr);
-    
-    free_null(buffer_info);
-    free_null(writes);
+    destroy_dirty_buffer(&state->entity_resources.transform_buffer, &state->memory_manager, state->device);
+    return create_entity_transform_buffer(state, state->entity_store.capacity);
 }
 
 inline bool init_entities(RendererState* state) {
-    if (!create_entity_buffers(state)) {
-        println("Error: failed to create entity buffers");
+    if (!init_entity_store(&state->entity_store, INITIAL_ENTITY_CAPACITY) ||
+        !init_mesh_registry(&state->mesh_registry, INITIAL_MESH_CAPACITY)) {
         return false;
     }
     
-    if (!create_entity_descriptor_sets(state)) {
-        println("Error: failed to create entity descriptor sets");
+    if (!create_entity_descriptor_set(state)) {
+        println("Error: failed to create entity descriptor set");
         return false;
     }
     
-    update_entity_descriptor_sets(state);
+    if (!create_entity_transform_buffer(state, state->entity_store.capacity)) {
+        return false;
+    }
+    
+    // Vertices are written once from the CPU, device local memory that can be mapped is the best fit.
+    // Transfer usages let the defragmenter move the blocks to another pool.
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkMemoryPropertyFlags preferred_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    
+    if (!init_buffer_suballocator(&state->entity_resources.vertex_suballocator, ENTITY_VERTEX_BLOCK_SIZE, sizeof(Vertex), usage, memory_flags, preferred_flags, MEMORY_TAG_ENTITY, state->selection.graphics_queue_family_index)) {
+        return false;
+    }
     
     return true;
 }
@@ -943,6 +976,15 @@ inline bool init_renderer(RendererState* state) {
         println("required device extensions: supported");
     }
     
+    state->selection.memory_budget_supported = is_device_extension_available(state->selection.device, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    println("memory budget extension: %s", state->selection.memory_budget_supported ? "supported" : "not supported");
+    
+    // The indirect commands select the transforms of their mesh with firstInstance
+    VkPhysicalDeviceFeatures features = {};
+    vkGetPhysicalDeviceFeatures(state->selection.device, &features);
+    state->selection.multi_draw_indirect_supported = features.multiDrawIndirect && features.drawIndirectFirstInstance;
+    println("multi draw indirect: %s", state->selection.multi_draw_indirect_supported ? "supported" : "not supported");
+    
     if (!create_device_and_queues(state)) {
         println("Error: failed to create the device.");
         return false;
@@ -953,12 +995,34 @@ inline bool init_renderer(RendererState* state) {
     u32 allocation_size = MB(128);
     u32 min_page_size = KB(4);
     
-    if (!init_memory(&state->memory_manager, allocation_size, min_page_size, state->selection.device)) {
+    if (!init_memory(&state->memory_manager, allocation_size, min_page_size, state->selection.device, state->device, state->selection.memory_budget_supported)) {
         return false;
     } else {
         println("memory manager init: success");
     }
     
+    // Same properties as the entity vertex blocks, so that the reserve lands in the type they use
+    VkMemoryPropertyFlags host_visible_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!reserve_memory(&state->memory_manager, state->device, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0, DEVICE_LOCAL_MEMORY_RESERVE) ||
+        !reserve_memory(&state->memory_manager, state->device, host_visible_flags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, HOST_VISIBLE_MEMORY_RESERVE)) {
+        return false;
+    } else {
+        println("memory reserve: success");
+    }
+    
+    // The instance entity indices and the indirect commands are rebuilt every frame in the frame ring.
+    // Data that mostly stays the same from frame to frame lives in dirty buffers instead.
+    VkBufferUsageFlags frame_ring_usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+    VkDeviceSize frame_ring_alignment = sizeof(VkDrawIndirectCommand);
+    
+    if (!init_frame_ring_allocator(&state->frame_ring, &state->memory_manager, state->device,
+                                   FRAME_RING_SIZE, frame_ring_alignment,
+                                   frame_ring_usage, state->selection.graphics_queue_family_index)) {
+        return false;
+    } else {
+        println("frame ring init: success");
+    }
+    
     if (!select_surface_format(state)) {
         return false;
     }
@@ -985,6 +1049,11 @@ inline bool init_renderer(RendererState* state) {
         println("depth images init: success");
     }
     
+    if (state->frames_in_flight == 0 || state->frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+        println("Error: %u frames in flight requested, the renderer supports 1 to %u", state->frames_in_flight, MAX_FRAMES_IN_FLIGHT);
+        return false;
+    }
+    
     if (!create_semaphore(state)) {
         return false;
     }
@@ -993,10 +1062,18 @@ inline bool init_renderer(RendererState* state) {
         return false;
     }
     
-    if (!create_command_pool(state)) {
+    if (!create_command_pools(state)) {
         return false;
     } else {
-        println("command pool init: success");
+        println("command pools init: success");
+    }
+    
+    // One thread per core at most, the main thread is one of them
+    long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!init_command_recorder(&state->command_recorder, state->device, state->selection.graphics_queue_family_index, core_count > 0 ? (u32)core_count : 1)) {
+        return false;
+    } else {
+        println("command recorder init: %u threads", state->command_recorder.thread_count);
     }
     
     if (!create_swapchain_image_views(state)) {
@@ -1083,12 +1160,16 @@ inline bool init_font(RendererState* state) {
     
     ConstString font_name = make_literal_string("ubuntu");
     
-    String font_file_path = push_string(&state->temporary_storage, 256);
+    TemporaryMemory scratch = begin_scratch_memory();
+    String font_file_path = push_string(&scratch, 256);
     string_format(font_file_path, "%s/resources/fonts/UbuntuMono-R.ttf", PROGRAM_ROOT);
     
     ConstString const_font_file_path = make_const_string(&font_file_path);
     
-    if (!load_and_add_font_to_catalog(&state->font_catalog, &font_name, &const_font_file_path, &state->main_arena)) {
+    bool font_loaded = load_and_add_font_to_catalog(&state->font_catalog, &font_name, &const_font_file_path, &state->main_arena);
+    end_scratch_memory(&scratch);
+    
+    if (!font_loaded) {
         return false;
     } else {
         println("loading '%s' font: success", font_name.str);
@@ -1200,6 +1281,12 @@ inline bool init(RendererState* state, WindowUserData* window_user_data) {
         println("entities init : success");
     }
     
+    if (!init_defragmenter(&state->defragmenter, state)) {
+        return false;
+    } else {
+        println("defragmenter init : success");
+    }
+    
     if (!create_cube_entity(state, new_vec3f(1.0f, 0.0f, 0.0f))) {
         return false;
     }
@@ -1213,33 +1300,42 @@ inline bool init(RendererState* state, WindowUserData* window_user_data) {
         return false;
     }
     
-    if (!create_cube_entity_color(state, new_vec3f(0.0f, 0.0f, 0.0f), new_vec3f(1.0f, 1.0f, 1.0f))) {
+    if (!create_cube_entity_color(state, new_vec3f(0.0f, 0.0f, 0.0f), new_vec3f(1.0f, 1.0f, 1.0f), &state->temp_data.light_entity)) {
         return false;
     }
     
-    state->temp_data.light_entity_id = state->entity_count - 1;
-    
     start = get_time_ns();
-    String obj_filename_var = push_string(&state->temporary_storage, 100);
+    TemporaryMemory scratch = begin_scratch_memory();
+    String obj_filename_var = push_string(&scratch, 100);
     string_format(obj_filename_var, "%s/resources/models/obj/Trumpet.obj", PROGRAM_ROOT);
     ConstString obj_filename = make_const_string(&obj_filename_var);
     
     Vertex* vertex_buffer = {};
     u32 vertex_buffer_size = 0;
     
-    if (!load_obj_file(&obj_filename, &vertex_buffer, &vertex_buffer_size, &state->main_arena)) {
+    bool obj_loaded = load_obj_file(&obj_filename, &vertex_buffer, &vertex_buffer_size, &state->main_arena);
+    end_scratch_memory(&scratch);
+    
+    if (!obj_loaded) {
         return false;
     }
     end = get_time_ns();
     
     println("Loading took %f s", (f32)(end - start) / (f32)1e9);
     
-    u32 trumpet_id = 0;
-    if (!create_entity(state, vertex_buffer, vertex_buffer_size, &trumpet_id)) {
+    u32 trumpet_mesh = 0;
+    EntityHandle trumpet = {};
+    if (!create_mesh(state, "Trumpet.obj", vertex_buffer, vertex_buffer_size, &trumpet_mesh)) {
         return false;
     }
     
-    state->entities[state->entity_count - 1].transform_data->model_matrix = translation_matrix(0.0f, 3.0f, 0.0f);
+    bool trumpet_created = create_entity(state, trumpet_mesh, &trumpet);
+    release_entity_mesh(state, trumpet_mesh);
+    if (!trumpet_created) {
+        return false;
+    }
+    
+    set_entity_transform(&state->entity_store, get_entity_index(&state->entity_store, trumpet), translation_matrix(0.0f, 3.0f, 0.0f));
     
     glfwSetWindowUserPointer(state->window, window_user_data);
     glfwSetKeyCallback(state->window, key_callback);
@@ -1252,38 +1348,49 @@ inline bool init(RendererState* state, WindowUserData* window_user_data) {
     glfwSetCursorPos(state->window, state->swapchain_extent.width / 2, state->swapchain_extent.height / 2);
     
     state->temp_data.frame_count_update = 60;
+    state->temp_data.use_indirect_draws = state->selection.multi_draw_indirect_supported;
+    
+    print_memory_statistics(&state->memory_manager);
+    
+    register_arena(&state->arena_registry, &state->main_arena, "main");
+    register_arena(&state->arena_registry, &state->temporary_storage, "temporary");
+    register_arena(&state->arena_registry, &state->gui_resources.main_arena, "gui");
+    register_arena(&state->arena_registry, &state->material_catalog.arena, "material");
+    
+    // Loading is over, the temporary storage only needs its per frame pages from now on
+    reset_arena(&state->temporary_storage, true);
     
     return true;
 }
 
-inline bool wait_for_acquire_fence(RendererState* state) {
-    VkResult result = vkWaitForFences(state->device,
-                                      1,
-                                      &state->acquire_fences[state->current_semaphore_index],
-                                      VK_TRUE,
-                                      1000000000);
+// Waits until the GPU is done with the last submission of the current frame in flight, its command
+// pool, frame ring slot and recorder slot can be reused afterwards. The fence is only reset once an
+// image was acquired, so that a frame dropped for swapchain recreation does not leave it unsignaled.
+inline bool wait_for_frame_fence(RendererState* state) {
+    VkResult result = vkWaitForFences(state->device, 1, state->submissions[state->frame_index].fence, VK_TRUE, 1000000000);
     if (result != VK_SUCCESS) {
         println("vkWaitForFences returned (%s)", vk_error_code_str(result));
         return false;
     }
     
-    result = vkResetFences(state->device, 1, &state->acquire_fences[state->current_semaphore_index]);
-    if (result != VK_SUCCESS) {
-        println("vkResetFences returned (%s)", vk_error_code_str(result));
-        return false;
-    }
-    
     return true;
 }
 
-inline bool wait_for_submit_fence(RendererState* state) {
-    VkResult result = vkWaitForFences(state->device, 1, state->submissions[state->image_index].fence, VK_TRUE, 1000000000);
-    if (result != VK_SUCCESS) {
-        println("vkWaitForFences returned (%s)", vk_error_code_str(result));
-        return false;
+// The acquired image may still be rendered to by another frame in flight when there are more frames
+// than images, or when the presentation engine hands them out of order.
+inline bool wait_for_image_fence(RendererState* state) {
+    VkFence* frame_fence = state->submissions[state->frame_index].fence;
+    VkFence image_fence = state->image_fences[state->image_index];
+    if (image_fence && image_fence != *frame_fence) {
+        VkResult result = vkWaitForFences(state->device, 1, &image_fence, VK_TRUE, 1000000000);
+        if (result != VK_SUCCESS) {
+            println("vkWaitForFences returned (%s)", vk_error_code_str(result));
+            return false;
+        }
     }
+    state->image_fences[state->image_index] = *frame_fence;
     
-    result = vkResetFences(state->device, 1, state->submissions[state->image_index].fence);
+    VkResult result = vkResetFences(state->device, 1, frame_fence);
     if (result != VK_SUCCESS) {
         println("vkResetFences returned (%s)", vk_error_code_str(result));
         return false;
@@ -1359,19 +1466,108 @@ inline void update_camera(RendererState* state, Input* input, Time* time) {
                                                3.0f * sin(2.0f * PI * *angle));
 }
 
-inline void update_entities(RendererState* state) {
+inline bool update_entities(RendererState* state) {
     // Update light cube position
     Vec3f* light_position = &state->camera.context.light_position;
-    Entity* light_entity = &state->entities[state->temp_data.light_entity_id];
-    Mat4f* light_model_matrix = &light_entity->transform_data->model_matrix;
-    *light_model_matrix = translation_matrix(light_position->x, light_position->y, light_position->z);
-    Mat4f* light_normal_matrix = &light_entity->transform_data->normal_matrix;
-    *light_normal_matrix = transpose_inverse(light_model_matrix);
+    EntityStore* store = &state->entity_store;
+    u32 light_index = get_entity_index(store, state->temp_data.light_entity);
+    if (light_index != ENTITY_INVALID_INDEX) {
+        set_entity_transform(store, light_index, translation_matrix(light_position->x, light_position->y, light_position->z));
+    }
+    
+    // Only the entities whose bounding sphere touches the view frustum are drawn
+    EntityResources* resources = &state->entity_resources;
+    CameraContext* camera_context = &state->camera.context;
+    Mat4f view_projection = camera_context->projection * camera_context->view;
+    Frustum frustum = extract_frustum(&view_projection);
+    
+    TemporaryMemory scratch = begin_scratch_memory();
+    u8* visibility = (u8*)allocate(&scratch, store->count);
+    resources->visible_count = cull_spheres(&frustum, store->sphere_x, store->sphere_y, store->sphere_z, store->sphere_radius, store->count, visibility);
+    
+    // The changes since the last frame go to every copy, the copy of this frame then gets all the
+    // transforms it missed since it was last used. Static entities are not written again.
+    DirtyBuffer* transform_buffer = &resources->transform_buffer;
+    if (store->capacity > transform_buffer->tracker.element_capacity && !grow_entity_transform_buffer(state)) {
+        end_scratch_memory(&scratch);
+        return false;
+    }
+    
+    mark_dirty_bits(&transform_buffer->tracker, store->dirty_bits, store->count);
+    clear_entity_dirty_bits(store);
+    if (!upload_dirty_buffer(transform_buffer, state->frame_index, store->transforms, store->count)) {
+        end_scratch_memory(&scratch);
+        return false;
+    }
+    
+    // Grouped by mesh for the instanced draws, each instance points at its entity transform
+    FrameRingSlice slice = {};
+    if (!frame_ring_allocate(&state->frame_ring, resources->visible_count * sizeof(u32), &slice)) {
+        end_scratch_memory(&scratch);
+        return false;
+    }
+    
+    u32 base_index = (u32)(get_dirty_copy_offset(transform_buffer, state->frame_index) / sizeof(EntityTransformData));
+    write_instance_indices(&state->mesh_registry, store, visibility, base_index, (u32*)slice.data);
+    resources->first_instance = (u32)(slice.offset / sizeof(u32));
+    end_scratch_memory(&scratch);
+    
+    // At most one command per mesh, the ones without instances are left out
+    resources->indirect_batch_count = 0;
+    if (state->temp_data.use_indirect_draws && state->mesh_registry.mesh_count != 0) {
+        FrameRingSlice command_slice = {};
+        if (!frame_ring_allocate(&state->frame_ring, state->mesh_registry.mesh_count * sizeof(VkDrawIndirectCommand), &command_slice)) {
+            return false;
+        }
+        
+        write_indirect_commands(&state->mesh_registry, resources->first_instance, (VkDrawIndirectCommand*)command_slice.data,
+                                resources->indirect_batches, &resources->indirect_batch_count);
+        resources->indirect_offset = command_slice.offset;
+    }
+    
+    return true;
+}
+
+// Per frame peak of every registered arena over the recorded history, scaled to its highest peak
+inline void draw_arena_stats(RendererState* state, FontAtlas* font_atlas, i32 x, i32 y) {
+    GuiState* gui_state = &state->gui_state;
+    ArenaRegistry* registry = &state->arena_registry;
+    
+    Vec4f background_color = new_coloru(30, 30, 30);
+    Vec4f bar_color = new_coloru(80, 160, 80);
+    Vec4f text_color = new_coloru(200, 200, 200);
     
-    memcpy(state->entity_resources.allocations[state->image_index].data, state->entity_resources.transform_data, state->entity_count * sizeof(EntityTransformData));
+    u32 history_size = get_arena_history_size(registry);
+    if (history_size == 0) return;
+    
+    TemporaryMemory scratch = begin_scratch_memory();
+    f32* values = push_array(&scratch, f32, history_size);
+    
+    char temp[201] = {};
+    String var_text = make_string(temp, 200);
+    for (u32 i = 0;i < registry->entry_count;++i) {
+        ArenaStatsEntry* entry = &registry->entries[i];
+        ArenaFrameStats* last_stats = get_arena_frame_stats(registry, entry, 0);
+        
+        string_format(var_text, "%s: %lu KB, peak %lu KB, %u allocations, %lu overflows",
+                      entry->name, last_stats->peak_usage / 1024, entry->max_peak_usage / 1024,
+                      last_stats->allocation_count, entry->total_overflow_count);
+        ConstString text = make_const_string(&var_text);
+        draw_text(gui_state, &text, x, y, text_color, TextAnchor::TopLeft, font_atlas);
+        
+        for (u32 frame = 0;frame < history_size;++frame) {
+            values[history_size - 1 - frame] = (f32)get_arena_frame_stats(registry, entry, frame)->peak_usage;
+        }
+        draw_bar_graph(gui_state, new_rect2i_dim(x, y + 25, ARENA_STATS_HISTORY_SIZE, 40),
+                       values, history_size, (f32)entry->max_peak_usage, background_color, bar_color);
+        
+        y += 75;
+    }
+    
+    end_scratch_memory(&scratch);
 }
 
-inline void update_gui(RendererState* state, Input* input) {
+inline bool update_gui(RendererState* state, Input* input) {
     reset_gui(&state->gui_state, &state->gui_resources);
     
     GuiState* gui_state = &state->gui_state;
@@ -1433,14 +1629,48 @@ inline void update_gui(RendererState* state, Input* input) {
         }
     }
     
-    memcpy(state->gui_resources.allocations[state->image_index].data, state->gui_state.vertex_buffer, state->gui_state.current_size * sizeof(GuiVertex));
+    if (state->temp_data.show_arena_stats) {
+        draw_arena_stats(state, font_atlas, 10, 50);
+    }
+    
+    // The gui is rebuilt every frame but mostly draws the same thing, only the vertices that differ
+    // from the last frame are marked
+    GuiResources* resources = &state->gui_resources;
+    mark_changed_elements(&resources->vertex_buffer.tracker, resources->uploaded_vertices, state->gui_state.vertex_buffer,
+                          sizeof(GuiVertex), state->gui_state.current_size);
+    if (!upload_dirty_buffer(&resources->vertex_buffer, state->frame_index, state->gui_state.vertex_buffer, state->gui_state.current_size)) {
+        return false;
+    }
+    resources->vertex_offset = get_dirty_copy_offset(&resources->vertex_buffer, state->frame_index);
+    
+    return true;
 }
 
-inline void update(RendererState* state, Input* input, Time* time) {
-    update_gui(state, input);
+// Steps timed by render(), printed with the memory reports
+#define RENDER_BENCHMARK_STEP_COUNT 5
+
+const char* render_benchmark_names[RENDER_BENCHMARK_STEP_COUNT] = {
+    "start", "command buffer reset", "recording", "submission", "presentation"
+};
+
+inline bool update(RendererState* state, Input* input, Time* time) {
+    if (!update_gui(state, input)) {
+        return false;
+    }
+    
     update_camera(state, input, time);
-    update_entities(state);
-    memcpy(state->camera_resources.allocations[state->image_index].data, &state->camera.context, sizeof(CameraContext));
+    
+    if (!update_entities(state)) {
+        return false;
+    }
+    
+    // Only rewritten when the camera or the light moved
+    CameraResources* camera_resources = &state->camera_resources;
+    mark_changed_elements(&camera_resources->buffer.tracker, &camera_resources->uploaded_context, &state->camera.context, sizeof(CameraContext), 1);
+    if (!upload_dirty_buffer(&camera_resources->buffer, state->frame_index, &state->camera.context, 1)) {
+        return false;
+    }
+    camera_resources->offset = (u32)get_dirty_copy_offset(&camera_resources->buffer, state->frame_index);
     
     if (input->button_just_pressed[GLFW_MOUSE_BUTTON_RIGHT]) {
         state->cursor_locked = !state->cursor_locked;
@@ -1462,28 +1692,219 @@ inline void update(RendererState* state, Input* input, Time* time) {
         state->temp_data.counter = 0;
         state->temp_data.updater = 1;
     }
+    
+    if (input->key_just_pressed[GLFW_KEY_M]) {
+        dump_memory_report(&state->memory_manager);
+        dump_arena_report(&state->arena_registry);
+        print_benchmark(&state->render_benchmark, render_benchmark_names, RENDER_BENCHMARK_STEP_COUNT);
+    }
+    
+    if (input->key_just_pressed[GLFW_KEY_F3]) {
+        state->temp_data.show_arena_stats = !state->temp_data.show_arena_stats;
+    }
+    
+    // Goes through inline recording, then 1 to the maximum number of recording threads
+    if (input->key_just_pressed[GLFW_KEY_F5]) {
+        state->temp_data.record_thread_count = (state->temp_data.record_thread_count + 1) % (state->command_recorder.thread_count + 1);
+        println("Entities recorded %s%u threads", state->temp_data.record_thread_count ? "on " : "inline, ", state->temp_data.record_thread_count);
+    }
+    
+    if (input->key_just_pressed[GLFW_KEY_F4] && state->selection.multi_draw_indirect_supported) {
+        state->temp_data.use_indirect_draws = !state->temp_data.use_indirect_draws;
+        println("Entities drawn with %s draws", state->temp_data.use_indirect_draws ? "indirect" : "direct");
+    }
+    
+    return true;
+}
+
+// Items are the indirect batches or the meshes, depending on the draw path
+inline u32 get_entity_draw_item_count(RendererState* state) {
+    if (state->temp_data.use_indirect_draws) {
+        return state->entity_resources.indirect_batch_count;
+    }
+    
+    return state->mesh_registry.mesh_count;
+}
+
+// Called from the recording threads, the renderer state is only read
+inline void record_entity_draws(VkCommandBuffer command_buffer, void* user_data, u32 first, u32 count) {
+    RendererState* state = (RendererState*)user_data;
+    
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->pipeline);
+    VkDeviceSize offset = 0;
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->pipeline_layout, 0, 1, &state->camera_resources.descriptor_set, 1, &state->camera_resources.offset);
+    
+    vkCmdBindDescriptorSets(command_buffer,
+                            VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            state->pipeline_layout,
+                            1, 1,
+                            &state->entity_resources.descriptor_set,
+                            0, nullptr);
+    
+    // The entity indices of this frame instances, firstInstance of every draw points inside them
+    vkCmdBindVertexBuffers(command_buffer, 1, 1, &state->frame_ring.buffer, &offset);
+    
+    BufferSuballocator* vertex_suballocator = &state->entity_resources.vertex_suballocator;
+    if (state->temp_data.use_indirect_draws) {
+        // The commands were written by update_entities(), one indirect draw per vertex block
+        EntityResources* resources = &state->entity_resources;
+        for (u32 i = first;i < first + count;++i) {
+            IndirectDrawBatch* batch = &resources->indirect_batches[i];
+            vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_suballocator->blocks[batch->block_index].buffer, &offset);
+            vkCmdDrawIndirect(command_buffer, state->frame_ring.buffer,
+                              resources->indirect_offset + batch->first_command * sizeof(VkDrawIndirectCommand),
+                              batch->command_count, sizeof(VkDrawIndirectCommand));
+        }
+    } else {
+        // One instanced draw per mesh, the vertex buffer is only bound again when the next mesh lives in another block
+        MeshRegistry* mesh_registry = &state->mesh_registry;
+        u32 bound_block_index = (u32)-1;
+        for (u32 i = first;i < first + count;++i) {
+            Mesh* mesh = &mesh_registry->meshes[i];
+            if (mesh->instance_count == 0) continue;
+            
+            if (mesh->vertex_range.block_index != bound_block_index) {
+                bound_block_index = mesh->vertex_range.block_index;
+                vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_suballocator->blocks[bound_block_index].buffer, &offset);
+            }
+            vkCmdDraw(command_buffer, mesh->vertex_count, mesh->instance_count, mesh->first_vertex,
+                      state->entity_resources.first_instance + mesh->first_instance);
+        }
+    }
+}
+
+inline void record_gui_draws(VkCommandBuffer command_buffer, void* user_data, u32 first, u32 count) {
+    RendererState* state = (RendererState*)user_data;
+    
+    // Bind the pipeline and the vertex buffer
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->gui_resources.pipeline);
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &state->gui_resources.vertex_buffer.buffer, &state->gui_resources.vertex_offset);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->gui_resources.pipeline_layout, 0, 1,
+                            &state->font_atlas_catalog.resources.descriptor_set, 0, nullptr);
+    vkCmdDraw(command_buffer, state->gui_state.current_size, 1, 0, 0);
+}
+
+inline bool init_frame_capture(RendererState* state) {
+    FrameCapture* capture = &state->frame_capture;
+    if (!(state->swapchain_usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+        println("Error: swapchain images can not be copied");
+        return false;
+    }
+    
+    // Swapchain formats all have 4 bytes per pixel
+    capture->size = (VkDeviceSize)state->swapchain_extent.width * state->swapchain_extent.height * 4;
+    
+    VkBufferCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_info.size = capture->size;
+    create_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    
+    VkResult result = vkCreateBuffer(state->device, &create_info, nullptr, &capture->buffer);
+    if (result != VK_SUCCESS) {
+        println("vkCreateBuffer returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    VkMemoryRequirements requirements = {};
+    vkGetBufferMemoryRequirements(state->device, capture->buffer, &requirements);
+    
+    VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    if (!allocate(&state->memory_manager, state->device, requirements, memory_flags, &capture->allocation, 0, MEMORY_TAG_STAGING)) {
+        vkDestroyBuffer(state->device, capture->buffer, nullptr);
+        capture->buffer = VK_NULL_HANDLE;
+        return false;
+    }
+    
+    result = vkBindBufferMemory(state->device, capture->buffer, capture->allocation.device_memory, capture->allocation.offset);
+    if (result != VK_SUCCESS) {
+        println("vkBindBufferMemory returned (%s)", vk_error_code_str(result));
+        return false;
+    }
+    
+    return true;
+}
+
+inline void destroy_frame_capture(RendererState* state, bool verbose = true) {
+    FrameCapture* capture = &state->frame_capture;
+    if (!capture->buffer) return;
+    
+    if (verbose) {
+        println("Destroying frame capture buffer (%p)", capture->buffer);
+    }
+    vkDestroyBuffer(state->device, capture->buffer, nullptr);
+    free(&state->memory_manager, &capture->allocation);
+    *capture = {};
+}
+
+// Recorded after the render pass, the image is handed back to the presentation in the layout it expects
+inline void record_frame_capture(RendererState* state, VkCommandBuffer command_buffer) {
+    VkImage image = state->swapchain_images[state->image_index];
+    
+    VkImageMemoryBarrier image_barrier = {};
+    image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    image_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    image_barrier.oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.image = image;
+    image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    image_barrier.subresourceRange.levelCount = 1;
+    image_barrier.subresourceRange.layerCount = 1;
+    
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         0, nullptr, 0, nullptr, 1, &image_barrier);
+    
+    VkBufferImageCopy region = {};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent = { state->swapchain_extent.width, state->swapchain_extent.height, 1 };
+    
+    vkCmdCopyImageToBuffer(command_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, state->frame_capture.buffer, 1, &region);
+    
+    image_barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    image_barrier.dstAccessMask = 0;
+    image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    
+    VkBufferMemoryBarrier buffer_barrier = {};
+    buffer_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    buffer_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    buffer_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.buffer = state->frame_capture.buffer;
+    buffer_barrier.size = VK_WHOLE_SIZE;
+    
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         0, nullptr, 1, &buffer_barrier, 1, &image_barrier);
 }
 
 inline VkResult render(RendererState* state) {
-    VkCommandBuffer command_buffer = {};
+    Benchmark* benchmark = &state->render_benchmark;
+    reset_benchmark(benchmark);
+    push_timestamp(benchmark);
     
-    VkCommandBufferAllocateInfo allocate_info = {};
-    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocate_info.commandPool = state->command_pool;
-    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocate_info.commandBufferCount = 1;
+    // The fence of the submission was waited on before the update, nothing is allocated in steady state
+    CommandBufferSubmission* submission = &state->submissions[state->frame_index];
+    VkCommandBuffer command_buffer = submission->command_buffer;
     
-    VkResult allocate_result = vkAllocateCommandBuffers(state->device, &allocate_info, &command_buffer);
-    if (allocate_result != VK_SUCCESS) {
-        println("vkAllocateCommandBuffers returned (%s)", vk_error_code_str(allocate_result));
-        return allocate_result;
+    VkResult result = vkResetCommandPool(state->device, submission->command_pool, 0);
+    if (result != VK_SUCCESS) {
+        println("vkResetCommandPool returned (%s)", vk_error_code_str(result));
+        return result;
     }
+    push_timestamp(benchmark);
     
     VkCommandBufferBeginInfo begin_info = {};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     
-    VkResult result = vkBeginCommandBuffer(command_buffer, &begin_info);
+    result = vkBeginCommandBuffer(command_buffer, &begin_info);
     if (result != VK_SUCCESS) {
         println("vkBeginCommandBuffer returned (%s)", vk_error_code_str(result));
         return result;
@@ -1502,61 +1923,69 @@ inline VkResult render(RendererState* state) {
     renderpass_begin_info.clearValueCount = array_size(clear_colors);
     renderpass_begin_info.pClearValues = clear_colors;
     
-    vkCmdBeginRenderPass(command_buffer, &renderpass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->pipeline);
-    VkDeviceSize offset = 0;
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->pipeline_layout, 0, 1, &state->camera_resources.descriptor_sets[state->image_index], 0, nullptr);
-    
-    // Draw entities
-    for (int i = 0;i < state->entity_count;++i) {
-        vkCmdBindDescriptorSets(command_buffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                state->pipeline_layout,
-                                1, 1,
-                                &state->entity_resources.descriptor_sets[state->image_index],
-                                1, &state->entities[i].offset);
-        vkCmdBindVertexBuffers(command_buffer, 0, 1, &state->entities[i].buffer, &offset);
-        vkCmdDraw(command_buffer, state->entities[i].size, 1, 0, 0);
+    // Secondary command buffers inherit the render pass, they are executed in order: entities then gui
+    u64 record_start = get_time_ns();
+    if (state->temp_data.record_thread_count == 0) {
+        vkCmdBeginRenderPass(command_buffer, &renderpass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+        record_entity_draws(command_buffer, state, 0, get_entity_draw_item_count(state));
+        record_gui_draws(command_buffer, state, 0, 1);
+    } else {
+        CommandRecorder* recorder = &state->command_recorder;
+        VkCommandBufferInheritanceInfo inheritance_info = {};
+        inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritance_info.renderPass = state->renderpass;
+        inheritance_info.subpass = 0;
+        inheritance_info.framebuffer = state->framebuffers[state->image_index];
+        
+        VkCommandBuffer secondary_command_buffers[MAX_RECORD_THREAD_COUNT + 1] = {};
+        u32 entity_command_buffer_count = 0;
+        u32 gui_command_buffer_count = 0;
+        if (!begin_record_slot(recorder, state->frame_index) ||
+            !record_secondary_command_buffers(recorder, &inheritance_info, record_entity_draws, state, get_entity_draw_item_count(state),
+                                              state->temp_data.record_thread_count, secondary_command_buffers, &entity_command_buffer_count) ||
+            !record_secondary_command_buffers(recorder, &inheritance_info, record_gui_draws, state, 1, 1,
+                                              secondary_command_buffers + entity_command_buffer_count, &gui_command_buffer_count)) {
+            vkEndCommandBuffer(command_buffer);
+            return VK_ERROR_INITIALIZATION_FAILED;
+        }
+        
+        vkCmdBeginRenderPass(command_buffer, &renderpass_begin_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        vkCmdExecuteCommands(command_buffer, entity_command_buffer_count + gui_command_buffer_count, secondary_command_buffers);
     }
-    
-    // Bind the pipeline and the vertex buffer
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->gui_resources.pipeline);
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, &state->gui_resources.buffers[state->image_index], &offset);
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, state->gui_resources.pipeline_layout, 0, 1,
-                            &state->font_atlas_catalog.resources.descriptor_set, 0, nullptr);
-    vkCmdDraw(command_buffer, state->gui_state.current_size, 1, 0, 0);
     vkCmdEndRenderPass(command_buffer);
+    state->temp_data.record_time = get_time_ns() - record_start;
+    
+    if (state->frame_capture.requested) {
+        record_frame_capture(state, command_buffer);
+        state->frame_capture.requested = false;
+    }
     vkEndCommandBuffer(command_buffer);
+    push_timestamp(benchmark);
     
     
     VkPipelineStageFlags stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
     VkSubmitInfo submit_info = {};
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submit_info.waitSemaphoreCount = 1;
-    submit_info.pWaitSemaphores = &state->acquire_semaphores[state->current_semaphore_index];
+    submit_info.pWaitSemaphores = &state->acquire_semaphores[state->frame_index];
     submit_info.pWaitDstStageMask = &stage;
     submit_info.commandBufferCount = 1;
     submit_info.pCommandBuffers = &command_buffer;
     submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = &state->present_semaphores[state->current_semaphore_index];
+    submit_info.pSignalSemaphores = &state->present_semaphores[state->image_index];
     
-    if (state->submissions[state->image_index].command_buffer) {
-        vkFreeCommandBuffers(state->device, state->command_pool, 1, &state->submissions[state->image_index].command_buffer);
-    }
-    
-    state->submissions[state->image_index].command_buffer = command_buffer;
-    
-    result = vkQueueSubmit(state->graphics_queue, 1, &submit_info, *state->submissions[state->image_index].fence);
+    result = vkQueueSubmit(state->graphics_queue, 1, &submit_info, *submission->fence);
     if (result != VK_SUCCESS) {
         println("vkQueueSubmit returned (%s)", vk_error_code_str(result));
         return result;
     }
+    push_timestamp(benchmark);
     
     VkResult present_result;
     VkPresentInfoKHR present_info = {};
     present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
     present_info.waitSemaphoreCount = 1;
-    present_info.pWaitSemaphores = &state->present_semaphores[state->current_semaphore_index];
+    present_info.pWaitSemaphores = &state->present_semaphores[state->image_index];
     present_info.swapchainCount = 1;
     present_info.pSwapchains = &state->swapchain;
     present_info.pImageIndices = &state->image_index;
@@ -1566,6 +1995,7 @@ inline VkResult render(RendererState* state) {
     if (result != VK_SUCCESS && result != VK_ERROR_OUT_OF_DATE_KHR){
         println("vkQueuePresentKHR returned (%s)", vk_error_code_str(result));
     }
+    push_timestamp(benchmark);
     
     return present_result;
 }
@@ -1579,22 +2009,34 @@ inline void do_frame(RendererState* state, WindowUserData* window_user_data, Tim
         return;
     }
     
-    VkResult acquire_result = vkAcquireNextImageKHR(state->device, state->swapchain, 0, state->acquire_semaphores[state->current_semaphore_index],
-                                                    state->acquire_fences[state->current_semaphore_index],
-                                                    &state->image_index);
+    if (!wait_for_frame_fence(state)) {
+        state->crashed = true;
+        return;
+    }
+    free_released_mesh_ranges(state, state->frame_index);
+    
+    // The GPU waits on the acquire semaphore, the CPU goes on with the frame without waiting for the image
+    VkResult acquire_result = vkAcquireNextImageKHR(state->device, state->swapchain, UINT64_MAX,
+                                                    state->acquire_semaphores[state->frame_index],
+                                                    VK_NULL_HANDLE, &state->image_index);
     if (acquire_result == VK_ERROR_OUT_OF_DATE_KHR) {
         window_user_data->swapchain_need_recreation = true;
         return;
-    } else if (acquire_result != VK_SUCCESS) {
+    } else if (acquire_result != VK_SUCCESS && acquire_result != VK_SUBOPTIMAL_KHR) {
         println("vkAcquireNextImageKHR returned (%s)", vk_error_code_str(acquire_result));
         state->crashed = true;
+        return;
     }
     
-    if (!wait_for_acquire_fence(state)) {
+    if (!wait_for_image_fence(state)) {
         state->crashed = true;
         return;
     }
-    if (!wait_for_submit_fence(state)) {
+    
+    // Everything written in the frame ring by the last use of this frame in flight can now be reused
+    begin_frame_ring(&state->frame_ring, state->frame_index);
+    
+    if (!update_defragmenter(&state->defragmenter, state, DEFRAG_FRAME_BUDGET_NS)) {
         state->crashed = true;
         return;
     }
@@ -1611,44 +2053,29 @@ inline void do_frame(RendererState* state, WindowUserData* window_user_data, Tim
 #endif
     
     do_input(state, window_user_data->input);
-    update(state, window_user_data->input, time);
+    if (!update(state, window_user_data->input, time)) {
+        state->crashed = true;
+        return;
+    }
     
     
     VkResult render_result = render(state);
-    if (render_result == VK_ERROR_OUT_OF_DATE_KHR) {
+    if (render_result == VK_ERROR_OUT_OF_DATE_KHR || render_result == VK_SUBOPTIMAL_KHR) {
         window_user_data->swapchain_need_recreation = true;
     } else if (render_result != VK_SUCCESS) {
         state->crashed = true;
     }
     
-    state->current_semaphore_index = (state->current_semaphore_index + 1) % state->swapchain_image_count;
+    state->frame_index = (state->frame_index + 1) % state->frames_in_flight;
 }
 
 inline void destroy_camera(RendererState* state, bool verbose = true) {
     if (verbose) {
         println("Destroying camera");
     }
-    if (state->camera_resources.buffers) {
-        for (int i = 0;i < state->swapchain_image_count;i++) {
-            if (verbose) {
-                println("    Destroying camera data buffer (%p)", state->camera_resources.buffers[i]);
-            }
-            vkDestroyBuffer(state->device, state->camera_resources.buffers[i], nullptr);
-        }
-        
-        free_null(state->camera_resources.buffers);
-    }
-    
-    if (state->camera_resources.allocations) {
-        for (int i = 0;i < state->swapchain_image_count;i++) {
-            free(&state->memory_manager, &state->camera_resources.allocations[i]);
-        }
-        free_null(state->camera_resources.allocations);
-    }
-    
-    if (state->camera_resources.descriptor_sets) {
-        free_null(state->camera_resources.descriptor_sets);
-    }
+    // The descriptor set is released with the descriptor pool
+    state->camera_resources.descriptor_set = 0;
+    destroy_dirty_buffer(&state->camera_resources.buffer, &state->memory_manager, state->device, verbose);
     if (verbose) {
         println("");
     }
@@ -1658,28 +2085,9 @@ inline void destroy_entity_resources(RendererState* state, bool verbose = true)
     if (verbose) {
         println("Destroying entity resources");
     }
-    if (state->entity_resources.buffers) {
-        for (int i = 0;i < state->swapchain_image_count;++i) {
-            if (verbose) {
-                println("    Destroying entity buffer (%p)", state->entity_resources.buffers[i]);
-            }
-            vkDestroyBuffer(state->device, state->entity_resources.buffers[i], nullptr);
-        }
-        
-        free_null(state->entity_resources.buffers);
-    }
-    
-    if (state->entity_resources.allocations) {
-        for (int i = 0;i < state->swapchain_image_count;++i) {
-            free(&state->memory_manager, &state->entity_resources.allocations[i]);
-        }
-        
-        free_null(state->entity_resources.allocations);
-    }
-    
-    if (state->entity_resources.descriptor_sets) {
-        free_null(state->entity_resources.descriptor_sets);
-    }
+    // The descriptor set is released with the descriptor pool
+    state->entity_resources.descriptor_set = 0;
+    destroy_dirty_buffer(&state->entity_resources.transform_buffer, &state->memory_manager, state->device, verbose);
     if (verbose) {
         println("");
     }
@@ -1689,29 +2097,44 @@ inline void destroy_entities(RendererState* state, bool verbose = true) {
     if (verbose) {
         println("Destroying entities");
     }
-    for (int i = 0;i < state->entity_count;++i) {
+    for (u32 i = 0;i < state->entity_store.count;++i) {
         if (verbose) {
-            println("    Destroying entity %d", i);
+            println("    Destroying entity %u", i);
         }
-        vkDestroyBuffer(state->device, state->entities[i].buffer, nullptr);
-        free(&state->memory_manager, &state->entities[i].allocation);
+        release_entity_mesh(state, state->entity_store.meshes[i]);
     }
     if (verbose) {
         println("");
     }
+    
+    // cleanup() waited for the fences of every frame in flight
+    for (u32 i = 0;i < MAX_FRAMES_IN_FLIGHT;++i) {
+        free_released_mesh_ranges(state, i);
+        free_null(state->entity_resources.released_ranges[i]);
+        state->entity_resources.released_range_capacity[i] = 0;
+    }
+    
+    // Meshes went with their last entity, the registry frees anything left behind
+    destroy_entity_store(&state->entity_store, verbose);
+    destroy_mesh_registry(&state->mesh_registry, &state->entity_resources.vertex_suballocator, verbose);
+    destroy_buffer_suballocator(&state->entity_resources.vertex_suballocator, &state->memory_manager, state->device, verbose);
 }
 
 inline void cleanup(RendererState* state) {
     if (state->submit_fences) {
-        for (int i = 0;i < state->swapchain_image_count;++i) {
+        for (int i = 0;i < state->frames_in_flight;++i) {
             vkWaitForFences(state->device, 1, &state->submit_fences[i], VK_TRUE, 1000000000);
         }
     }
     
+    dump_arena_report(&state->arena_registry);
+    
     u64 start = get_time_ns();
     destroy_window(state, true);
     glfwTerminate();
     
+    // Pending moves are finalized first so that entities destroy their current buffers
+    destroy_defragmenter(&state->defragmenter, state, true);
     destroy_entities(state, true);
     destroy_entity_resources(state, true);
     destroy_camera(state, true);
@@ -1728,13 +2151,16 @@ inline void cleanup(RendererState* state) {
     destroy_descriptor_pool(state, true);
     destroy_pipeline_layout(state, true);
     cleanup_shader_catalog(state->device, &state->shader_catalog, true);
-    destroy_command_pool(state, true);
+    destroy_command_recorder(&state->command_recorder, true);
+    destroy_command_pools(state, true);
     destroy_fences(state, true);
     destroy_submissions(state, true);
     destroy_semaphores(state, true);
     destroy_depth_images(state, true);
     destroy_swapchain_image_views(state, true);
     destroy_swapchain(state, true);
+    destroy_frame_ring_allocator(&state->frame_ring, &state->memory_manager, state->device, true);
+    destroy_frame_capture(state, true);
     cleanup_memory(&state->memory_manager, state->device, true);
     
     destroy_device(state, true);
@@ -1747,12 +2173,138 @@ inline void cleanup(RendererState* state) {
     println("Clean up done in %f s", (f64)(end - start) / (f64)(1e9));
 }
 
-int main() {
+#define RECORD_BENCHMARK_WARMUP_FRAME_COUNT 30
+#define RECORD_BENCHMARK_FRAME_COUNT 300
+
+// Renders the same still frame with every number of recording threads and prints the average
+// recording time. The last frame of each run is read back, its checksum must match the one of the
+// inline recording.
+inline bool run_record_benchmark(RendererState* state, WindowUserData* window_user_data, Time* time) {
+    if (!init_frame_capture(state)) {
+        return false;
+    }
+    
+    state->temp_data.rotation_speed = 0;
+    
+    u64 inline_checksum = 0;
+    bool succeeded = true;
+    for (u32 thread_count = 0;thread_count <= state->command_recorder.thread_count;++thread_count) {
+        state->temp_data.record_thread_count = thread_count;
+        
+        u64 cumulated_record_time = 0;
+        u32 frame_count = RECORD_BENCHMARK_WARMUP_FRAME_COUNT + RECORD_BENCHMARK_FRAME_COUNT;
+        for (u32 i = 0;i < frame_count && !state->crashed;++i) {
+            state->frame_capture.requested = i == frame_count - 1;
+            do_frame(state, window_user_data, time);
+            if (i >= RECORD_BENCHMARK_WARMUP_FRAME_COUNT) {
+                cumulated_record_time += state->temp_data.record_time;
+            }
+        }
+        
+        // The copy is recorded with the frame, a frame that was skipped leaves the request pending
+        if (state->crashed || state->frame_capture.requested) {
+            println("Error: the last frame of the record benchmark was not rendered");
+            succeeded = false;
+            break;
+        }
+        
+        VkResult result = vkQueueWaitIdle(state->graphics_queue);
+        if (result != VK_SUCCESS) {
+            println("vkQueueWaitIdle returned (%s)", vk_error_code_str(result));
+            succeeded = false;
+            break;
+        }
+        
+        u64 checksum = hash((u8*)state->frame_capture.allocation.data, (u32)state->frame_capture.size);
+        if (thread_count == 0) {
+            inline_checksum = checksum;
+        }
+        
+        bool matches = checksum == inline_checksum;
+        succeeded = succeeded && matches;
+        println("Recording on %u threads: %.3f ms per frame, checksum %016lx%s", thread_count,
+                (f64)cumulated_record_time / RECORD_BENCHMARK_FRAME_COUNT / 1000000.0, checksum,
+                matches ? "" : " (differs from the inline recording)");
+    }
+    
+    destroy_frame_capture(state);
+    return succeeded;
+}
+
+#define FRAME_TIME_BENCHMARK_WARMUP_FRAME_COUNT 60
+#define FRAME_TIME_BENCHMARK_FRAME_COUNT 1000
+
+// Runs the normal frame loop and prints the distribution of the frame times. Compare runs made with
+// different --frames-in-flight values, 1 being the fully serialized CPU and GPU.
+inline bool run_frame_time_benchmark(RendererState* state, WindowUserData* window_user_data, Time* time) {
+    u64* frame_times = (u64*)calloc(FRAME_TIME_BENCHMARK_FRAME_COUNT, sizeof(u64));
+    
+    u32 frame_count = FRAME_TIME_BENCHMARK_WARMUP_FRAME_COUNT + FRAME_TIME_BENCHMARK_FRAME_COUNT;
+    u64 start = get_time_ns();
+    for (u32 i = 0;i < frame_count && !state->crashed;++i) {
+        do_frame(state, window_user_data, time);
+        
+        u64 end = get_time_ns();
+        if (i >= FRAME_TIME_BENCHMARK_WARMUP_FRAME_COUNT) {
+            frame_times[i - FRAME_TIME_BENCHMARK_WARMUP_FRAME_COUNT] = end - start;
+        }
+        start = end;
+    }
+    
+    if (state->crashed) {
+        println("Error: the frame time benchmark did not complete");
+        free(frame_times);
+        return false;
+    }
+    
+    f64 sum = 0;
+    u64 min_time = UINT64_MAX;
+    u64 max_time = 0;
+    for (u32 i = 0;i < FRAME_TIME_BENCHMARK_FRAME_COUNT;++i) {
+        sum += (f64)frame_times[i];
+        if (frame_times[i] < min_time) min_time = frame_times[i];
+        if (frame_times[i] > max_time) max_time = frame_times[i];
+    }
+    f64 mean = sum / FRAME_TIME_BENCHMARK_FRAME_COUNT;
+    
+    f64 squared_deviation_sum = 0;
+    for (u32 i = 0;i < FRAME_TIME_BENCHMARK_FRAME_COUNT;++i) {
+        f64 deviation = (f64)frame_times[i] - mean;
+        squared_deviation_sum += deviation * deviation;
+    }
+    f64 deviation = sqrt(squared_deviation_sum / FRAME_TIME_BENCHMARK_FRAME_COUNT);
+    
+    println("%u frames in flight, %u swapchain images: %.3f ms per frame, standard deviation %.3f ms, min %.3f ms, max %.3f ms",
+            state->frames_in_flight, state->swapchain_image_count, mean / 1000000.0, deviation / 1000000.0,
+            (f64)min_time / 1000000.0, (f64)max_time / 1000000.0);
+    
+    free(frame_times);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bool record_benchmark = false;
+    bool frame_time_benchmark = false;
+    
     WindowUserData window_user_data = {};
     Input input = {};
     window_user_data.input = &input;
     
     RendererState state = {};
+    state.frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT;
+    
+    for (int i = 1;i < argc;++i) {
+        if (strcmp(argv[i], "--record-benchmark") == 0) {
+            record_benchmark = true;
+        } else if (strcmp(argv[i], "--frame-time-benchmark") == 0) {
+            frame_time_benchmark = true;
+        } else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+            state.frames_in_flight = (u32)atoi(argv[++i]);
+        } else {
+            println("Error: unknown argument %s", argv[i]);
+            return -1;
+        }
+    }
     
     if (!init(&state, &window_user_data)) {
         cleanup(&state);
@@ -1764,10 +2316,23 @@ int main() {
     time.start = get_time_ns();
     fps_counter.start = get_time_ns();
     
+    if (record_benchmark) {
+        bool succeeded = run_record_benchmark(&state, &window_user_data, &time);
+        cleanup(&state);
+        return succeeded ? 0 : -1;
+    }
+    
+    if (frame_time_benchmark) {
+        bool succeeded = run_frame_time_benchmark(&state, &window_user_data, &time);
+        cleanup(&state);
+        return succeeded ? 0 : -1;
+    }
+    
     while (!glfwWindowShouldClose(state.window) && !state.crashed) {
         do_frame(&state, &window_user_data, &time);
         
         update_fps_counter(&state, state.window, &fps_counter);
+        record_arena_stats(&state.arena_registry);
     }
     
     cleanup(&state);